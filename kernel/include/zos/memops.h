@@ -0,0 +1,36 @@
+// memops.h
+#pragma once
+
+/**
+ * Memory and string primitives (memcpy, memmove, memset, memcmp and strlen)
+ * shared by the kernel and libc. They are implemented in
+ * kernel/src/common/memops.S and pick their strategy from the CPU features
+ * detected by memops_init.
+ */
+
+// Enhanced REP MOVSB/STOSB
+#define MEMOPS_ERMS (1 << 0)
+// Fast short REP MOVSB
+#define MEMOPS_FSRM (1 << 1)
+
+// Copies and fills of at least this many bytes use rep movsb/stosb when the
+// CPU has ERMS. Smaller ones go through SSE2 (or FSRM for copies) in libc,
+// which assembles memops.S with MEMOPS_SSE2, and through general purpose
+// registers in the kernel.
+#define MEMOPS_REP_THRESHOLD 512
+
+#ifndef __ASSEMBLER__
+#include <stdint.h>
+
+/**
+ * MEMOPS_* bits detected by memops_init. Zero until it is called, which
+ * selects the SSE2 (or general purpose register) paths only.
+ */
+extern uint32_t memops_features;
+
+/**
+ * Detects the CPU features used by the memory primitives. Must be called
+ * once at startup of each image (kernel and user programs).
+ */
+void memops_init(void);
+#endif
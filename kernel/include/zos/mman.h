@@ -0,0 +1,34 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+// These values are just like Linux.
+#define PROT_NONE  0x0
+#define PROT_READ  0x1
+#define PROT_WRITE 0x2
+#define PROT_EXEC  0x4
+
+#define MAP_SHARED    0x01
+#define MAP_PRIVATE   0x02
+#define MAP_FIXED     0x10
+#define MAP_ANONYMOUS 0x20
+
+#define MAP_FAILED ((void *)-1)
+
+/**
+ * Arguments of the mmap syscall. Syscalls only take three registers, so
+ * mmap takes a pointer to this instead.
+ */
+struct mmap_args {
+  // Where to put the mapping. A hint unless MAP_FIXED is given.
+  void *addr;
+  size_t length;
+  // PROT_ flags
+  int prot;
+  // Exactly one of MAP_SHARED and MAP_PRIVATE, plus other MAP_ flags
+  int flags;
+  // The file to map. Ignored with MAP_ANONYMOUS.
+  int fd;
+  // Offset of the mapping in the file. Must be page aligned.
+  int64_t offset;
+};
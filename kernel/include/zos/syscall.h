@@ -2,6 +2,7 @@
 #pragma once
 
 #include "sysnum.h"
+#include "mman.h"
 #include <stdint.h>
 #include <stddef.h>
 #include "fs/fs.h"
@@ -15,4 +15,8 @@
 #define SYSCALL_UNLINK  13
 #define SYSCALL_MKDIR   14
 #define SYSCALL_CHDIR   15
-#define SYSCALL_READDIR 16
\ No newline at end of file
+#define SYSCALL_READDIR 16
+#define SYSCALL_FORK    17
+#define SYSCALL_MMAP    18
+#define SYSCALL_MUNMAP  19
+#define SYSCALL_MPROTECT 20
\ No newline at end of file
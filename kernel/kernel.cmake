@@ -8,9 +8,16 @@ target_compile_options(kernel_objs_c PRIVATE
     -nostdlib
     -mcmodel=kernel 
     -mno-red-zone 
+    -mgeneral-regs-only
     -Wc23-extensions
 )
 set_optimizations(kernel_objs_c)
+if(DZOS_BOOT_BENCHMARKS)
+    target_compile_definitions(kernel_objs_c PRIVATE DZOS_BOOT_BENCHMARKS)
+endif()
+if(DZOS_LAZY_FPU)
+    target_compile_definitions(kernel_objs_c PRIVATE DZOS_LAZY_FPU)
+endif()
 target_include_directories(kernel_objs_c PRIVATE ${DZOS_KERNEL_DIR} ${DZOS_KERNEL_INC_DIR} ${DZOS_KERNEL_SRC_DIR} ${DZOS_XXD_DIR} ${flanterm_SOURCE_DIR}/src)
 
 add_library(kernel_objs_s OBJECT ${KERNEL_ASM_SOURCES})
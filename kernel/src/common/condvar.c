@@ -40,10 +40,23 @@ void condvar_wait(struct condvar *cond) {
    * process's lock.
    */
   condvar_lock(&proc->lock);
+
+  // Queue up before letting go of cond.lock so no notify is missed. A
+  // notifier which dequeues us waits for proc.lock, which we hold until
+  // we are off the core and asleep.
+  struct wait_entry entry = {.next = NULL, .proc = proc};
+  spinlock_lock(&cond->wait_lock);
+  if (cond->wait_tail != NULL)
+    cond->wait_tail->next = &entry;
+  else
+    cond->wait_head = &entry;
+  cond->wait_tail = &entry;
+  spinlock_unlock(&cond->wait_lock);
+
   condvar_unlock(cond);
 
   // Put the process to sleep and dequeue it from runqueue
-  sched_sleep(proc, &cond->lock);
+  sched_sleep(proc, cond);
   // Switch back to the scheduler
   scheduler_switch_back(0);
 
@@ -52,6 +65,38 @@ void condvar_wait(struct condvar *cond) {
   condvar_lock(cond);
 }
 
+/**
+ * Dequeues the oldest waiter of cond, or all of them, and wakes them up.
+ * Costs nothing more than the waiters themselves.
+ */
+static void condvar_wake(struct condvar *cond, bool everyone) {
+  spinlock_lock(&cond->wait_lock);
+  struct wait_entry *entry = cond->wait_head;
+  if (entry != NULL) {
+    if (everyone) {
+      cond->wait_head = NULL;
+      cond->wait_tail = NULL;
+    } else {
+      cond->wait_head = entry->next;
+      if (cond->wait_head == NULL)
+        cond->wait_tail = NULL;
+      entry->next = NULL;
+    }
+  }
+  spinlock_unlock(&cond->wait_lock);
+
+  while (entry != NULL) {
+    // The entry is on the stack of the waiter, which may return as soon
+    // as it is woken up
+    struct wait_entry *next = entry->next;
+    struct process *proc = entry->proc;
+    condvar_lock(&proc->lock);
+    sched_wakeup(proc);
+    condvar_unlock(&proc->lock);
+    entry = next;
+  }
+}
+
 /**
  * Wake up one process (if there is any) which is waiting on this condvar.
  * Might be known as signal in other languages.
@@ -59,7 +104,7 @@ void condvar_wait(struct condvar *cond) {
  * It is allowed but not required for the caller to hold cond.lock during the
  * call.
  */
-void condvar_notify(struct condvar *cond) { proc_wakeup(&cond->lock, false); }
+void condvar_notify(struct condvar *cond) { condvar_wake(cond, false); }
 
 /**
  * Wakes up all process (if there is any) which are waiting on this condvar.
@@ -68,6 +113,4 @@ void condvar_notify(struct condvar *cond) { proc_wakeup(&cond->lock, false); }
  * It is allowed but not required for the caller to hold cond.lock during the
  * call.
  */
-void condvar_notify_all(struct condvar *cond) {
-  proc_wakeup(&cond->lock, true);
-}
+void condvar_notify_all(struct condvar *cond) { condvar_wake(cond, true); }
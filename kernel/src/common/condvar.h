@@ -14,12 +14,29 @@
  * https://en.cppreference.com/w/cpp/thread/condition_variable
  * https://linux.die.net/man/3/pthread_cond_wait
  */
+struct process;
+
+/**
+ * A process waiting on a condvar. The entry lives on the kernel stack of
+ * the waiter for as long as it is queued.
+ */
+struct wait_entry {
+    struct wait_entry *next;
+    struct process *proc;
+};
+
 struct condvar {
     // As said, we handle the spinlock internally.
     // You should hold the lock before using wait.
     // You can use however notify or notify_all if you are not
     // holding this lock.
     struct spinlock lock;
+    // Guards the wait queue. It is separate from lock because notify may
+    // be called with or without lock held.
+    struct spinlock wait_lock;
+    // Waiting processes, oldest first. A zeroed condvar has none.
+    struct wait_entry *wait_head;
+    struct wait_entry *wait_tail;
 };
 
 void condvar_lock(struct condvar *cond);
@@ -1,20 +1,16 @@
 #include "common/lib.h"
-
-// GCC and Clang reserve the right to generate calls to the following
-// 4 functions even if they are not directly called.
-// Implement them as the C specification mandates.
-// DO NOT remove or rename these functions, or stuff will eventually break!
-// They CAN be moved to a different .c file.
-void *memcpy(void *dest, const void *src, size_t n) {
-  uint8_t *pdest = (uint8_t *)dest;
-  const uint8_t *psrc = (const uint8_t *)src;
-
-  for (size_t i = 0; i < n; i++) {
-    pdest[i] = psrc[i];
-  }
-
-  return dest;
-}
+#include "cpu/fpu.h"
+#include "zos/memops.h"
+#ifdef DZOS_BOOT_BENCHMARKS
+#include "common/printf.h"
+#include "cpu/asm.h"
+#include "device/rtc.h"
+#include "mem/mem.h"
+#endif
+
+// memcpy, memmove, memset, memcmp and strlen live in common/memops.S and are
+// shared with libc. GCC and Clang reserve the right to generate calls to the
+// first four even if they are not directly called.
 
 #define MEMSET_SRC(TYPE) void memset_##TYPE(void* ptr, TYPE val, size_t len) {\
   TYPE* tptr = (TYPE*)ptr;\
@@ -47,40 +43,6 @@ MEMSET_SRC(int16_t)
 MEMSET_SRC(int32_t)
 MEMSET_SRC(int64_t)
 
-void memset(void* buf, int64_t val, size_t len) {
-  return memset_int8_t(buf, val, len);
-}
-
-void *memmove(void *dest, const void *src, size_t n) {
-  uint8_t *pdest = (uint8_t *)dest;
-  const uint8_t *psrc = (const uint8_t *)src;
-
-  if (src > dest) {
-    for (size_t i = 0; i < n; i++) {
-      pdest[i] = psrc[i];
-    }
-  } else if (src < dest) {
-    for (size_t i = n; i > 0; i--) {
-      pdest[i - 1] = psrc[i - 1];
-    }
-  }
-
-  return dest;
-}
-
-int memcmp(const void *s1, const void *s2, size_t n) {
-  const uint8_t *p1 = (const uint8_t *)s1;
-  const uint8_t *p2 = (const uint8_t *)s2;
-
-  for (size_t i = 0; i < n; i++) {
-    if (p1[i] != p2[i]) {
-      return p1[i] < p2[i] ? -1 : 1;
-    }
-  }
-
-  return 0;
-}
-
 char *strcpy(char *s, const char *t) {
   char *os = s;
   while ((*s++ = *t++) != 0)
@@ -106,11 +68,117 @@ int strncmp(const char *s1, const char *s2, size_t n) {
   return (0);
 }
 
+void *memcpy_fpu(void *dest, const void *src, size_t n)
+{
+	// Saving the user FPU state only pays off when rep movsb is slow
+	if ((memops_features & MEMOPS_ERMS) && n >= MEMOPS_REP_THRESHOLD)
+		return memcpy(dest, src, n);
+	kernel_fpu_begin();
+	memcpy_sse(dest, src, n);
+	kernel_fpu_end();
+	return dest;
+}
 
-size_t strlen(const char *s) {
-  size_t n;
+#ifdef DZOS_BOOT_BENCHMARKS
+#define MEMOPS_BENCH_PAGES 256
+#define MEMOPS_BENCH_BYTES (16ull * 1024 * 1024)
+
+/**
+ * Naive byte loop used as the baseline. The volatile destination keeps the
+ * compiler from turning it back into a memcpy call.
+ */
+static void bench_byte_copy(void *dest, const void *src, size_t n)
+{
+	volatile uint8_t *d = dest;
+	const uint8_t *s = src;
+	for (size_t i = 0; i < n; i++)
+		d[i] = s[i];
+}
 
-  for (n = 0; s[n]; n++)
-    ;
-  return n;
-}
\ No newline at end of file
+/**
+ * Returns the throughput in MB/s of moving len bytes in a loop of rounds
+ * iterations which took cycles TSC ticks.
+ */
+static uint64_t bench_mbps(uint64_t len, uint64_t rounds, uint64_t cycles, uint64_t tsc_hz)
+{
+	if (cycles == 0 || tsc_hz == 0)
+		return 0;
+	return len * rounds * (tsc_hz / 1000000) / cycles;
+}
+
+void memops_bench(void)
+{
+	static const size_t sizes[] = {8, 64, 512, 4096, 64 * 1024, 1024 * 1024};
+	const uint64_t tsc_hz = rtc_tsc_frequency();
+	uint8_t *a = kalloc_pages(MEMOPS_BENCH_PAGES);
+	uint8_t *b = kalloc_pages(MEMOPS_BENCH_PAGES);
+	if (a == NULL || b == NULL)
+		panic("memops_bench: OOM");
+	memset(a, 'a', MEMOPS_BENCH_PAGES * PAGE_SIZE);
+	memset(b, 'a', MEMOPS_BENCH_PAGES * PAGE_SIZE);
+	a[MEMOPS_BENCH_PAGES * PAGE_SIZE - 1] = '\0';
+	b[MEMOPS_BENCH_PAGES * PAGE_SIZE - 1] = '\0';
+
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+	{
+		const size_t len = sizes[i];
+		const uint64_t rounds = MEMOPS_BENCH_BYTES / len;
+		volatile uint64_t sink = 0;
+		uint64_t start, c_byte, c_cpy, c_sse, c_move, c_set, c_cmp, c_len;
+
+		start = get_tsc();
+		for (uint64_t r = 0; r < rounds; r++)
+			bench_byte_copy(b, a, len);
+		c_byte = get_tsc() - start;
+
+		start = get_tsc();
+		for (uint64_t r = 0; r < rounds; r++)
+			memcpy(b, a, len);
+		c_cpy = get_tsc() - start;
+
+		kernel_fpu_begin();
+		start = get_tsc();
+		for (uint64_t r = 0; r < rounds; r++)
+			memcpy_sse(b, a, len);
+		c_sse = get_tsc() - start;
+		kernel_fpu_end();
+
+		// Overlapping by one byte in both directions
+		start = get_tsc();
+		for (uint64_t r = 0; r < rounds; r++)
+			memmove(b + (r & 1), b + !(r & 1), len - 1);
+		c_move = get_tsc() - start;
+
+		start = get_tsc();
+		for (uint64_t r = 0; r < rounds; r++)
+			memset(b, (int)r, len);
+		c_set = get_tsc() - start;
+
+		memcpy(b, a, len);
+		start = get_tsc();
+		for (uint64_t r = 0; r < rounds; r++)
+			sink += memcmp(a, b, len);
+		c_cmp = get_tsc() - start;
+
+		// Terminate the string at len - 1 so strlen scans len bytes
+		a[len - 1] = '\0';
+		start = get_tsc();
+		for (uint64_t r = 0; r < rounds; r++)
+			sink += strlen((const char *)a);
+		c_len = get_tsc() - start;
+		a[len - 1] = 'a';
+		(void)sink;
+
+		ktprintf("[bench] memops %llu B (MB/s): byte loop %llu, memcpy %llu, memcpy_sse %llu, memmove %llu, "
+		         "memset %llu, memcmp %llu, strlen %llu\n",
+		         (unsigned long long)len, bench_mbps(len, rounds, c_byte, tsc_hz),
+		         bench_mbps(len, rounds, c_cpy, tsc_hz), bench_mbps(len, rounds, c_sse, tsc_hz),
+		         bench_mbps(len, rounds, c_move, tsc_hz),
+		         bench_mbps(len, rounds, c_set, tsc_hz), bench_mbps(len, rounds, c_cmp, tsc_hz),
+		         bench_mbps(len, rounds, c_len, tsc_hz));
+	}
+
+	kfree_pages(a, MEMOPS_BENCH_PAGES);
+	kfree_pages(b, MEMOPS_BENCH_PAGES);
+}
+#endif
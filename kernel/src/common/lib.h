@@ -26,11 +26,26 @@ MEMSET_HEADER(int16_t);
 MEMSET_HEADER(int32_t);
 MEMSET_HEADER(int64_t);
 
-void memset(void* buf, int64_t val, size_t len);
+void *memset(void *buf, int val, size_t len);
 
 void *memmove(void *dest, const void *src, size_t n);
 int memcmp(const void *s1, const void *s2, size_t n);
 char *strcpy(char *s, const char *t);
 int strcmp(const char *p, const char *q);
 int strncmp(const char *s1, const char *s2, size_t n);
-size_t strlen(const char *s);
\ No newline at end of file
+size_t strlen(const char *s);
+
+/**
+ * The SSE2 block copy of memcpy. The kernel is built without SIMD, so this
+ * may only run between kernel_fpu_begin and kernel_fpu_end.
+ */
+void *memcpy_sse(void *dest, const void *src, size_t n);
+/**
+ * memcpy for large copies, done in SSE2 inside an FPU region unless rep
+ * movsb is as fast
+ */
+void *memcpy_fpu(void *dest, const void *src, size_t n);
+
+#ifdef DZOS_BOOT_BENCHMARKS
+void memops_bench(void);
+#endif
@@ -126,25 +126,26 @@ void kprintptr(uint64_t x)
     kprints(COLOR_RESET);
 }
 
-double first_print_now = 0.0;
-
-void kprintfloat(double f, int precision)
+/* rtc_now() of the first timestamped print */
+uint64_t first_print_now = 0;
+
+/**
+ * Prints value / unit with precision decimals, in integers only as the
+ * kernel is built without the FPU
+ */
+void kprintfixed(uint64_t value, uint64_t unit, int precision)
 {
-  if (f < 0)
-  { kputc('-'); f = -f; }
-  uint64_t int_part = (uint64_t)f;
-  double frac_part = f - (double)int_part;
-  kprintint(int_part, 10, 0);
+  kprintint(value / unit, 10, 0);
 
   if (print_colored)
     kprints(c_time_print ? COLOR_BRIGHT_YELLOW_FG : COLOR_MAGENTA_FG);
   kputc('.');
+  uint64_t frac_part = value % unit;
   for (int i = 0; i < precision; i++)
   {
-    frac_part *= 10.0;
-    int digit = (int)frac_part;
-    kputc('0' + digit);
-    frac_part -= digit;
+    frac_part *= 10;
+    kputc('0' + frac_part / unit);
+    frac_part %= unit;
   }
 
   if (print_colored)
@@ -247,17 +248,10 @@ int cprintptr(char* dest, int* rem, uint64_t x)
   return len;
 }
 
-int cprintfloat(char* dest, int* rem, double f, int precision)
+int cprintfixed(char* dest, int* rem, uint64_t value, uint64_t unit, int precision)
 {
   int len = 0;
-  if (f < 0)
-  {
-    len += cputc(dest++, rem, '-');
-    f = -f;
-  }
-  uint64_t int_part = (uint64_t)f;
-  double frac_part = f - (double)int_part;
-  int tlen = cprintint(dest, rem, int_part, 10, 0);
+  int tlen = cprintint(dest, rem, value / unit, 10, 0);
   dest += tlen;
   len += tlen;
 
@@ -267,12 +261,12 @@ int cprintfloat(char* dest, int* rem, double f, int precision)
     len += tlen;
   }
   len += cputc(dest++, rem, '.');
+  uint64_t frac_part = value % unit;
   for (int i = 0; i < precision; i++)
   {
-    frac_part *= 10.0;
-    int digit = (int)frac_part;
-    len += cputc(dest++, rem, '0' + digit);
-    frac_part -= digit;
+    frac_part *= 10;
+    len += cputc(dest++, rem, '0' + frac_part / unit);
+    frac_part %= unit;
   }
   if (print_colored) {
     tlen = cprintf(dest, rem, COLOR_RESET);
@@ -387,17 +381,6 @@ int kvprintf(const char *fmt, va_list ap)
           s = va_arg(ap, char *);
           kprints(s);
         }
-        else if (c0 == 'f')
-        {
-          double f = va_arg(ap, double);
-          kprintfloat(f, 6);
-        }
-        else if (c0 == 'l' && c1 == 'f')
-        {
-          double f = va_arg(ap, double);
-          kprintfloat(f, 6);
-          i += 1;
-        }
         else if (c0 == '%')
           kputc('%');
         else if (c0 == 0)
@@ -532,21 +515,6 @@ int cvprintf(char* dest, int* rem, const char *fmt, va_list ap)
             for (; *s; s++)
               len += cputc(dest++, rem, *s);
         }
-        else if (c0 == 'f')
-        {
-          double f = va_arg(ap, double);
-          int tlen = cprintfloat(dest, rem, f, 6);
-          dest += tlen;
-          len += tlen;
-        }
-        else if (c0 == 'l' && c1 == 'f')
-        {
-          double f = va_arg(ap, double);
-          int tlen = cprintfloat(dest, rem, f, 6);
-          dest += tlen;
-          len += tlen;
-          i += 1;
-        }
         else if (c0 == '%') len += cputc(dest++, rem, '%');
         else if (c0 == 0) break;
         else
@@ -600,14 +568,15 @@ int snprintf(char* dest, int dest_len, const char *fmt, ...)
 
 int ktprintf(const char *fmt, ...)
 {
-    double now_s = rtc_now_seconds();
-    if (first_print_now == 0.0) first_print_now = now_s;
-    double diff = now_s - first_print_now;
+    uint64_t now = rtc_now();
+    if (first_print_now == 0) first_print_now = now;
+    spinlock_lock(&print_lock);
+    kputc('[');
     c_time_print = true;
-    kprintf("[%lf] ", diff);
+    kprintfixed(now - first_print_now, RTC_PRECISION, 6);
     c_time_print = false;
+    kprints("] ");
 
-    spinlock_lock(&print_lock);
     va_list ap;
     va_start(ap, fmt);
     kvprintf(fmt, ap);
@@ -619,14 +588,17 @@ int ktprintf(const char *fmt, ...)
 int ctprintf(char* dest, int* rem, const char *fmt, ...)
 {
     int len = 0;
-    double now_s = rtc_now_seconds();
-    if (first_print_now == 0.0) first_print_now = now_s;
-    double diff = now_s - first_print_now;
+    uint64_t now = rtc_now();
+    if (first_print_now == 0) first_print_now = now;
+    len += cputc(dest++, rem, '[');
     c_time_print = true;
-    int tlen = cprintf(dest, rem, "[%lf] ", diff);
+    int tlen = cprintfixed(dest, rem, now - first_print_now, RTC_PRECISION, 6);
     dest += tlen;
     len += tlen;
     c_time_print = false;
+    tlen = cprintf(dest, rem, "] ");
+    dest += tlen;
+    len += tlen;
 
     va_list ap;
     va_start(ap, fmt);
@@ -15,11 +15,11 @@ void kputc(char c);
 int cputc(char* dest, int* rem, char c);
 void kprintint(long long xx, int base, int sign);
 void kprintptr(uint64_t x);
-void kprintfloat(double f, int precision);
+void kprintfixed(uint64_t value, uint64_t unit, int precision);
 void kprints(char* s);
 int cprintint(char* dest, int* rem, long long xx, int base, int sign);
 int cprintptr(char* dest, int* rem, uint64_t x);
-int cprintfloat(char* dest, int* rem, double f, int precision);
+int cprintfixed(char* dest, int* rem, uint64_t value, uint64_t unit, int precision);
 int kvprintf(const char *fmt, va_list ap);
 int cvprintf(char* dest, int* rem, const char *fmt, va_list ap);
 int kprintf(const char *fmt, ...);
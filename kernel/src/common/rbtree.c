@@ -0,0 +1,219 @@
+#include "rbtree.h"
+
+/**
+ * Puts new where old was below old's parent
+ */
+static void rb_replace_child(struct rb_root *root, struct rb_node *old, struct rb_node *new)
+{
+    struct rb_node *parent = old->parent;
+    if (parent == NULL)
+        root->node = new;
+    else if (parent->left == old)
+        parent->left = new;
+    else
+        parent->right = new;
+    if (new != NULL)
+        new->parent = parent;
+}
+
+/**
+ * Rotates the right child of x up into the place of x
+ */
+static void rb_rotate_left(struct rb_root *root, struct rb_node *x)
+{
+    struct rb_node *y = x->right;
+    x->right = y->left;
+    if (y->left != NULL)
+        y->left->parent = x;
+    rb_replace_child(root, x, y);
+    y->left = x;
+    x->parent = y;
+}
+
+/**
+ * Rotates the left child of x up into the place of x
+ */
+static void rb_rotate_right(struct rb_root *root, struct rb_node *x)
+{
+    struct rb_node *y = x->left;
+    x->left = y->right;
+    if (y->right != NULL)
+        y->right->parent = x;
+    rb_replace_child(root, x, y);
+    y->right = x;
+    x->parent = y;
+}
+
+static inline bool rb_is_red(const struct rb_node *node) { return node != NULL && node->red; }
+
+void rb_insert(struct rb_root *root, struct rb_node *node, struct rb_node *parent,
+               struct rb_node **link, bool leftmost)
+{
+    node->parent = parent;
+    node->left = node->right = NULL;
+    node->red = true;
+    *link = node;
+    if (leftmost)
+        root->leftmost = node;
+
+    // Fix two reds in a row going up
+    while (rb_is_red(node->parent))
+    {
+        struct rb_node *p = node->parent;
+        struct rb_node *g = p->parent; // exists, the root is black
+        struct rb_node *uncle = g->left == p ? g->right : g->left;
+        if (rb_is_red(uncle))
+        {
+            p->red = uncle->red = false;
+            g->red = true;
+            node = g;
+            continue;
+        }
+        if (g->left == p)
+        {
+            if (p->right == node)
+            {
+                rb_rotate_left(root, p);
+                p = node;
+            }
+            rb_rotate_right(root, g);
+        }
+        else
+        {
+            if (p->left == node)
+            {
+                rb_rotate_right(root, p);
+                p = node;
+            }
+            rb_rotate_left(root, g);
+        }
+        p->red = false;
+        g->red = true;
+        break;
+    }
+    root->node->red = false;
+}
+
+struct rb_node *rb_next(const struct rb_node *node)
+{
+    if (node->right != NULL)
+    {
+        node = node->right;
+        while (node->left != NULL)
+            node = node->left;
+        return (struct rb_node *)node;
+    }
+    while (node->parent != NULL && node->parent->right == node)
+        node = node->parent;
+    return node->parent;
+}
+
+void rb_erase(struct rb_root *root, struct rb_node *node)
+{
+    if (root->leftmost == node)
+        root->leftmost = rb_next(node);
+
+    // Unlink the node, or its successor if it has two children, and find
+    // out where a black node went missing
+    struct rb_node *child, *parent;
+    bool removed_red;
+    if (node->left == NULL || node->right == NULL)
+    {
+        child = node->left != NULL ? node->left : node->right;
+        parent = node->parent;
+        removed_red = node->red;
+        rb_replace_child(root, node, child);
+    }
+    else
+    {
+        struct rb_node *next = node->right;
+        while (next->left != NULL)
+            next = next->left;
+        child = next->right;
+        removed_red = next->red;
+        if (next->parent == node)
+        {
+            parent = next;
+        }
+        else
+        {
+            parent = next->parent;
+            rb_replace_child(root, next, child);
+            next->right = node->right;
+            next->right->parent = next;
+        }
+        rb_replace_child(root, node, next);
+        next->left = node->left;
+        next->left->parent = next;
+        next->red = node->red;
+    }
+    if (removed_red)
+        return;
+
+    // child carries an extra black which is pushed up until it can be
+    // absorbed
+    while (child != root->node && !rb_is_red(child))
+    {
+        if (parent->left == child)
+        {
+            struct rb_node *sibling = parent->right;
+            if (sibling->red)
+            {
+                sibling->red = false;
+                parent->red = true;
+                rb_rotate_left(root, parent);
+                sibling = parent->right;
+            }
+            if (!rb_is_red(sibling->left) && !rb_is_red(sibling->right))
+            {
+                sibling->red = true;
+                child = parent;
+                parent = child->parent;
+                continue;
+            }
+            if (!rb_is_red(sibling->right))
+            {
+                sibling->left->red = false;
+                sibling->red = true;
+                rb_rotate_right(root, sibling);
+                sibling = parent->right;
+            }
+            sibling->red = parent->red;
+            parent->red = false;
+            sibling->right->red = false;
+            rb_rotate_left(root, parent);
+        }
+        else
+        {
+            struct rb_node *sibling = parent->left;
+            if (sibling->red)
+            {
+                sibling->red = false;
+                parent->red = true;
+                rb_rotate_right(root, parent);
+                sibling = parent->left;
+            }
+            if (!rb_is_red(sibling->left) && !rb_is_red(sibling->right))
+            {
+                sibling->red = true;
+                child = parent;
+                parent = child->parent;
+                continue;
+            }
+            if (!rb_is_red(sibling->left))
+            {
+                sibling->right->red = false;
+                sibling->red = true;
+                rb_rotate_left(root, sibling);
+                sibling = parent->left;
+            }
+            sibling->red = parent->red;
+            parent->red = false;
+            sibling->left->red = false;
+            rb_rotate_right(root, parent);
+        }
+        child = root->node;
+    }
+    if (child != NULL)
+        child->red = false;
+}
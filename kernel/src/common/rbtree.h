@@ -0,0 +1,36 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * An intrusive red-black tree. The nodes are embedded in the objects they
+ * order and the tree never allocates. The caller finds where a new node
+ * goes by walking down from the root with its own comparison, and then
+ * calls rb_insert to link and rebalance it. The leftmost node is cached
+ * so the smallest one is at hand without a walk.
+ */
+struct rb_node {
+    struct rb_node *parent;
+    struct rb_node *left;
+    struct rb_node *right;
+    bool red;
+};
+
+struct rb_root {
+    struct rb_node *node;
+    struct rb_node *leftmost;
+};
+
+/**
+ * Links node below parent at *link, which is parent->left, parent->right
+ * or root->node, and rebalances the tree. leftmost tells if the walk to
+ * link only went left.
+ */
+void rb_insert(struct rb_root *root, struct rb_node *node, struct rb_node *parent,
+               struct rb_node **link, bool leftmost);
+void rb_erase(struct rb_root *root, struct rb_node *node);
+struct rb_node *rb_next(const struct rb_node *node);
+
+static inline struct rb_node *rb_first(const struct rb_root *root) { return root->leftmost; }
+
+static inline bool rb_empty(const struct rb_root *root) { return root->node == NULL; }
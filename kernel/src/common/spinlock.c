@@ -72,6 +72,27 @@ void spinlock_lock(struct spinlock *lock)
     lock->holding_cpu = get_processor_id();
 }
 
+/**
+ * Locks the spinlock like spinlock_lock if it is free. Returns false right
+ * away if another CPU is holding it.
+ */
+bool spinlock_trylock(struct spinlock *lock)
+{
+    if (!spinlocks_enabled)
+        return true;
+    save_and_disable_interrupts();
+    if (this_cpu_holding_lock(lock))
+        panic("deadlock");
+    if (__sync_lock_test_and_set(&lock->locked, 1) != 0)
+    {
+        restore_interrupts();
+        return false;
+    }
+    __sync_synchronize();
+    lock->holding_cpu = get_processor_id();
+    return true;
+}
+
 /**
  * Unlock the spinlock and restores the interrupt flags
  */
@@ -15,5 +15,6 @@ struct spinlock {
 
 void enable_spinlocks(bool enabled);
 void spinlock_lock(struct spinlock *lock);
+bool spinlock_trylock(struct spinlock *lock);
 void spinlock_unlock(struct spinlock *lock);
 bool spinlock_locked(struct spinlock *lock);
\ No newline at end of file
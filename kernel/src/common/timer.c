@@ -0,0 +1,124 @@
+#include "timer.h"
+
+#include <stddef.h>
+
+#include "common/printf.h"
+#include "common/spinlock.h"
+#include "cpu/smp.h"
+#ifdef DZOS_BOOT_BENCHMARKS
+#include "device/clockevent.h"
+#include "device/rtc.h"
+#endif
+
+/* Pending timers of each core */
+static struct {
+    // Only contended by the core itself today, but timer_run drops it
+    // around callbacks which may take other locks
+    struct spinlock lock;
+    struct rb_root tree;
+} timer_bases[MAX_CORES];
+
+static inline struct timer *timer_of(const struct rb_node *node)
+{
+    return node ? (struct timer *)((char *)node - offsetof(struct timer, node)) : NULL;
+}
+
+void timer_add(struct timer *timer, uint64_t expires, void (*callback)(struct timer *))
+{
+    timer->expires = expires;
+    timer->callback = callback;
+    timer->pending = true;
+
+    typeof(timer_bases[0]) *base = &timer_bases[cpu_local()->cpuid];
+    spinlock_lock(&base->lock);
+    // Equal expiries go right, so timers of the same time run in order
+    struct rb_node **link = &base->tree.node, *parent = NULL;
+    bool leftmost = true;
+    while (*link != NULL)
+    {
+        parent = *link;
+        if (expires < timer_of(parent)->expires)
+        {
+            link = &parent->left;
+        }
+        else
+        {
+            link = &parent->right;
+            leftmost = false;
+        }
+    }
+    rb_insert(&base->tree, &timer->node, parent, link, leftmost);
+    spinlock_unlock(&base->lock);
+}
+
+uint64_t timer_next_expiry(void)
+{
+    typeof(timer_bases[0]) *base = &timer_bases[cpu_local()->cpuid];
+    spinlock_lock(&base->lock);
+    const struct timer *first = timer_of(rb_first(&base->tree));
+    const uint64_t expires = first ? first->expires : UINT64_MAX;
+    spinlock_unlock(&base->lock);
+    return expires;
+}
+
+void timer_run(uint64_t now)
+{
+    typeof(timer_bases[0]) *base = &timer_bases[cpu_local()->cpuid];
+    spinlock_lock(&base->lock);
+    for (;;)
+    {
+        struct timer *timer = timer_of(rb_first(&base->tree));
+        if (timer == NULL || timer->expires > now)
+            break;
+        rb_erase(&base->tree, &timer->node);
+        timer->pending = false;
+        void (*callback)(struct timer *) = timer->callback;
+        spinlock_unlock(&base->lock);
+        callback(timer);
+        spinlock_lock(&base->lock);
+    }
+    spinlock_unlock(&base->lock);
+}
+
+#ifdef DZOS_BOOT_BENCHMARKS
+/* When the timer of the accuracy benchmark fired */
+static volatile uint64_t bench_fired_at;
+
+static void bench_timer_fired(struct timer *timer)
+{
+    (void)timer;
+    bench_fired_at = rtc_now();
+}
+
+/**
+ * Boot-time benchmark of how late kernel timers fire. Each timer is waited
+ * for halted, like an idle core waits for a sleeping process, and the
+ * lateness is measured from its expiry to its callback. Must run after the
+ * timer interrupt of this core is set up.
+ */
+void timer_bench_accuracy(void)
+{
+    const uint64_t delays_ms[] = {1, 10, 100};
+    const int rounds = 4;
+    for (size_t d = 0; d < sizeof(delays_ms) / sizeof(delays_ms[0]); d++)
+    {
+        uint64_t total_late = 0, max_late = 0;
+        for (int r = 0; r < rounds; r++)
+        {
+            struct timer timer;
+            bench_fired_at = 0;
+            const uint64_t expires = rtc_now() + delays_ms[d] * 1000;
+            timer_add(&timer, expires, bench_timer_fired);
+            clockevent_arm(delays_ms[d] * 1000);
+            while (bench_fired_at == 0)
+                __asm__ volatile("sti; hlt; cli" ::: "memory");
+            const uint64_t late = bench_fired_at - expires;
+            total_late += late;
+            if (late > max_late)
+                max_late = late;
+        }
+        ktprintf("[bench] timer %llu ms: %llu us late on average, %llu us at most\n",
+                 delays_ms[d], total_late / rounds, max_late);
+    }
+}
+#endif
@@ -0,0 +1,41 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "common/rbtree.h"
+
+/**
+ * A kernel timer calls its callback from the timer interrupt of the core
+ * which added it, once rtc_now() has reached expires. Each core keeps its
+ * pending timers in a tree ordered by expiry, so the scheduler can arm the
+ * clockevent for the nearest one without a periodic tick.
+ *
+ * The callback runs with interrupts disabled and no timer lock held. The
+ * timer is no longer pending by then, so the callback may free it or add
+ * it again.
+ */
+struct timer {
+    struct rb_node node;
+    uint64_t expires; // In microseconds like rtc_now()
+    void (*callback)(struct timer *timer);
+    bool pending;
+};
+
+/**
+ * Adds a timer to this core. The clockevent is armed for it the next time
+ * the scheduler of this core picks a process or goes idle, which happens
+ * right away when the caller goes to sleep afterwards.
+ */
+void timer_add(struct timer *timer, uint64_t expires, void (*callback)(struct timer *));
+/**
+ * Expiry of the nearest timer of this core, or UINT64_MAX if there is none
+ */
+uint64_t timer_next_expiry(void);
+/**
+ * Runs the callbacks of every timer of this core which is due at now
+ */
+void timer_run(uint64_t now);
+
+#ifdef DZOS_BOOT_BENCHMARKS
+void timer_bench_accuracy(void);
+#endif
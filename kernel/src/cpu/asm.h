@@ -21,6 +21,9 @@
 #define FLAGS_VIP (1UL << 20)
 #define FLAGS_ID (1UL << 21)
 
+#define CR4_PGE (1UL << 7)
+#define CR4_PCIDE (1UL << 17)
+
 #define MSR_FS_BASE 0xC0000100
 #define MSR_GS_BASE 0xC0000101
 #define MSR_KERNEL_GS_BASE 0xC0000102
@@ -81,6 +84,48 @@ static inline uint64_t get_installed_pagetable()
   return cr3 & 0xFFFFFFFFFFFFF000ULL;
 }
 
+static inline uint64_t read_cr0(void)
+{
+  uint64_t cr0;
+  __asm__ volatile("mov %%cr0, %0" : "=r"(cr0));
+  return cr0;
+}
+
+static inline void write_cr0(uint64_t cr0)
+{
+  __asm__ volatile("mov %0, %%cr0" : : "r"(cr0) : "memory");
+}
+
+static inline uint64_t read_cr4(void)
+{
+  uint64_t cr4;
+  __asm__ volatile("mov %%cr4, %0" : "=r"(cr4));
+  return cr4;
+}
+
+static inline void write_cr4(uint64_t cr4)
+{
+  __asm__ volatile("mov %0, %%cr4" : : "r"(cr4) : "memory");
+}
+
+static inline void cpuid(uint32_t leaf, uint32_t subleaf, uint32_t *eax,
+                         uint32_t *ebx, uint32_t *ecx, uint32_t *edx)
+{
+  __asm__ volatile("cpuid"
+                   : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx)
+                   : "a"(leaf), "c"(subleaf));
+}
+
+/**
+ * Returns the linear address which caused the last page fault
+ */
+static inline uint64_t read_cr2(void)
+{
+  uint64_t cr2;
+  __asm__ volatile("mov %%cr2, %0" : "=r"(cr2));
+  return cr2;
+}
+
 static inline uint64_t rdmsr(uint32_t msr)
 {
   uint32_t lo, hi;
@@ -117,3 +162,21 @@ static inline bool is_interrupts_enabled(void)
 {
   return (read_rflags() & FLAGS_IF) != 0;
 }
+
+/**
+ * Disables interrupts on this core and returns the previous RFLAGS to be
+ * given to irq_restore. Unlike the spinlock interrupt stack, this does not
+ * touch any per-CPU state.
+ */
+static inline uint64_t irq_save(void)
+{
+  uint64_t flags = read_rflags();
+  cli();
+  return flags;
+}
+
+static inline void irq_restore(uint64_t flags)
+{
+  if (flags & FLAGS_IF)
+    sti();
+}
@@ -1,48 +1,282 @@
 #include "fpu.h"
-#include "userspace/proc.h"
+#include "common/lib.h"
+#include "common/printf.h"
+#include "cpu/asm.h"
 #include "cpu/smp.h"
-
-#include <stdint.h>
-
+#include "mem/slab.h"
+#include "userspace/proc.h"
+
+#include <stdint.h>
+
+/**
+ * The user FPU state of a process lives in its save area while it is not
+ * in the registers. Each core tracks in fpu_owner whose state is in its
+ * registers and newer than the save area. The kernel is built with
+ * -mgeneral-regs-only, so syscalls and interrupts leave the registers alone
+ * and the state of the owner is only saved when another process or a
+ * kernel_fpu_begin region needs them. Returning to a process either loads
+ * its state right away (eager) or sets CR0.TS and loads it on the first
+ * FPU instruction of the process (lazy). In the lazy mode a process which
+ * never touches the FPU never pays for a save or restore.
+ */
+#ifdef DZOS_LAZY_FPU
+static const bool fpu_lazy = true;
+#else
+static const bool fpu_lazy = false;
+#endif
+
+#define CR0_MP (1ull << 1)
+#define CR0_EM (1ull << 2)
+#define CR0_TS (1ull << 3)
+#define CR4_OSFXSR (1ull << 9)
+#define CR4_OSXMMEXCPT (1ull << 10)
+#define CR4_OSXSAVE (1ull << 18)
+#define CPUID_1_ECX_XSAVE (1u << 26)
+#define CPUID_D_1_EAX_XSAVEOPT (1u << 0)
+#define CPUID_D_1_EAX_XSAVEC (1u << 1)
+
+// x87, SSE and AVX, and the opmask and upper ZMM state of AVX-512
+#define XCR0_X87 (1ull << 0)
+#define XCR0_SSE (1ull << 1)
+#define XCR0_AVX (1ull << 2)
+#define XCR0_AVX512 ((1ull << 5) | (1ull << 6) | (1ull << 7))
+
+// Offsets in the legacy area shared by FXSAVE and XSAVE
+#define FXSAVE_FCW 0
+#define FXSAVE_MXCSR 24
+#define FCW_DEFAULT 0x037F
+#define MXCSR_DEFAULT 0x1F80
+
+/* How the FPU state is saved, best first. All cores use the same. */
+static enum {
+    FPU_XSAVEC,   // compacted, skips components in their initial state
+    FPU_XSAVEOPT, // skips components unchanged since the last restore
+    FPU_XSAVE,
+    FPU_FXSAVE,   // no XSAVE, only x87 and SSE
+} fpu_insn = FPU_FXSAVE;
+static const char *const fpu_insn_names[] = {"xsavec", "xsaveopt", "xsave", "fxsave"};
+static uint64_t fpu_xcr0;
+static uint32_t fpu_state_size = 512;
+static struct kmem_cache *fpu_state_cache;
+
+/* Counters of each core */
+static struct {
+    uint64_t eager_restores;
+    uint64_t lazy_restores;
+    uint64_t saves;
+} fpu_stats[MAX_CORES];
+
+static inline void xsetbv(uint32_t reg, uint64_t value)
+{
+    __asm__ volatile("xsetbv" ::"c"(reg), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)));
+}
+
+static inline void clts(void) { __asm__ volatile("clts" ::: "memory"); }
+
+static inline void stts(void) { write_cr0(read_cr0() | CR0_TS); }
+
+/**
+ * Picks the XSAVE features to enable and how to save them. Only done on
+ * the first core.
+ */
+static void fpu_xsave_setup(void)
+{
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(0xD, 0, &eax, &ebx, &ecx, &edx);
+    const uint64_t supported = eax | ((uint64_t)edx << 32);
+    fpu_xcr0 = XCR0_X87 | XCR0_SSE;
+    if (supported & XCR0_AVX)
+        fpu_xcr0 |= XCR0_AVX;
+    if ((fpu_xcr0 & XCR0_AVX) && (supported & XCR0_AVX512) == XCR0_AVX512)
+        fpu_xcr0 |= XCR0_AVX512;
+    xsetbv(0, fpu_xcr0);
+
+    // EBX of leaf 0xD is the size of the standard format for XCR0, and
+    // EBX of subleaf 1 the size of the compacted one
+    cpuid(0xD, 0, &eax, &ebx, &ecx, &edx);
+    fpu_state_size = ebx;
+    fpu_insn = FPU_XSAVE;
+    cpuid(0xD, 1, &eax, &ebx, &ecx, &edx);
+    if (eax & CPUID_D_1_EAX_XSAVEC)
+    {
+        fpu_insn = FPU_XSAVEC;
+        fpu_state_size = ebx;
+    }
+    else if (eax & CPUID_D_1_EAX_XSAVEOPT)
+    {
+        fpu_insn = FPU_XSAVEOPT;
+    }
+}
+
 void fpu_enable(void)
-{
-    uint64_t cr0, cr4;
-    __asm__ volatile("mov %%cr0, %0" : "=r"(cr0));
-    cr0 &= ~(1 << 2);  // clear EM
-    cr0 |=  (1 << 1);  // set MP
-    __asm__ volatile("mov %0, %%cr0" :: "r"(cr0));
-
-    __asm__ volatile("mov %%cr4, %0" : "=r"(cr4));
-    cr4 |= (1 << 9) | (1 << 10); // OSFXSR | OSXMMEXCPT
-    __asm__ volatile("mov %0, %%cr4" :: "r"(cr4));
-
-    __asm__ volatile("fninit");
+{
+    uint64_t cr0 = read_cr0();
+    cr0 &= ~(CR0_EM | CR0_TS);
+    cr0 |= CR0_MP;
+    write_cr0(cr0);
+
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+    uint64_t cr4 = read_cr4() | CR4_OSFXSR | CR4_OSXMMEXCPT;
+    if (ecx & CPUID_1_ECX_XSAVE)
+        cr4 |= CR4_OSXSAVE;
+    write_cr4(cr4);
+    if (ecx & CPUID_1_ECX_XSAVE)
+    {
+        if (fpu_xcr0 == 0)
+            fpu_xsave_setup();
+        else
+            xsetbv(0, fpu_xcr0);
+    }
+
+    __asm__ volatile("fninit");
+}
+
+/**
+ * Saves the FPU registers in a save area aligned to 64 bytes
+ */
+static void fpu_save(void *state)
+{
+    // The requested-feature bitmap in EDX:EAX is masked with XCR0
+    switch (fpu_insn)
+    {
+    case FPU_XSAVEC:
+        __asm__ volatile("xsavec64 (%0)" ::"r"(state), "a"(UINT32_MAX), "d"(UINT32_MAX) : "memory");
+        break;
+    case FPU_XSAVEOPT:
+        __asm__ volatile("xsaveopt64 (%0)" ::"r"(state), "a"(UINT32_MAX), "d"(UINT32_MAX) : "memory");
+        break;
+    case FPU_XSAVE:
+        __asm__ volatile("xsave64 (%0)" ::"r"(state), "a"(UINT32_MAX), "d"(UINT32_MAX) : "memory");
+        break;
+    case FPU_FXSAVE:
+        __asm__ volatile("fxsave64 (%0)" ::"r"(state) : "memory");
+        break;
+    }
 }
 
-void fpu_save_current(void)
+/**
+ * Loads the FPU registers from a save area written by fpu_save or
+ * fpu_state_alloc
+ */
+static void fpu_load(const void *state)
 {
-    struct process *p = my_process();
-    if (p)
-        fpu_save((void *)p->additional_data.fpu_state);
+    // XRSTOR tells the standard and compacted formats apart by itself
+    if (fpu_insn == FPU_FXSAVE)
+        __asm__ volatile("fxrstor64 (%0)" ::"r"(state) : "memory");
+    else
+        __asm__ volatile("xrstor64 (%0)" ::"r"(state), "a"(UINT32_MAX), "d"(UINT32_MAX) : "memory");
 }
 
-void fpu_load_current(void)
+void fpu_state_cache_init(void)
 {
-    struct process *p = my_process();
-    if (p)
-        fpu_load((const void *)p->additional_data.fpu_state);
+    fpu_state_cache = kmem_cache_create("fpu_state", fpu_state_size, 64, NULL);
+    if (fpu_state_cache == NULL)
+        panic("fpu_state_cache_init: out of memory");
+    ktprintf("FPU: %s with xcr0 0x%llx, %u byte save areas, %s restores\n",
+             fpu_insn_names[fpu_insn], fpu_xcr0, fpu_state_size, fpu_lazy ? "lazy" : "eager");
+}
+
+void *fpu_state_alloc(void)
+{
+    uint8_t *state = kmem_cache_alloc(fpu_state_cache);
+    if (state == NULL)
+        return NULL;
+    // An XSAVE header of zeros in the standard format puts every component
+    // in its initial state, except MXCSR which is always loaded
+    memset(state, 0, fpu_state_size);
+    *(uint16_t *)(state + FXSAVE_FCW) = FCW_DEFAULT;
+    *(uint32_t *)(state + FXSAVE_MXCSR) = MXCSR_DEFAULT;
+    return state;
+}
+
+void fpu_state_free(void *state) { kmem_cache_free(fpu_state_cache, state); }
+
+void fpu_state_copy(void *dst, const void *src) { memcpy(dst, src, fpu_state_size); }
+
+void fpu_state_sync(struct process *p)
+{
+    struct cpu_local_data *cpu = cpu_local();
+    if (cpu->fpu_owner != p)
+        return;
+    clts();
+    fpu_save(p->additional_data.fpu_state);
+    fpu_stats[cpu->cpuid].saves++;
+}
+
+/**
+ * Saves the registers of the owner of this core, if any, in its save area
+ */
+static void fpu_save_owner(struct cpu_local_data *cpu)
+{
+    if (cpu->fpu_owner == NULL)
+        return;
+    fpu_save(cpu->fpu_owner->additional_data.fpu_state);
+    fpu_stats[cpu->cpuid].saves++;
+    cpu->fpu_owner = NULL;
 }
 
-// Save/restore kernel FP/SIMD state around kernel code that may use XMM.
-// This avoids depending on my_process() which can change during preemption.
 void kernel_fpu_begin(void)
 {
     struct cpu_local_data *cpu = cpu_local();
-    fpu_save((void *)cpu->kernel_fpu_state);
+    clts();
+    fpu_save_owner(cpu);
 }
 
-void kernel_fpu_end(void)
+void kernel_fpu_end(void) { fpu_return_to_user(my_process()); }
+
+void fpu_return_to_user(struct process *p)
+{
+    struct cpu_local_data *cpu = cpu_local();
+    if (p == NULL)
+        return;
+    if (cpu->fpu_owner == p)
+    {
+        // Its registers are still here, so it need not trap
+        if (fpu_lazy)
+            clts();
+        return;
+    }
+    if (fpu_lazy)
+    {
+        stts();
+        return;
+    }
+    fpu_save_owner(cpu);
+    fpu_load(p->additional_data.fpu_state);
+    cpu->fpu_owner = p;
+    fpu_stats[cpu->cpuid].eager_restores++;
+}
+
+void fpu_release(struct process *p)
+{
+    struct cpu_local_data *cpu = cpu_local();
+    if (cpu->fpu_owner == p)
+        cpu->fpu_owner = NULL;
+}
+
+void fpu_device_not_available(struct interrupt_frame *frame)
 {
+    // The kernel is built without SIMD and clears CR0.TS before its own
+    // FPU instructions
+    if ((frame->cs & 3) == 0)
+        panic("fpu: #NM in the kernel");
     struct cpu_local_data *cpu = cpu_local();
-    fpu_load((const void *)cpu->kernel_fpu_state);
+    clts();
+    fpu_save_owner(cpu);
+    fpu_load(cpu->running_process->additional_data.fpu_state);
+    cpu->fpu_owner = cpu->running_process;
+    fpu_stats[cpu->cpuid].lazy_restores++;
+}
+
+void fpu_print_stats(void)
+{
+    uint64_t eager = 0, lazy = 0, saves = 0;
+    for (uint8_t cpu = 0; cpu < cpu_count(); cpu++)
+    {
+        eager += fpu_stats[cpu].eager_restores;
+        lazy += fpu_stats[cpu].lazy_restores;
+        saves += fpu_stats[cpu].saves;
+    }
+    ktprintf("FPU restores:       %llu eager, %llu lazy (%llu saves)\n", eager, lazy, saves);
 }
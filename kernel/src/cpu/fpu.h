@@ -1,22 +1,54 @@
 #pragma once
+#include <stddef.h>
+
+struct process;
+struct interrupt_frame;
+
 /**
- * Enable FPU at the boot time.
+ * Enable FPU at the boot time. Also enables XSAVE and the AVX and AVX-512
+ * state if the CPU has them. Called on every core.
  */
 void fpu_enable(void);
 /**
- * Saves the FPU state in the given save area. The area must be aligned
- * to 16 bytes. The size of the save location must be at least 512 bytes.
+ * Creates the cache of the FPU save areas. Their size is only known after
+ * fpu_enable ran on the first core.
+ */
+void fpu_state_cache_init(void);
+/**
+ * Allocates a save area holding the initial FPU state. Returns NULL if out
+ * of memory.
  */
-void fpu_save(void *);
+void *fpu_state_alloc(void);
+void fpu_state_free(void *state);
+/**
+ * Copies a save area into another, e.g. the one of a forked process
+ */
+void fpu_state_copy(void *dst, const void *src);
+/**
+ * Writes the registers of p to its save area if they are live on this
+ * core. p keeps them, this is for reading the save area, e.g. on fork.
+ */
+void fpu_state_sync(struct process *p);
 
 /**
- * Loads the FPU state saved with fpu_save to the FPU. The given location
- * must be aligned to 16 bytes.
+ * Called last before returning to p in userspace. Eagerly loads the FPU
+ * state of p, or in the lazy mode sets CR0.TS so the state is only loaded
+ * once p uses the FPU.
+ */
+void fpu_return_to_user(struct process *p);
+/**
+ * Forgets the registers of p on this core, as p has exited
  */
-void fpu_load(const void *);
-// Save/restore current process FP state (helper for asm)
-void fpu_save_current(void);
-void fpu_load_current(void);
-// Save/restore kernel FP state on interrupt/syscall entry/exit
+void fpu_release(struct process *p);
+/**
+ * Handles #NM, which userspace gets for the first FPU instruction after
+ * fpu_return_to_user set CR0.TS
+ */
+void fpu_device_not_available(struct interrupt_frame *frame);
+void fpu_print_stats(void);
+
+// The kernel is built without SIMD. Code using it anyway, like
+// memcpy_sse, must run between these two, which save the user FPU state
+// and give it back. Regions do not nest and run with interrupts disabled.
 void kernel_fpu_begin(void);
 void kernel_fpu_end(void);
@@ -1,6 +1,7 @@
 #include "cpu/gdt.h"
+#include "cpu/asm.h"
+#include "cpu/smp.h"
 #include "mem/mem.h"
-#include "mem/vmm.h"
 #include "common/printf.h"
 #include <stdint.h>
 
@@ -48,9 +49,10 @@ union gdt_entry
 };
 
 /**
- * The GDT entries needed for our OS
+ * The GDT entries needed for our OS. Each core has its own TSS, so the TSS
+ * descriptors of the cores follow each other at the end.
  */
-static union gdt_entry gdt_entries[] = {
+static union gdt_entry gdt_entries[GDT_TSS_SEGMENT / 8 + 2 * MAX_CORES] = {
     // First segment is NULL
     {.normal = {0}},
     // 64-Bit Code Segement (Kernel)
@@ -81,18 +83,8 @@ static union gdt_entry gdt_entries[] = {
                 .access = 0b11111010,
                 .granularity = 0b00100000,
                 .base_hi = 0x00}},
-    // TSS. Limit and base will be filled before this gets loaded
-    {.normal = {.limit = 0x0000,
-                .base_low = 0x0000,
-                .base_mid = 0x00,
-                .access = 0b10001001,
-                .granularity = 0b00000000,
-                .base_hi = 0x00}},
-    // TSS continued...
-    {.sys_desc_upper = {
-         .base_very_high = 0,
-         .reserved = 0,
-     }}};
+    // TSS descriptors of the cores. They are filled in tss_init_and_load.
+};
 
 /**
  * The TSS entry
@@ -118,63 +110,68 @@ struct tss_entry {
 } __attribute__((packed));
 
 /**
- * The TSS which will be loaded. At first, we initialize everything
- * with zero and then fill them in tss_init.
+ * The TSS of each core. At first, we initialize everything with zero and
+ * then fill them in tss_init_and_load.
  */
-static struct tss_entry tss = {0};
+static struct tss_entry tss_entries[MAX_CORES] = {0};
 
 extern void reload_segments(void *gdt); // defined in snippet.S
 
 /**
- * Setup the Task State Segment for this (and only) core and
- * put the address of it in GDT.
+ * Setup the Task State Segment for this core and put the address of it in
+ * its GDT slot.
  *
- * This function must be called before gdt_init.
+ * This function must be called after gdt_init and cpu_local_setup.
  */
 void tss_init_and_load(void)
 {
   ktprintf("[TSS] Initializing Task State Segment\n");
+  const uint8_t cpuid = cpu_local()->cpuid;
+  struct tss_entry *const tss = &tss_entries[cpuid];
   
   // Allocate stacks for IST entries
   // IST[0] = Double Fault (already done in original code)
-  tss.ist[IST_DOUBLE_FAULT_STACK_INDEX - 1] = (uint64_t)kalloc() + PAGE_SIZE;
+  tss->ist[IST_DOUBLE_FAULT_STACK_INDEX - 1] = (uint64_t)kalloc() + PAGE_SIZE;
   
   // IST[1] = NMI (Non-Maskable Interrupt)
-  tss.ist[IST_NMI_STACK_INDEX - 1] = (uint64_t)kalloc() + PAGE_SIZE;
+  tss->ist[IST_NMI_STACK_INDEX - 1] = (uint64_t)kalloc() + PAGE_SIZE;
   
   // IST[2] = Machine Check Exception
-  tss.ist[IST_MACHINE_CHECK_STACK_INDEX - 1] = (uint64_t)kalloc() + PAGE_SIZE;
+  tss->ist[IST_MACHINE_CHECK_STACK_INDEX - 1] = (uint64_t)kalloc() + PAGE_SIZE;
   
   // IST[3] = Debug/Breakpoint
-  tss.ist[IST_DEBUG_STACK_INDEX - 1] = (uint64_t)kalloc() + PAGE_SIZE;
+  tss->ist[IST_DEBUG_STACK_INDEX - 1] = (uint64_t)kalloc() + PAGE_SIZE;
   
-  // SP0 will be updated per-process by scheduler
-  // This is the default kernel interrupt stack
-  tss.sp0 = INTSTACK_VIRTUAL_ADDRESS_TOP;
+  // SP0 is the kernel stack of the running process and is set by the
+  // scheduler before it enters one. Nothing comes from userspace before.
+  tss->sp0 = 0;
   
   // SP1 and SP2 unused in long mode
-  tss.sp1 = 0;
-  tss.sp2 = 0;
+  tss->sp1 = 0;
+  tss->sp2 = 0;
   
   // IO bitmap at end of TSS (none used)
-  tss.io_bitmap_base = 0xFFFF;
+  tss->io_bitmap_base = 0xFFFF;
   
   // Update GDT entry with TSS address
-  uint64_t tss_address = (uint64_t)&tss;
-  gdt_entries[GDT_TSS_SEGMENT / 8].normal.limit = sizeof(tss) - 1;
-  gdt_entries[GDT_TSS_SEGMENT / 8].normal.base_low = tss_address & 0xFFFF;
-  gdt_entries[GDT_TSS_SEGMENT / 8].normal.base_mid = (tss_address >> 16) & 0xFF;
-  gdt_entries[GDT_TSS_SEGMENT / 8].normal.base_hi = (tss_address >> 24) & 0xFF;
-  gdt_entries[GDT_TSS_SEGMENT / 8 + 1].sys_desc_upper.base_very_high = 
+  const uint16_t segment = GDT_TSS_SEGMENT_OF(cpuid);
+  const uint64_t tss_address = (uint64_t)tss;
+  gdt_entries[segment / 8].normal.limit = sizeof(*tss) - 1;
+  gdt_entries[segment / 8].normal.base_low = tss_address & 0xFFFF;
+  gdt_entries[segment / 8].normal.base_mid = (tss_address >> 16) & 0xFF;
+  gdt_entries[segment / 8].normal.access = 0b10001001;
+  gdt_entries[segment / 8].normal.granularity = 0b00000000;
+  gdt_entries[segment / 8].normal.base_hi = (tss_address >> 24) & 0xFF;
+  gdt_entries[segment / 8 + 1].sys_desc_upper.base_very_high = 
       (tss_address >> 32) & 0xFFFFFFFF;
   
   // Load TSS into TR register
-  __asm__ volatile("ltr %%ax" : : "a"((uint16_t)GDT_TSS_SEGMENT));
+  __asm__ volatile("ltr %%ax" : : "a"(segment));
   
-  ktprintf("[TSS] Loaded with SP0=0x%llx\n", tss.sp0);
+  ktprintf("[TSS] Loaded for core %d\n", cpuid);
   ktprintf("[TSS] IST[%d] (Double Fault) = 0x%llx\n", 
             IST_DOUBLE_FAULT_STACK_INDEX, 
-            tss.ist[IST_DOUBLE_FAULT_STACK_INDEX - 1]);
+            tss->ist[IST_DOUBLE_FAULT_STACK_INDEX - 1]);
 }
 
 /**
@@ -184,26 +181,26 @@ void tss_init_and_load(void)
  */
 void gdt_init(void)
 {
-  // Add TSS to GDT
-  gdt_entries[GDT_TSS_SEGMENT / 8].normal.limit = sizeof(tss);
-  const uint64_t tss_address = (uint64_t)&tss;
-  gdt_entries[GDT_TSS_SEGMENT / 8].normal.base_low = tss_address & 0xFFFF;
-  gdt_entries[GDT_TSS_SEGMENT / 8].normal.base_mid = (tss_address >> 16) & 0xFF;
-  gdt_entries[GDT_TSS_SEGMENT / 8].normal.base_hi = (tss_address >> 24) & 0xFF;
-  gdt_entries[GDT_TSS_SEGMENT / 8 + 1].sys_desc_upper.base_very_high =
-      (tss_address >> 32) & 0xFFFFFFFF;
+  // The TSS descriptors are filled by each core in tss_init_and_load
   struct gdtr gdt = {
       .limit = sizeof(gdt_entries) - 1,
       .ptr = (uint64_t)&gdt_entries[0],
   };
+  // Loading the null selector into GS clears its base on Intel, which
+  // already points to the local data of this core on the application
+  // processors
+  const uint64_t gs_base = rdmsr(MSR_GS_BASE);
   reload_segments(&gdt);
+  wrmsr(MSR_GS_BASE, gs_base);
   ktprintf("GDT initialized\n");
 }
 
 /**
- * Update TSS SP0 when switching processes
+ * Update TSS SP0 and the syscall stack of this core when switching processes
  * Called by scheduler before context switch to user
  */
 void tss_set_kernel_stack(uint64_t stack_top) {
-    tss.sp0 = stack_top;
+    struct cpu_local_data *cpu = cpu_local();
+    tss_entries[cpu->cpuid].sp0 = stack_top;
+    cpu->kernel_stack_top = stack_top;
 }
\ No newline at end of file
@@ -4,6 +4,8 @@
 #define GDT_USER_DATA_SEGMENT   0x18
 #define GDT_USER_CODE_SEGMENT   0x20
 #define GDT_TSS_SEGMENT         0x28
+// Each core has a 16 byte TSS descriptor, starting at GDT_TSS_SEGMENT
+#define GDT_TSS_SEGMENT_OF(cpuid) (GDT_TSS_SEGMENT + (cpuid) * 16)
 #define IST_DOUBLE_FAULT_STACK_INDEX  1
 #define IST_NMI_STACK_INDEX           2
 #define IST_MACHINE_CHECK_STACK_INDEX 3
@@ -5,12 +5,45 @@
 #include "traps.h"
 #include "common/printf.h"
 #include "device/pic.h"
+#include "cpu/asm.h"
+#include "mem/uaccess.h"
+#include "mem/vma.h"
 #include "userspace/proc.h"
 
-void handle_page_fault(uint64_t error_code, uint64_t faulting_address)
+/* Page fault error code bits */
+#define PF_PRESENT (1ULL << 0) /* protection violation, not a missing page */
+#define PF_WRITE   (1ULL << 1)
+#define PF_USER    (1ULL << 2)
+
+void handle_page_fault(interrupt_frame_t *frame)
 {
-	// Check if this is a stack overflow
+	const uint64_t error_code = frame->error_code;
+	const uint64_t faulting_address = read_cr2();
 	struct process *p = my_process();
+
+	// Anonymous memory of the running process is allocated on first touch.
+	// The kernel may hit it too while working on a user buffer.
+	if (p && faulting_address < USERSPACE_VA_MAX &&
+	    vma_fault(&p->vm, p->pagetable, faulting_address, (error_code & PF_WRITE) != 0) == 0)
+		return;
+
+	// A user copy of the kernel hit a bad address: the copy fails instead
+	if (!(error_code & PF_USER)) {
+		const uint64_t fixup = uaccess_fixup(frame->rip);
+		if (fixup != 0) {
+			frame->rip = fixup;
+			return;
+		}
+	}
+
+	// Bad access of a user program: kill the program, not the kernel
+	if (p && (error_code & PF_USER)) {
+		ktprintf("[PF] PID %llu: segmentation fault at 0x%llx (rip 0x%llx, error 0x%llx)\n",
+		         p->pid, faulting_address, frame->rip, error_code);
+		proc_exit(-1);
+	}
+
+	// Check if this is a stack overflow
 	if (p) {
 		uint64_t guard_page_start = p->kernel_stack_base - KERNEL_STACK_GUARD_SIZE;
 		uint64_t guard_page_end = p->kernel_stack_base;
@@ -32,7 +65,7 @@ void handle_page_fault(uint64_t error_code, uint64_t faulting_address)
 	}
 	
 	// Handle other page faults normally
-	kprintf("Page fault at 0x%llx (error: 0x%llx)\n", faulting_address, error_code);
+	kprintf("Page fault at 0x%llx (error: 0x%llx, rip: 0x%llx)\n", faulting_address, error_code, frame->rip);
 	panic("Unhandled page fault");
 }
 
@@ -54,6 +87,9 @@ struct idt_ptr {
 static struct idt_entry idt[256];
 static struct idt_ptr idtp;
 
+extern void isr_page_fault_stub(void);
+extern void isr_device_not_available_stub(void);
+
 void idt_set_gate(uint8_t vector, uint64_t handler, uint8_t dpl, uint8_t type_attr)
 {
     idt[vector].offset_low  = (uint16_t)(handler & 0xFFFF);
@@ -77,6 +113,11 @@ void idt_init(void)
         idt[i].zero = 0;
     }
 
+    // Page faults drive demand paging of user memory
+    idt_set_gate(T_PGFLT, (uint64_t)isr_page_fault_stub, 0, 0x8E);
+    // The lazy FPU restore of processes
+    idt_set_gate(T_DEVICE, (uint64_t)isr_device_not_available_stub, 0, 0x8E);
+
     idt_load();
 
     ktprintf("IDT initialized with %d entries\n", 256);
@@ -1,6 +1,8 @@
 #include "smp.h"
 #include "asm.h"
 #include "common/printf.h"
+#include "device/clockevent.h"
+#include "device/pic.h"
 
 // List of local datas of all cores
 static struct cpu_local_data cpu_locals[MAX_CORES];
@@ -16,12 +18,55 @@ struct cpu_local_data *cpu_local(void)
 
 uint8_t get_processor_id(void) { return cpu_local()->cpuid; }
 
+uint8_t cpu_count(void) { return __atomic_load_n(&next_cpuid, __ATOMIC_RELAXED); }
+
+struct cpu_local_data *cpu_local_of(uint8_t cpuid) { return &cpu_locals[cpuid]; }
+
 void cpu_local_setup(void)
 {
     uint8_t cpuid = __atomic_fetch_add(&next_cpuid, 1, __ATOMIC_RELAXED);
-    if (cpuid > MAX_CORES)
+    if (cpuid >= MAX_CORES)
         panic("too much cores");
     cpu_locals[cpuid].cpuid = cpuid;
     wrmsr(MSR_GS_BASE, (uint64_t)&cpu_locals[cpuid]);
     wrmsr(MSR_KERNEL_GS_BASE, (uint64_t)&cpu_locals[cpuid]);
-}
\ No newline at end of file
+}
+
+void smp_start_aps(volatile struct limine_smp_request *request, limine_goto_address entry)
+{
+    const struct limine_smp_response *smp = request->response;
+    if (smp == NULL)
+    {
+        ktprintf("SMP: no response from the bootloader, running on one core\n");
+        return;
+    }
+    uint8_t started = 0;
+    for (uint64_t i = 0; i < smp->cpu_count; i++)
+    {
+        struct limine_smp_info *info = smp->cpus[i];
+        if (info->lapic_id == smp->bsp_lapic_id)
+            continue;
+        if (cpu_count() + started >= MAX_CORES)
+        {
+            ktprintf("SMP: only using %d of %llu cores\n", MAX_CORES, smp->cpu_count);
+            break;
+        }
+        // The core is spinning on goto_address
+        __atomic_store_n(&info->goto_address, entry, __ATOMIC_SEQ_CST);
+        started++;
+    }
+    // Wait until every core has its local data, so cpu_count is final
+    const uint8_t expected = cpu_count() + started;
+    while (cpu_count() < expected)
+        __asm__ volatile("pause");
+    ktprintf("SMP: %d cores online\n", expected);
+}
+
+void smp_kick(uint8_t cpuid)
+{
+    struct cpu_local_data *local = &cpu_locals[cpuid];
+    if (local == cpu_local() || !__atomic_load_n(&local->idle, __ATOMIC_SEQ_CST))
+        return;
+    // The timer interrupt does everything an idle core needs
+    lapic_send_ipi(local->lapic_id, CLOCKEVENT_VECTOR);
+}
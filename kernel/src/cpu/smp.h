@@ -1,9 +1,18 @@
-#include <stdint.h>
-#include "userspace/proc.h"
+#pragma once
 
 // Maximum number of cores we support
 #define MAX_CORES 8
 
+// Offset of kernel_stack_top in cpu_local_data for the assembly files
+#define CPU_LOCAL_KERNEL_STACK_TOP 16
+
+#ifndef __ASSEMBLER__
+#include <stddef.h>
+#include <stdint.h>
+#include "limine.h"
+#include "mem/mem.h"
+#include "userspace/proc.h"
+
 /**
  * Each CPU core has some kind of local storage which it should have access to.
  * This structure holds the variables which each cpu must use locally. For
@@ -22,6 +31,14 @@ struct cpu_local_data {
    * in order to make my life easier in the assembly files.
    */
   uint64_t scratchpad[1];
+
+  /**
+   * Where syscalls and interrupts from userspace switch their stack to. It
+   * is the kernel stack of the process running on this core, so the entry
+   * stacks are per core and the processes only pay for their kernel stack.
+   * See tss_set_kernel_stack.
+   */
+  uint64_t kernel_stack_top;
   
   // Simply, the CPU ID of this CPU. The value is in range of [0, MAX_CORES)
   uint8_t cpuid;
@@ -44,18 +61,45 @@ struct cpu_local_data {
    * and writes must be 32 bits wide or else, this won't work.
    */
   volatile uint32_t *lapic;
+  // The ID of the local APIC, which IPIs to this core are sent to
+  uint32_t lapic_id;
 
   // What was the last running process on this CPU.
-  // This is needed because we lazily load some states like FPU
-  // in memory if the running process is not equal to the last running
-  // process.
+  // This is needed because we lazily load some states like the GS base
+  // if the running process is not equal to the last running process.
   struct process *last_running_process;
 
-  // Scratch area to save kernel FPU/SIMD state during interrupts/syscalls
-  __attribute__((aligned(16))) uint8_t kernel_fpu_state[512];
-  // Nesting depth for kernel_fpu_begin/end pairs
-  int kernel_fpu_depth;
+  // The process whose user FPU state is in the registers of this core and
+  // newer than its save area, or NULL. See fpu.c.
+  struct process *fpu_owner;
+
+  // ASID of the address space installed on this core, and the one which
+  // was installed when the PCIDs last ran out. See vmm_switch_pagetable.
+  uint64_t active_asid;
+  uint64_t reserved_asid;
+  // The ASID generation whose PCIDs may still be in the TLB of this core
+  uint64_t asid_generation;
+  // The user pagetable in CR3 of this core or NULL. Other cores wait for
+  // it to change before freeing it, see vmm_user_pagetable_free.
+  pagetable_t user_pagetable;
+
+  // Free frames cached by this core in front of the buddy allocator.
+  // See kalloc/kfree in mem.c.
+  struct page_magazine page_magazine;
+
+  // The last kernel TLB epoch this core has flushed for. See vmm_tlb_sync.
+  uint64_t tlb_epoch;
+
+  // Where scheduler_start of this core continues when a process gives
+  // the core back
+  struct cpu_context kernel_context;
+
+  // Set while the core halts with nothing to run and its timer off. It
+  // only wakes up again for an interrupt, see smp_kick.
+  bool idle;
 };
+_Static_assert(offsetof(struct cpu_local_data, kernel_stack_top) == CPU_LOCAL_KERNEL_STACK_TOP,
+               "trampoline.S reads kernel_stack_top at CPU_LOCAL_KERNEL_STACK_TOP");
 
 /**
  * Gets a pointer to the local CPU structure that contains
@@ -71,3 +115,27 @@ uint8_t get_processor_id(void);
  * When each core is starting up, they shall call this function with
  */
 void cpu_local_setup(void);
+
+/**
+ * Number of cores which have called cpu_local_setup
+ */
+uint8_t cpu_count(void);
+
+/**
+ * Gets the local data of another core. Used to aggregate statistics.
+ */
+struct cpu_local_data *cpu_local_of(uint8_t cpuid);
+
+/**
+ * Starts the application processors which Limine reported. Each of them
+ * jumps to entry on the stack Limine gave it, and must call
+ * cpu_local_setup before anything else. Returns once all of them did.
+ */
+void smp_start_aps(volatile struct limine_smp_request *request, limine_goto_address entry);
+
+/**
+ * Wakes up the core cpuid with an IPI if it is idle, so that it looks for
+ * work and catches up with the kernel TLB epoch
+ */
+void smp_kick(uint8_t cpuid);
+#endif
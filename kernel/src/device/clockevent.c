@@ -0,0 +1,74 @@
+#include "clockevent.h"
+#include "common/printf.h"
+#include "cpu/asm.h"
+#include "cpu/smp.h"
+#include "device/rtc.h"
+
+/* How long the LAPIC timer is measured for in the one-shot mode */
+#define CALIBRATION_MS 10
+
+/* Timer of each core */
+static struct {
+    bool tsc_deadline;
+    // Ticks of the TSC in the TSC-deadline mode, of the LAPIC timer otherwise
+    uint64_t ticks_per_ms;
+} clockevents[MAX_CORES];
+
+/**
+ * Counts the ticks of the LAPIC timer in a millisecond
+ */
+static uint64_t lapic_timer_calibrate(void)
+{
+    lapic_write(LAPIC_TIMER, LAPIC_MASKED);
+    lapic_write(LAPIC_TICR, UINT32_MAX);
+    delay_ms(CALIBRATION_MS);
+    const uint32_t left = lapic_read(LAPIC_TCCR);
+    lapic_write(LAPIC_TICR, 0);
+    return (UINT32_MAX - left) / CALIBRATION_MS;
+}
+
+void clockevent_init(void)
+{
+    const uint8_t cpu = cpu_local()->cpuid;
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+    clockevents[cpu].tsc_deadline = (ecx & (1u << 24)) != 0; // CPUID.01H:ECX.TSC_DEADLINE
+
+    lapic_write(LAPIC_TDCR, LAPIC_X1_DIV);
+    if (clockevents[cpu].tsc_deadline)
+    {
+        clockevents[cpu].ticks_per_ms = rtc_tsc_frequency() / 1000;
+        lapic_write(LAPIC_TIMER, CLOCKEVENT_VECTOR | LAPIC_TSC_DEADLINE);
+        // The mode must be set before the deadline MSR is written
+        __asm__ volatile("mfence" ::: "memory");
+        wrmsr(IA32_TSC_DEADLINE_MSR, 0);
+    }
+    else
+    {
+        clockevents[cpu].ticks_per_ms = lapic_timer_calibrate();
+        lapic_write(LAPIC_TIMER, CLOCKEVENT_VECTOR); // one-shot
+    }
+    ktprintf("[CLOCKEVENT] Core %d: %s timer, %llu ticks/ms\n", cpu,
+             clockevents[cpu].tsc_deadline ? "TSC-deadline" : "one-shot LAPIC",
+             clockevents[cpu].ticks_per_ms);
+}
+
+void clockevent_arm(uint64_t delay_us)
+{
+    const uint8_t cpu = cpu_local()->cpuid;
+    uint64_t ticks = delay_us * clockevents[cpu].ticks_per_ms / 1000;
+    if (ticks == 0)
+        ticks = 1;
+    if (clockevents[cpu].tsc_deadline)
+        wrmsr(IA32_TSC_DEADLINE_MSR, get_tsc() + ticks);
+    else // a longer delay fires early and is armed again then
+        lapic_write(LAPIC_TICR, ticks > UINT32_MAX ? UINT32_MAX : (uint32_t)ticks);
+}
+
+void clockevent_stop(void)
+{
+    if (clockevents[cpu_local()->cpuid].tsc_deadline)
+        wrmsr(IA32_TSC_DEADLINE_MSR, 0);
+    else
+        lapic_write(LAPIC_TICR, 0);
+}
@@ -0,0 +1,25 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "device/pic.h"
+
+/* The vector of the timer interrupt of every core */
+#define CLOCKEVENT_VECTOR (T_IRQ0 + 0)
+
+/**
+ * Sets up the local APIC timer of this core to fire once per deadline
+ * instead of periodically. The TSC-deadline mode is used if the CPU has
+ * it, otherwise the one-shot mode with the timer frequency measured
+ * against the TSC. The timer is off until clockevent_arm.
+ */
+void clockevent_init(void);
+/**
+ * Makes the timer interrupt of this core fire once, delay_us from now.
+ * Replaces the deadline which was armed before.
+ */
+void clockevent_arm(uint64_t delay_us);
+/**
+ * Cancels the deadline of this core, if any
+ */
+void clockevent_stop(void);
@@ -169,11 +169,17 @@ static uintptr_t cpu_get_apic_base(void) {
   return msr & 0xfffff000;
 }
 
-/* Initialize local APIC */
+/* Initialize local APIC of this core */
 void lapic_init(void)
 {
+    // Every core sees its own LAPIC at the same address, so the first
+    // core maps it for all of them
+    static bool lapic_mapped = false;
     uint64_t apic_msr = cpu_get_apic_base();
-    vmm_init_lapic(apic_msr);
+    if (!lapic_mapped) {
+        vmm_init_lapic(apic_msr);
+        lapic_mapped = true;
+    }
     cpu_local()->lapic = (volatile uint32_t *)P2V(apic_msr);
     apic_msr |= (1UL << 11);
     wrmsr(IA32_APIC_BASE_MSR, apic_msr);
@@ -192,7 +198,8 @@ void lapic_init(void)
     lapic_write(LAPIC_EOI, 0);
     lapic_write(LAPIC_TPR, 0);
 
-    ktprintf("LAPIC initialized (ID: %d)\n", lapic_read(LAPIC_ID) >> 24);
+    cpu_local()->lapic_id = lapic_get_id();
+    ktprintf("LAPIC initialized (ID: %d)\n", cpu_local()->lapic_id);
 }
 
 void lapic_write(uint32_t off, uint32_t val)
@@ -218,6 +225,16 @@ uint32_t lapic_get_id(void)
     return lapic_read(LAPIC_ID) >> 24;
 }
 
+/* Sends a fixed interrupt with the given vector to the core with lapic_id */
+void lapic_send_ipi(uint32_t lapic_id, uint8_t vector)
+{
+    // Wait for the previous IPI of this core to leave
+    while (lapic_read(LAPIC_ICRLO) & LAPIC_ICR_PENDING)
+        __asm__ volatile("pause");
+    lapic_write(LAPIC_ICRHI, lapic_id << 24);
+    lapic_write(LAPIC_ICRLO, LAPIC_ICR_ASSERT | vector);
+}
+
 /* MADT parsing: adapted to find MADT pointer - parse_madt already implemented below */
 struct MADT *madt = NULL;
 
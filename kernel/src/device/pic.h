@@ -66,7 +66,12 @@
 #define LAPIC_SVR_ENABLE   0x00000100
 #define LAPIC_MASKED       0x00010000
 #define LAPIC_PERIODIC     0x00020000
+#define LAPIC_TSC_DEADLINE 0x00040000
 #define LAPIC_X1_DIV       0x0000000B
+#define LAPIC_ICR_PENDING  0x00001000
+#define LAPIC_ICR_ASSERT   0x00004000
+
+#define IA32_TSC_DEADLINE_MSR 0x6E0
 
 // Simple IOAPIC/LAPIC helpers in pic.c
 void ioapic_init(volatile struct limine_rsdp_request* rsdp_request);
@@ -81,6 +86,7 @@ void lapic_write(uint32_t off, uint32_t val);
 uint32_t lapic_read(uint32_t off);
 void lapic_send_eoi(void);
 uint32_t lapic_get_id(void);
+void lapic_send_ipi(uint32_t lapic_id, uint8_t vector);
 
 uint64_t parse_madt(volatile struct limine_rsdp_request* rsdp_request);
 
@@ -9,6 +9,6 @@
 
 void rtc_init(void);
 uint64_t rtc_now(void);
-double rtc_now_seconds(void);
 uint64_t rtc_now_us(void);
+uint64_t rtc_tsc_frequency(void);
 void delay_ms(uint64_t ms);
\ No newline at end of file
@@ -6,6 +6,7 @@
 #include "mem/mem.h"
 #include "mem/vmm.h"
 #include "mem/kmalloc.h"
+#include "mem/slab.h"
 #include <stddef.h>
 
 // NVMe register offsets and constants
@@ -100,9 +101,19 @@ typedef struct {
     uint16_t next_command_id;
 } nvme_device_data_t;
 
+// An I/O command in flight. The controller reads and writes the page
+// aligned bounce buffer instead of the caller's memory.
+typedef struct {
+    nvme_sq_entry_t command;
+    char *buffer;
+} nvme_request_t;
+
 // Global device counter for unique naming
 static uint32_t g_nvme_device_count = 0;
 
+// Cache of I/O requests, shared by all controllers
+static struct kmem_cache *nvme_request_cache = NULL;
+
 #define NEXT_CID(nvme) (__atomic_fetch_add(&(nvme)->next_command_id, 1, __ATOMIC_RELAXED))
 
 static void nvme_disable_device(nvme_device_data_t *nvme) {
@@ -148,6 +159,48 @@ static void nvme_do_one_cmd_synchronous(nvme_device_data_t *nvme, nvme_queue_t *
         queue->completion_queue_head;
 }
 
+// Constructor of nvme_request_cache. Fields which are the same for every
+// I/O command are set once here.
+static void nvme_request_ctor(void *object) {
+    nvme_request_t *req = object;
+    memset(&req->command, 0, sizeof(req->command));
+    req->command.nsid = NVME_NAMESPACE_INDEX;
+    req->buffer = NULL;
+}
+
+// Gets a request with a bounce buffer for a read or write of block_count
+// blocks at lba. Returns NULL if out of memory.
+static nvme_request_t *nvme_request_get(uint8_t opcode, uint64_t lba, uint32_t block_count) {
+    nvme_request_t *req = kmem_cache_alloc(nvme_request_cache);
+    if (!req) return NULL;
+    // Reads overwrite the buffer and writes fill it first, so skip zeroing
+    req->buffer = kalloc_flags(KALLOC_NOZERO);
+    if (!req->buffer) {
+        kmem_cache_free(nvme_request_cache, req);
+        return NULL;
+    }
+    req->command.opc = opcode;
+    req->command.cdw10 = lba;
+    req->command.cdw11 = (lba >> 32);
+    req->command.cdw12 = (block_count - 1) & 0xFFFF;
+    req->command.prp[0] = V2P(req->buffer);
+    return req;
+}
+
+static void nvme_request_put(nvme_request_t *req) {
+    kfree(req->buffer);
+    req->buffer = NULL;
+    kmem_cache_free(nvme_request_cache, req);
+}
+
+// Copies the request to the queue and waits for it to complete
+static void nvme_request_submit(nvme_device_data_t *nvme, nvme_queue_t *queue, nvme_request_t *req) {
+    volatile nvme_sq_entry_t *sq = &queue->submission_queue[queue->submission_queue_tail];
+    req->command.cid = NEXT_CID(nvme);
+    memcpy((void *)sq, &req->command, sizeof(nvme_sq_entry_t));
+    nvme_do_one_cmd_synchronous(nvme, queue);
+}
+
 static void nvme_create_io_queue(nvme_device_data_t *nvme) {
     volatile nvme_sq_entry_t *sq;
     
@@ -223,6 +276,12 @@ static int nvme_init(device_t *dev) {
     
     ktprintf("[NVME_DRIVER] Initializing NVMe at BAR %p\n", bar_addr);
     
+    if (!nvme_request_cache) {
+        nvme_request_cache = kmem_cache_create("nvme_request", sizeof(nvme_request_t), 0,
+                                               nvme_request_ctor);
+        if (!nvme_request_cache) return -1;
+    }
+
     // Allocate device data
     nvme_device_data_t *nvme = kcmalloc(sizeof(nvme_device_data_t));
     if (!nvme) return -1;
@@ -308,7 +367,7 @@ static int nvme_remove_op(device_t *dev)
 {
     if (!dev)
         return 0;
-    kfree((void*)dev->name);
+    kmfree((void*)dev->name);
     return 0;
 }
 
@@ -347,22 +406,11 @@ void nvme_write(uint64_t lba, uint32_t block_count, const char *buffer) {
     
     if (block_count * g_nvme->block_size > PAGE_SIZE) return;
     
-    char *aligned_buffer = kalloc();
-    memcpy(aligned_buffer, buffer, block_count * g_nvme->block_size);
-    
-    volatile nvme_sq_entry_t *sq =
-        &g_nvme->io_queue.submission_queue[g_nvme->io_queue.submission_queue_tail];
-    memset((void *)sq, 0, sizeof(nvme_sq_entry_t));
-    sq->opc = 1; // WRITE
-    sq->cid = NEXT_CID(g_nvme);
-    sq->nsid = NVME_NAMESPACE_INDEX;
-    sq->cdw10 = lba;
-    sq->cdw11 = (lba >> 32);
-    sq->cdw12 = (block_count - 1) & 0xFFFF;
-    sq->prp[0] = V2P(aligned_buffer);
-    
-    nvme_do_one_cmd_synchronous(g_nvme, &g_nvme->io_queue);
-    kfree(aligned_buffer);
+    nvme_request_t *req = nvme_request_get(1, lba, block_count); // WRITE
+    if (!req) panic("nvme_write: out of memory");
+    memcpy(req->buffer, buffer, block_count * g_nvme->block_size);
+    nvme_request_submit(g_nvme, &g_nvme->io_queue, req);
+    nvme_request_put(req);
 }
 
 void nvme_read(uint64_t lba, uint32_t block_count, char *buffer) {
@@ -370,22 +418,11 @@ void nvme_read(uint64_t lba, uint32_t block_count, char *buffer) {
     
     if (block_count * g_nvme->block_size > PAGE_SIZE) return;
     
-    char *aligned_buffer = kalloc();
-    
-    volatile nvme_sq_entry_t *sq =
-        &g_nvme->io_queue.submission_queue[g_nvme->io_queue.submission_queue_tail];
-    memset((void *)sq, 0, sizeof(nvme_sq_entry_t));
-    sq->opc = 2; // READ
-    sq->cid = NEXT_CID(g_nvme);
-    sq->nsid = NVME_NAMESPACE_INDEX;
-    sq->cdw10 = lba;
-    sq->cdw11 = (lba >> 32);
-    sq->cdw12 = block_count - 1;
-    sq->prp[0] = V2P(aligned_buffer);
-    
-    nvme_do_one_cmd_synchronous(g_nvme, &g_nvme->io_queue);
-    memcpy(buffer, aligned_buffer, block_count * g_nvme->block_size);
-    kfree(aligned_buffer);
+    nvme_request_t *req = nvme_request_get(2, lba, block_count); // READ
+    if (!req) panic("nvme_read: out of memory");
+    nvme_request_submit(g_nvme, &g_nvme->io_queue, req);
+    memcpy(buffer, req->buffer, block_count * g_nvme->block_size);
+    nvme_request_put(req);
 }
 
 uint32_t nvme_block_size(void) {
@@ -297,8 +297,8 @@ static int rtc_init(device_t *dev) {
     
     dev->driver_data = data;
     
-    ktprintf("[RTC_DRIVER] TSC frequency: %llu Hz (%f MHz)\n",
-             data->tsc_frequency, data->tsc_frequency / 1e6);
+    ktprintf("[RTC_DRIVER] TSC frequency: %llu Hz (%llu MHz)\n",
+             data->tsc_frequency, data->tsc_frequency / 1000000);
     ktprintf("[RTC_DRIVER] Initial RTC: %llu us\n", data->initial_rtc);
     
     return 0;
@@ -323,8 +323,8 @@ static int rtc_ioctl(device_t *dev, uint32_t cmd, uintptr_t arg) {
         case 2: { // Delay milliseconds
             uint64_t ms = (uint64_t)arg;
             uint64_t start = get_tsc();
-            double target_ticks = ((double)data->tsc_frequency / 1000.0) * (double)ms;
-            while ((double)(get_tsc() - start) < target_ticks)
+            uint64_t target_ticks = data->tsc_frequency / 1000 * ms;
+            while (get_tsc() - start < target_ticks)
                 __asm__ volatile("pause");
             return 0;
         }
@@ -380,10 +380,13 @@ uint64_t sys_time(void) {
     return rtc_now();
 }
 
-double rtc_now_seconds(void) {
-    return (double)rtc_now() / (double)RTC_PRECISION;
-}
-
 uint64_t rtc_now_us(void) {
     return rtc_now();
+}
+
+uint64_t rtc_tsc_frequency(void) {
+    if (!g_rtc_dev || !g_rtc_dev->driver_data) return 0;
+    uint64_t result;
+    driver_ioctl(g_rtc_dev, 1, (uintptr_t)&result);
+    return result;
 }
\ No newline at end of file
@@ -7,6 +7,7 @@
 #include "device/rtc.h"
 #include <zos/file.h>
 #include "mem/mem.h"
+#include "mem/slab.h"
 
 // Hardcoded values of GPT table which we make.
 // TODO: Parse the GPT table and find these values.
@@ -74,18 +75,71 @@ static struct dzFS main_filesystem = {
     .current_date = current_date,
 };
 
-#define MAX_INODES 64
-// A static list of inodes
+// All inodes which are open. Inodes are allocated from inode_cache when a
+// file is opened for the first time and freed when its last reference is
+// closed.
 static struct {
-  // List of all inodes on the memory
-  struct fs_inode inodes[MAX_INODES];
+  struct fs_inode *head;
   // A lock to disable mutual access
   struct spinlock lock;
 } fs_inode_list;
 
+static struct kmem_cache *inode_cache;
+
+// A page of file data which is kept for mmap. The inode owns one share of
+// the page and every mapping of it owns another one.
+struct fs_page {
+  // The page holds the file data at index * PAGE_SIZE
+  uint64_t index;
+  void *page;
+  struct fs_page *next;
+};
+
+static struct kmem_cache *fs_page_cache;
+
+/**
+ * Drops the cached pages of an inode which hold data between the pages
+ * first and last (inclusive). Mappings keep their own share of the pages.
+ * The inode lock must be held unless the inode is being freed.
+ */
+static void drop_cached_pages(struct fs_inode *inode, uint64_t first,
+                              uint64_t last) {
+  struct fs_page **link = &inode->pages;
+  while (*link != NULL) {
+    struct fs_page *entry = *link;
+    if (entry->index < first || entry->index > last) {
+      link = &entry->next;
+      continue;
+    }
+    *link = entry->next;
+    kfree(entry->page);
+    kmem_cache_free(fs_page_cache, entry);
+    inode->cached_pages--;
+  }
+}
+
+/**
+ * Copies data written to the file at offset into the cached pages which
+ * hold it. The pages are updated in place rather than dropped, so every
+ * mapping of them sees the write. The inode lock must be held.
+ */
+static void update_cached_pages(struct fs_inode *inode, const char *buffer,
+                                size_t len, size_t offset) {
+  for (struct fs_page *entry = inode->pages; entry != NULL;
+       entry = entry->next) {
+    const size_t page_start = entry->index * PAGE_SIZE;
+    if (page_start >= offset + len || page_start + PAGE_SIZE <= offset)
+      continue;
+    const size_t start = MAX_SAFE(page_start, offset);
+    const size_t end = MIN_SAFE(page_start + PAGE_SIZE, offset + len);
+    memcpy((char *)entry->page + (start - page_start), buffer + (start - offset),
+           end - start);
+  }
+}
+
 /**
  * Opens the inode for the given file. Returns NULL
- * if there is no free inodes or the file does not exists.
+ * if we are out of memory or the file does not exists.
  *
  * Flags must correspond to the dzFS flags.
  *
@@ -101,22 +155,12 @@ struct fs_inode *fs_open(const char *path, const struct fs_inode *relative_to,
                                     &dnode, &parent, flags);
   if (result != DZFS_OK)
     return NULL;
-  // Look for an inode
-  struct fs_inode *inode = NULL, *free_inode = NULL;
+  // Look for an inode. The dnode of an inode never changes while it is on
+  // the list, so the list lock is enough here.
+  struct fs_inode *inode;
   spinlock_lock(&fs_inode_list.lock);
-  for (int i = 0; i < MAX_INODES; i++) {
-    // Note: We have to lock here as well because of races that
-    // can happen if another core is trying to delete an inode and another
-    // is opening one.
-    spinlock_lock(&fs_inode_list.inodes[i].lock);
-    if (fs_inode_list.inodes[i].type == INODE_EMPTY) {
-      // We save a free inode in case that we end up not having this inode in
-      // the list of open inodes
-      free_inode = &fs_inode_list.inodes[i];
-      spinlock_unlock(&fs_inode_list.inodes[i].lock);
-    } else if (fs_inode_list.inodes[i].dnode == dnode) {
-      // We found the inode!
-      inode = &fs_inode_list.inodes[i];
+  for (inode = fs_inode_list.head; inode != NULL; inode = inode->next) {
+    if (inode->dnode == dnode) {
       // Note for myself: I'm not sure about this. The whole goddamn
       // file system is racy and buggy as fuck. If we set the parent
       // each time we move this inode, I think we won't have an issue
@@ -124,15 +168,12 @@ struct fs_inode *fs_open(const char *path, const struct fs_inode *relative_to,
       // to set the inode->parent_dnode as parent.
       // Even setting it MIGHT cause some race issues.
       __atomic_add_fetch(&inode->reference_count, 1, __ATOMIC_RELAXED);
-      spinlock_unlock(&fs_inode_list.inodes[i].lock);
       break;
-    } else { // Some other in use file, just unlock the spinlock
-      spinlock_unlock(&fs_inode_list.inodes[i].lock);
     }
   }
-  // Did we found an inode? If not, did we found a free inode?
-  if (inode == NULL && free_inode != NULL) {
-    inode = free_inode;
+  // Did we found an inode? If not, make a new one.
+  if (inode == NULL && (inode = kmem_cache_alloc(inode_cache)) != NULL) {
+    memset(inode, 0, sizeof(*inode));
     inode->dnode = dnode;
     inode->parent_dnode = parent;
     inode->reference_count = 1;
@@ -154,6 +195,10 @@ struct fs_inode *fs_open(const char *path, const struct fs_inode *relative_to,
       panic("open: invalid dnode type");
       break;
     }
+    inode->next = fs_inode_list.head;
+    if (fs_inode_list.head != NULL)
+      fs_inode_list.head->prev = inode;
+    fs_inode_list.head = inode;
   }
   spinlock_unlock(&fs_inode_list.lock);
   return inode;
@@ -172,14 +217,20 @@ void fs_dup(struct fs_inode *inode) {
  * frees it if needed.
  */
 void fs_close(struct fs_inode *inode) {
-  spinlock_lock(&inode->lock);
+  // Take the list lock so that fs_open can not find the inode while it is
+  // being freed
+  spinlock_lock(&fs_inode_list.lock);
   if (__atomic_sub_fetch(&inode->reference_count, 1, __ATOMIC_ACQ_REL) == 0) {
-    inode->type = INODE_EMPTY;
-    inode->dnode = 0;
-    inode->parent_dnode = 0;
-    inode->size = 0;
+    if (inode->prev != NULL)
+      inode->prev->next = inode->next;
+    else
+      fs_inode_list.head = inode->next;
+    if (inode->next != NULL)
+      inode->next->prev = inode->prev;
+    drop_cached_pages(inode, 0, UINT64_MAX);
+    kmem_cache_free(inode_cache, inode);
   }
-  spinlock_unlock(&inode->lock);
+  spinlock_unlock(&fs_inode_list.lock);
 }
 
 /**
@@ -199,6 +250,8 @@ int fs_write(struct fs_inode *inode, const char *buffer, size_t len,
   // Increase the file size if needed
   if (offset + len > inode->size)
     inode->size = offset + len;
+  // Both existing and future mappings must see the new data
+  update_cached_pages(inode, buffer, len, offset);
   spinlock_unlock(&inode->lock);
   return (int)len;
 }
@@ -217,6 +270,71 @@ int fs_read(struct fs_inode *inode, char *buffer, size_t len, size_t offset) {
   return result;
 }
 
+/**
+ * Reads a page of a file into a new cache entry. The inode lock must be
+ * held. Returns NULL on error.
+ */
+static struct fs_page *read_page(struct fs_inode *inode, uint64_t index) {
+  struct fs_page *entry = kmem_cache_alloc(fs_page_cache);
+  if (entry == NULL)
+    return NULL;
+  entry->page = kalloc_for_page_cache();
+  if (entry->page == NULL) {
+    kmem_cache_free(fs_page_cache, entry);
+    return NULL;
+  }
+  int result = dzfs_read(&main_filesystem, inode->dnode, entry->page,
+                         PAGE_SIZE, index * PAGE_SIZE);
+  if (result < 0) {
+    kfree(entry->page);
+    kmem_cache_free(fs_page_cache, entry);
+    return NULL;
+  }
+  memset((char *)entry->page + result, 0, PAGE_SIZE - result);
+  entry->index = index;
+  return entry;
+}
+
+/**
+ * Gets the page which holds the file data at offset index * PAGE_SIZE. The
+ * part of the page past the end of the file is zeroed. The page is read
+ * from the disk on the first call and then kept with the inode, so mapping
+ * the same part of a file again does not touch the disk.
+ *
+ * The caller owns a share of the page and frees it with kfree. The page
+ * must not be written as it may be mapped in other processes. Returns NULL
+ * on error.
+ */
+void *fs_get_page(struct fs_inode *inode, uint64_t index) {
+  spinlock_lock(&inode->lock);
+  struct fs_page **link = &inode->pages, *entry;
+  while ((entry = *link) != NULL && entry->index != index)
+    link = &entry->next;
+  if (entry != NULL) {
+    // Unlink it to move it to the front
+    *link = entry->next;
+  } else {
+    entry = read_page(inode, index);
+    if (entry == NULL) {
+      spinlock_unlock(&inode->lock);
+      return NULL;
+    }
+    if (inode->cached_pages == FS_MAX_CACHED_PAGES) {
+      // Evict the least recently used page
+      struct fs_page *last = inode->pages;
+      while (last->next != NULL)
+        last = last->next;
+      drop_cached_pages(inode, last->index, last->index);
+    }
+    inode->cached_pages++;
+  }
+  entry->next = inode->pages;
+  inode->pages = entry;
+  mem_page_share(entry->page);
+  spinlock_unlock(&inode->lock);
+  return entry->page;
+}
+
 /**
  * Renames a file or directory and updates all effected inodes.
  */
@@ -326,6 +444,10 @@ bool fs_ensure_userspace_prog(struct dzFS* fs, unsigned char* prog, unsigned int
  * and load metadata of it in the memory.
  */
 void fs_init(void) {
+  inode_cache = kmem_cache_create("fs_inode", sizeof(struct fs_inode), 0, NULL);
+  fs_page_cache = kmem_cache_create("fs_page", sizeof(struct fs_page), 0, NULL);
+  if (inode_cache == NULL || fs_page_cache == NULL)
+    panic("fs: out of memory");
   // Block size of the dzFS must be divisible by the NVMe block size
   if (DZFS_BLOCK_SIZE % nvme_block_size() != 0)
     panic("fs/nvme indivisible block size");
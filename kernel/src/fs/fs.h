@@ -3,6 +3,8 @@
 #include <stddef.h>
 #include <stdint.h>
 
+struct fs_page;
+
 // Each inode which represents a dnode and a reference counted
 // value which represents the number of files which are using this
 // inode
@@ -19,11 +21,20 @@ struct fs_inode {
   uint32_t size;
   // How many of file are using this inode
   uint32_t reference_count;
+  // Pages of the file which are mapped with mmap, most recently used first
+  struct fs_page *pages;
+  // Number of pages in the list above
+  uint32_t cached_pages;
+  // Links in the list of open inodes
+  struct fs_inode *prev, *next;
 };
 
 // Maximum path length to prevent DoS
 #define MAX_PATH_LENGTH 4096
 
+// Most pages of a single file which are kept in memory for mmap
+#define FS_MAX_CACHED_PAGES 64
+
 struct fs_inode *fs_open(const char *path, const struct fs_inode *relative_to,
                          uint32_t flags);
 void fs_close(struct fs_inode *inode);
@@ -31,6 +42,7 @@ void fs_dup(struct fs_inode *inode);
 int fs_write(struct fs_inode *inode, const char *buffer, size_t len,
              size_t offset);
 int fs_read(struct fs_inode *inode, char *buffer, size_t len, size_t offset);
+void *fs_get_page(struct fs_inode *inode, uint64_t index);
 int fs_rename(const char *old_path, const char *new_path,
               const struct fs_inode *relative_to);
 int fs_delete(const char *path, const struct fs_inode *relative_to);
@@ -1,10 +1,13 @@
 // syscall.c
 #include <zos/syscall.h>
 #include "dzfs.h"
+#include "common/lib.h"
 #include "common/printf.h"
 #include "device.h"
 #include "file.h"
 #include <zos/file.h>
+#include "mem/uaccess.h"
+#include "mem/vma.h"
 #include "mem/vmm.h"
 #include "userspace/proc.h"
 #include "mem/kmalloc.h"
@@ -15,14 +18,10 @@
 */
 char *validate_user_string(const char *user_str, size_t max_len)
 {
-	struct process *p = my_process();
-	if (!p) return NULL;
-
 	char *kernel_buf = kmalloc(max_len);
 	if (!kernel_buf) return NULL;
 
-	int result = vmm_copy_user_string(p->pagetable, user_str, kernel_buf, max_len);
-	if (result < 0) {
+	if (strncpy_from_user(kernel_buf, user_str, max_len) < 0) {
 		kmfree(kernel_buf);
 		return NULL;
 	}
@@ -31,23 +30,89 @@ char *validate_user_string(const char *user_str, size_t max_len)
 }
 
 /**
- * Validate a user pointer for read access.
+ * Validate a user pointer for read access. Only for buffers which are
+ * handed to drivers as they are; everything else uses copy_from_user.
+ * Populating a range checks every page of it already.
  */
 bool validate_user_read(const void *ptr, size_t len)
 {
 	struct process *p = my_process();
 	if (!p) return false;
-	return vmm_validate_user_ptr(p->pagetable, ptr, len, false);
+	return vma_populate(&p->vm, p->pagetable, (uint64_t)ptr, len, false) == len;
 }
 
 /**
- * Validate a user pointer for write access.
+ * Validate a user pointer for write access. Like validate_user_read, only
+ * for buffers of drivers.
  */
 bool validate_user_write(void *ptr, size_t len)
 {
 	struct process *p = my_process();
 	if (!p) return false;
-	return vmm_validate_user_ptr(p->pagetable, ptr, len, true);
+	return vma_populate(&p->vm, p->pagetable, (uint64_t)ptr, len, true) == len;
+}
+
+/**
+ * Reads a file into a user buffer a page at a time through a kernel page,
+ * so the file system never faults on user memory while it holds its locks.
+ * Returns the number of bytes read or -1.
+ */
+static int read_file_to_user(int fd, char *buffer, size_t len)
+{
+	char *bounce = kalloc_flags(KALLOC_NOZERO);
+	if (!bounce) return -1;
+
+	size_t done = 0;
+	int result = 0;
+	while (done < len) {
+		const size_t chunk = MIN_SAFE(len - done, PAGE_SIZE);
+		const int n = file_read(fd, bounce, chunk);
+		if (n < 0) {
+			result = -1;
+			break;
+		}
+		if (copy_to_user(buffer + done, bounce, n) < 0) {
+			// The bytes were never delivered
+			my_process()->open_files[fd].offset -= n;
+			result = -1;
+			break;
+		}
+		done += n;
+		if ((size_t)n < chunk) break;
+	}
+
+	kfree(bounce);
+	return done > 0 ? (int)done : result;
+}
+
+/**
+ * Writes a user buffer to a file a page at a time, like read_file_to_user.
+ * Returns the number of bytes written or -1.
+ */
+static int write_file_from_user(int fd, const char *buffer, size_t len)
+{
+	char *bounce = kalloc_flags(KALLOC_NOZERO);
+	if (!bounce) return -1;
+
+	size_t done = 0;
+	int result = 0;
+	while (done < len) {
+		const size_t chunk = MIN_SAFE(len - done, PAGE_SIZE);
+		if (copy_from_user(bounce, buffer + done, chunk) < 0) {
+			result = -1;
+			break;
+		}
+		const int n = file_write(fd, bounce, chunk);
+		if (n < 0) {
+			result = -1;
+			break;
+		}
+		done += n;
+		if ((size_t)n < chunk) break;
+	}
+
+	kfree(bounce);
+	return done > 0 ? (int)done : result;
 }
 
 /**
@@ -89,11 +154,6 @@ int sys_read(int fd, void *buffer, size_t len) {
 		return -1; // EBADF
 	}
 
-	// Validate buffer is writable
-	if (!validate_user_write(buffer, len)) {
-		return -1; // EFAULT
-	}
-
 	// Check if fd is readable
 	if (!p->open_files[fd].readble) {
 		return -1; // EBADF
@@ -102,10 +162,11 @@ int sys_read(int fd, void *buffer, size_t len) {
 	// Perform read based on type
 	switch (p->open_files[fd].type) {
 	case FD_INODE:
-		return file_read(fd, buffer, len);
+		return read_file_to_user(fd, buffer, len);
 	case FD_DEVICE: {
 		struct device *dev = device_get(p->open_files[fd].structures.device);
 		if (dev == NULL) return -1;
+		if (!validate_user_write(buffer, len)) return -1; // EFAULT
 		return dev->read((char *)buffer, len);
 	}
 	default:
@@ -123,11 +184,6 @@ int sys_write(int fd, const void *buffer, size_t len) {
 		return -1; // EBADF
 	}
 
-	// Validate buffer is readable
-	if (!validate_user_read(buffer, len)) {
-		return -1; // EFAULT
-	}
-
 	// Check if fd is writable
 	if (!p->open_files[fd].writable) {
 		return -1; // EBADF
@@ -136,10 +192,11 @@ int sys_write(int fd, const void *buffer, size_t len) {
 	// Perform write based on type
 	switch (p->open_files[fd].type) {
 	case FD_INODE:
-		return file_write(fd, buffer, len);
+		return write_file_from_user(fd, buffer, len);
 	case FD_DEVICE: {
 		struct device *dev = device_get(p->open_files[fd].structures.device);
 		if (dev == NULL) return -1;
+		if (!validate_user_read(buffer, len)) return -1; // EFAULT
 		return dev->write((const char *)buffer, len);
 	}
 	default:
@@ -324,14 +381,17 @@ int sys_readdir(int fd, void *buffer, size_t len) {
 		return -1;
 	}
 
-	// Validate buffer
-	if (!validate_user_write(buffer, len)) {
-		return -1;
-	}
+	// Entries are built in a zeroed kernel page, so copying all of it
+	// leaks nothing
+	char *bounce = kcalloc();
+	if (!bounce) return -1;
+	const size_t chunk = MIN_SAFE(len, PAGE_SIZE);
 
 	// Read directories
-	int result = fs_readdir(p->open_files[fd].structures.inode, buffer, len,
+	int result = fs_readdir(p->open_files[fd].structures.inode, bounce, chunk,
 	                        p->open_files[fd].offset);
+	if (result > 0 && copy_to_user(buffer, bounce, chunk) < 0) result = -1;
+	kfree(bounce);
 	if (result <= 0) return result;
 
 	// Save how many entries we have read
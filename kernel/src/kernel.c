@@ -20,7 +20,9 @@
 #include "userspace/syscall.h"
 #include "common/term.h"
 #include "cpu/fpu.h"
+#include "zos/memops.h"
 #include "mem/kmalloc.h"
+#include "mem/slab.h"
 #include <stddef.h>
 #include <stdint.h>
 
@@ -73,6 +75,15 @@ __attribute__((
         .revision = 0,
 };
 
+__attribute__((
+    used,
+    section(".limine_requests")
+)) static volatile struct limine_smp_request
+    smp_request = {
+        .id = LIMINE_SMP_REQUEST,
+        .revision = 0,
+};
+
 const struct limine_framebuffer_response* get_framebuffer_response(void) {
     return framebuffer_request.response;
 }
@@ -82,22 +93,27 @@ struct limine_framebuffer *get_framebuffer()
     return framebuffer_request.response->framebuffers[0];
 }
 
-static uint32_t rng_state = 2463534242U;
+// xorshift32 state of each core, so the stress tests may run on all of
+// them at once. Zero until the first use of a core.
+static uint32_t rng_state[MAX_CORES];
 
 void srand_custom(uint32_t seed)
 {
     if (seed == 0)
         seed = 1;
-    rng_state = seed;
+    rng_state[cpu_local()->cpuid] = seed;
 }
 
 uint32_t rand_custom()
 {
-    uint32_t x = rng_state;
+    const uint8_t cpu = cpu_local()->cpuid;
+    uint32_t x = rng_state[cpu];
+    if (x == 0)
+        x = 2463534242U + cpu; // a different sequence on each core
     x ^= x << 13;
     x ^= x >> 17;
     x ^= x << 5;
-    rng_state = x;
+    rng_state[cpu] = x;
     return x;
 }
 
@@ -115,8 +131,8 @@ void km_test()
     void *d = kcmalloc(4096);
     memset_int8_t(a, 0x70, 10);
     memset_int8_t(b, 0x47, 12);
-    memset_int64_t(b, 0x12, 256);
-    memset(b, 0x23, 4096);
+    memset_int64_t(c, 0x12, 256);
+    memset(d, 0x23, 4096);
     kmfree(a);
     kmfree(b);
     kmfree(c);
@@ -130,6 +146,30 @@ extern void serial_set_global(device_t* dev);
 extern void fb_set_global(device_t* dev);
 extern void nvme_set_global(device_t* dev);
 
+/**
+ * Entry point of the application processors. Limine starts them on its
+ * own pagetable, which already has the kernel mapped at the same place.
+ */
+static void kmain_ap(struct limine_smp_info *info)
+{
+    (void)info;
+    cpu_local_setup();
+    fpu_enable();
+    gdt_init();
+    vmm_init_pcid();
+    idt_load();
+    tss_init_and_load();
+    lapic_init();
+    init_syscall_table();
+
+#ifdef DZOS_BOOT_BENCHMARKS
+    kmalloc_stress_test();
+#endif
+    scheduler_start();
+
+    halt();
+}
+
 void kmain(void)
 {
     set_output_mode(OUTPUT_SERIAL);
@@ -140,6 +180,7 @@ void kmain(void)
     }
 
     fpu_enable();
+    memops_init();
 
     gdt_init();
     cpu_local_setup();
@@ -147,11 +188,22 @@ void kmain(void)
     // Memory initialization
     init_mem(hhdm_request.response->offset, memmap_request.response);
     vmm_init_kernel(*kernel_address_request.response);
+    vmm_init_pcid();
     kmalloc_init();
+    vmm_init_kernel_stacks();
 
     // === EARLY DEVICE INITIALIZATION (RTC for timestamps) ===
     device_manager_early_init();
     km_test();
+#ifdef DZOS_BOOT_BENCHMARKS
+    mem_stress_test();
+    vmm_bench_pagetables();
+    vmm_bench_vmalloc();
+    vmm_bench_context_switch();
+    vmm_bench_huge_pages();
+    memops_bench();
+    slab_stress_test();
+#endif
 
     idt_init();
     tss_init_and_load();
@@ -190,6 +242,11 @@ void kmain(void)
     init_syscall_table();
 
     enable_spinlocks(true);
+    smp_start_aps(&smp_request, kmain_ap);
+#ifdef DZOS_BOOT_BENCHMARKS
+    // The other cores join in from kmain_ap
+    kmalloc_stress_test();
+#endif
 
     scheduler_start();
 
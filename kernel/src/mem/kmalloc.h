@@ -4,7 +4,7 @@
 #include <stdint.h>
 
 /**
- * Initialize the kernel memory allocator.
+ * Initialize the kernel memory allocator by creating its slab caches.
  * Must be called once during kernel initialization, after init_mem().
  */
 void kmalloc_init(void);
@@ -13,9 +13,11 @@ void kmalloc_init(void);
  * Allocate n bytes of kernel memory.
  *
  * Memory allocation strategy:
- * - Sizes < 16 bytes: Contiguous arena allocator (bitmap-based, ~240 objects/page)
- * - Sizes 16-2048 bytes: Slab allocator (power-of-2 size classes)
- * - Sizes > 2048 bytes: Multi-page allocator (contiguous pages via kalloc_pages)
+ * - Sizes up to 2048 bytes: Slab caches of power-of-2 size classes (16 bytes minimum)
+ * - Sizes > 2048 bytes: Multi-page allocator (contiguous pages via kalloc_pages),
+ *   falling back to vmalloc when no contiguous run is free. Such blocks are
+ *   only virtually contiguous, so do not hand them to devices as one
+ *   physical range. kmfree() returns them with vfree().
  *
  * @param n Number of bytes to allocate (minimum 1)
  * @return Pointer to allocated memory, or NULL on failure
@@ -35,8 +37,16 @@ void* kcmalloc(size_t n);
  * Free memory previously allocated by kmalloc() or kcmalloc().
  * Safe to call with NULL pointer (no-op).
  *
- * Automatically detects allocation type (arena/slab/large) via magic numbers.
+ * Automatically detects allocation type (slab/large) from the page it is in.
  *
  * @param p Pointer to memory to free, or NULL
  */
-void kmfree(void* p);
\ No newline at end of file
+void kmfree(void* p);
+
+#ifdef DZOS_BOOT_BENCHMARKS
+/**
+ * Concurrent kmalloc/kmfree stress test. Every online core must call it,
+ * once all of them are online.
+ */
+void kmalloc_stress_test(void);
+#endif
@@ -3,103 +3,212 @@
 #include "common/lib.h"
 #include "common/spinlock.h"
 #include "common/printf.h"
+#include "cpu/asm.h"
+#include "cpu/smp.h"
+#include "device/rtc.h"
 
 /* HHDM offset */
 volatile uint64_t hhdm_offset;
 /* Maximum physical address end (one past the last byte) observed in memmap */
 volatile uint64_t phys_max_end = 0;
 
-/* Free page node used for free list (freed pages land here) */
-struct freepage_t {
-	struct freepage_t *next;
-};
-
-/* Region describing contiguous usable physical memory we haven't carved yet.
- * phys_cur points to the next free physical page inside the region; phys_end is one-past-last.
+/*
+ * Physical memory is managed by a binary buddy allocator. Every usable frame
+ * reported by Limine belongs to exactly one free block of order 0 to
+ * BUDDY_MAX_ORDER (a block of order n is 2^n contiguous, naturally aligned
+ * frames). Allocating splits larger blocks on demand and freeing merges a
+ * block with its buddy for as long as the buddy is free as a whole.
+ *
+ * Book-keeping lives in a frame descriptor array indexed by PFN, carved out
+ * of usable memory at init. Free lists are linked through the descriptors,
+ * so free frames themselves are never written to.
+ *
+ * Single pages do not go to the buddy allocator directly. Each core keeps a
+ * magazine of free frames in its cpu_local_data and only takes buddy_lock to
+ * move PAGE_MAGAZINE_BATCH frames when the magazine runs empty or full.
+ *
+ * Zeroed pages are served from a pool which the idle loop keeps filled (see
+ * mem_zero_pool_refill), so the allocating path rarely has to clear a page.
+ *
+ * A page can have several owners, for example when fork shares user pages
+ * between two address spaces. Its descriptor then counts the extra owners
+ * and kfree only releases the page once the last owner lets go.
  */
-struct mem_region {
-	uintptr_t phys_cur;   /* physical addr of next free page in region (page-aligned) */
-	uintptr_t phys_end;   /* physical address one-past-last page (page-aligned) */
-	struct mem_region *next;
+
+/* Frame descriptor flags */
+#define FRAME_FREE     (1u << 0)  /* head of a free block, order is valid */
+#define FRAME_RESERVED (1u << 1)  /* not owned by the allocator */
+#define FRAME_CACHED   (1u << 2)  /* sitting in a per-CPU magazine */
+#define FRAME_ZEROED   (1u << 3)  /* sitting in the pre-zeroed pool */
+#define FRAME_SLAB     (1u << 4)  /* backs a slab, next is its first PFN */
+
+/* End of list marker for free lists */
+#define FRAME_NONE UINT32_MAX
+
+struct frame {
+	uint32_t next;   /* next free block of the same order */
+	uint32_t prev;   /* previous free block of the same order */
+	uint8_t order;   /* order of the free block this frame is the head of */
+	uint8_t flags;
+	uint16_t shares; /* owners besides the first, see mem_page_share */
 };
 
-/* Heads */
-static struct freepage_t *freepages = NULL;      /* pages returned by kfree() */
-static struct mem_region *regions = NULL;        /* lazy regions from init_mem() */
+static struct frame *frames = NULL;  /* descriptor for each PFN */
+static uint64_t frame_count = 0;     /* number of descriptors */
+
+static uint32_t free_area[BUDDY_MAX_ORDER + 1];        /* free list heads */
+static uint64_t free_area_count[BUDDY_MAX_ORDER + 1];  /* blocks per order */
+static uint64_t free_pages_total = 0;
+static uint64_t managed_pages_total = 0;
+
+static struct spinlock buddy_lock;
 
-/* Locks */
-static struct spinlock freepages_lock;
-static struct spinlock regions_lock;
+/* How many pre-zeroed frames the idle loop keeps around (2MB) */
+#define ZERO_POOL_TARGET 512
+
+/* Pre-zeroed frames, linked through the next field of their descriptors so
+ * that the frames themselves stay zero */
+static uint32_t zero_pool_head = FRAME_NONE;
+static uint64_t zero_pool_count = 0;
+static uint64_t zero_pool_hits = 0;
+static uint64_t zero_pool_misses = 0;
+static struct spinlock zero_pool_lock;
 
 /* Init guard */
 static bool mem_initialized = false;
 
-/* Static pool for regions - used during early boot before allocator is ready */
-#define STATIC_REGION_POOL_SIZE 32  /* Increased from 16 to handle complex memory maps */
-static struct mem_region static_region_pool[STATIC_REGION_POOL_SIZE];
-static int static_region_pool_idx = 0;
-
 /* Helpers */
-static inline void push_free_page(void *page)
+static inline uint64_t frame_pfn(const void *page)
 {
-	struct freepage_t *p = (struct freepage_t *)page;
-	p->next = freepages;
-	freepages = p;
+	return V2P(page) / PAGE_SIZE;
 }
 
-static inline void *pop_free_page(void)
+static inline void *pfn_to_virt(uint64_t pfn)
 {
-	if (!freepages) return NULL;
-	void *p = freepages;
-	freepages = freepages->next;
-	return p;
+	return P2V(pfn * PAGE_SIZE);
 }
 
-/* Create and append a mem_region node. Caller must hold regions_lock.
- * Returns 0 on success, -1 on failure (caller should handle by panicking).
- */
-static int append_region(uintptr_t phys_start, uintptr_t phys_end)
+/* Smallest order which holds num_pages pages */
+static inline unsigned int pages_to_order(size_t num_pages)
 {
-	if (phys_start >= phys_end) {
-		return 0;  /* Empty region, not an error */
-	}
+	unsigned int order = 0;
+	while (((size_t)1 << order) < num_pages) order++;
+	return order;
+}
 
-	struct mem_region *r = NULL;
+static void free_list_push(uint64_t pfn, unsigned int order)
+{
+	struct frame *f = &frames[pfn];
+	f->order = order;
+	f->flags |= FRAME_FREE;
+	f->prev = FRAME_NONE;
+	f->next = free_area[order];
+	if (free_area[order] != FRAME_NONE)
+		frames[free_area[order]].prev = (uint32_t)pfn;
+	free_area[order] = (uint32_t)pfn;
+	free_area_count[order]++;
+}
 
-	/* Try dynamic allocation first (if allocator is ready) */
-	if (mem_initialized && freepages) {
-		r = (struct mem_region *)kalloc_for_page_cache();
+static void free_list_remove(uint64_t pfn, unsigned int order)
+{
+	struct frame *f = &frames[pfn];
+	if (f->prev != FRAME_NONE) frames[f->prev].next = f->next;
+	else free_area[order] = f->next;
+	if (f->next != FRAME_NONE) frames[f->next].prev = f->prev;
+	f->flags &= ~FRAME_FREE;
+	f->next = f->prev = FRAME_NONE;
+	free_area_count[order]--;
+}
+
+/* Return a block to the free lists and merge it with its buddies.
+ * Caller must hold buddy_lock. */
+static void buddy_free(uint64_t pfn, unsigned int order)
+{
+	free_pages_total += (uint64_t)1 << order;
+	while (order < BUDDY_MAX_ORDER) {
+		uint64_t buddy = pfn ^ ((uint64_t)1 << order);
+		if (buddy >= frame_count) break;
+		const struct frame *b = &frames[buddy];
+		if (!(b->flags & FRAME_FREE) || b->order != order) break;
+		free_list_remove(buddy, order);
+		pfn &= ~((uint64_t)1 << order);
+		order++;
 	}
+	free_list_push(pfn, order);
+}
 
-	/* Fall back to static pool if dynamic allocation failed or not ready yet */
-	if (!r) {
-		if (static_region_pool_idx >= STATIC_REGION_POOL_SIZE) {
-			ktprintf("ERROR: Exhausted static region pool (%d regions)!\n", 
-			         STATIC_REGION_POOL_SIZE);
-			ktprintf("       Attempted to add region: 0x%lx - 0x%lx (%lu bytes)\n",
-			         phys_start, phys_end, phys_end - phys_start);
-			return -1;  /* Caller should panic */
-		}
-		r = &static_region_pool[static_region_pool_idx++];
+/* Take a block of the given order, splitting larger blocks if needed.
+ * Caller must hold buddy_lock. Returns FRAME_NONE on OOM. */
+static uint64_t buddy_alloc(unsigned int order)
+{
+	unsigned int current = order;
+	while (current <= BUDDY_MAX_ORDER && free_area[current] == FRAME_NONE)
+		current++;
+	if (current > BUDDY_MAX_ORDER) return FRAME_NONE;
+
+	uint64_t pfn = free_area[current];
+	free_list_remove(pfn, current);
+
+	/* Give back the upper halves until the block is of the right size */
+	while (current > order) {
+		current--;
+		free_list_push(pfn + ((uint64_t)1 << current), current);
 	}
 
-	r->phys_cur = phys_start;
-	r->phys_end = phys_end;
-	r->next = NULL;
+	free_pages_total -= (uint64_t)1 << order;
+	return pfn;
+}
 
-	/* Append to linked list */
-	if (!regions) {
-		regions = r;
-	} else {
-		struct mem_region *it = regions;
-		while (it->next) it = it->next;
-		it->next = r;
+/* Free an arbitrary run of frames by splitting it into naturally aligned
+ * blocks. Caller must hold buddy_lock. */
+static void buddy_free_range(uint64_t pfn, uint64_t num_pages)
+{
+	while (num_pages) {
+		unsigned int order = 0;
+		while (order < BUDDY_MAX_ORDER &&
+		       (pfn & (((uint64_t)1 << (order + 1)) - 1)) == 0 &&
+		       ((uint64_t)1 << (order + 1)) <= num_pages)
+			order++;
+		buddy_free(pfn, order);
+		pfn += (uint64_t)1 << order;
+		num_pages -= (uint64_t)1 << order;
 	}
+}
 
-	return 0;
+/* Make sure a run of frames is something we handed out */
+static void check_owned(uint64_t pfn, uint64_t num_pages, const char *who)
+{
+	if (pfn + num_pages > frame_count) panic(who);
+	/* FRAME_FREE is only set on block heads, so also look for a free block
+	 * which starts below pfn and covers it. Blocks are aligned to their
+	 * size, so its head is pfn rounded down to some order. Heads inside
+	 * the run are caught by the loop below. */
+	for (unsigned int order = 1; order <= BUDDY_MAX_ORDER; order++) {
+		const struct frame *head = &frames[pfn & ~(((uint64_t)1 << order) - 1)];
+		if ((head->flags & FRAME_FREE) && head->order >= order)
+			panic(who);
+	}
+	for (uint64_t i = 0; i < num_pages; i++) {
+		if (frames[pfn + i].flags & (FRAME_FREE | FRAME_RESERVED | FRAME_CACHED | FRAME_ZEROED | FRAME_SLAB))
+			panic(who);
+	}
 }
 
-/* Initialize memory subsystem. Very fast: parse memory map and create regions only. */
+/* Drop one owner of a shared page. Returns false if the caller was the only
+ * owner and has to free the page. */
+static bool page_drop_share(uint64_t pfn)
+{
+	uint16_t shares = __atomic_load_n(&frames[pfn].shares, __ATOMIC_ACQUIRE);
+	while (shares != 0) {
+		if (__atomic_compare_exchange_n(&frames[pfn].shares, &shares, shares - 1, false,
+		                                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			return true;
+	}
+	return false;
+}
+
+/* Initialize memory subsystem. Builds the frame descriptors and hands every
+ * usable page to the buddy allocator. */
 void init_mem(uint64_t hhdm_offset_local,
               const struct limine_memmap_response *memory_map)
 {
@@ -111,7 +220,7 @@ void init_mem(uint64_t hhdm_offset_local,
 
 	hhdm_offset = hhdm_offset_local;
 
-	uint64_t total_pages = 0;
+	uint64_t usable_end = 0;
 	uint64_t region_count = 0;
 
 	ktprintf("Memory Map Analysis:\n");
@@ -141,43 +250,101 @@ void init_mem(uint64_t hhdm_offset_local,
         if (entry->base + entry->length > phys_max_end)
             phys_max_end = entry->base + entry->length;
 
-        /* Only process usable memory */
-        if (entry->type != LIMINE_MEMMAP_USABLE) continue;
+        if (entry->type == LIMINE_MEMMAP_USABLE &&
+            entry->base + entry->length > usable_end)
+            usable_end = entry->base + entry->length;
+	}
 
-		uintptr_t base = (uintptr_t)entry->base;
-		uintptr_t length = (uintptr_t)entry->length;
-		if (length < PAGE_SIZE) continue;
+	/* Carve the descriptor array out of the first usable entry big enough */
+	frame_count = usable_end / PAGE_SIZE;
+	const uint64_t frames_bytes = PAGE_ROUND_UP(frame_count * sizeof(struct frame));
+	uintptr_t frames_phys = 0;
+	bool frames_found = false;
+	for (uint64_t i = 0; i < memory_map->entry_count; ++i) {
+		const struct limine_memmap_entry *entry = memory_map->entries[i];
+		if (!entry || entry->type != LIMINE_MEMMAP_USABLE) continue;
+		uintptr_t aligned_base = PAGE_ROUND_UP(entry->base);
+		uintptr_t end = (entry->base + entry->length) & ~(uint64_t)(PAGE_SIZE - 1);
+		if (aligned_base < end && end - aligned_base >= frames_bytes) {
+			frames_phys = aligned_base;
+			frames_found = true;
+			break;
+		}
+	}
+	if (!frames_found) panic("init_mem: no room for frame descriptors");
+
+	frames = (struct frame *)P2V(frames_phys);
+	for (uint64_t pfn = 0; pfn < frame_count; pfn++) {
+		frames[pfn].next = frames[pfn].prev = FRAME_NONE;
+		frames[pfn].order = 0;
+		frames[pfn].flags = FRAME_RESERVED;
+		frames[pfn].shares = 0;
+	}
+	for (unsigned int order = 0; order <= BUDDY_MAX_ORDER; order++) {
+		free_area[order] = FRAME_NONE;
+		free_area_count[order] = 0;
+	}
 
-		uintptr_t aligned_base = (base + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
-		uintptr_t end = (base + length) & ~(PAGE_SIZE - 1);
+	/* Hand all usable memory (except the descriptors) to the buddy allocator */
+	for (uint64_t i = 0; i < memory_map->entry_count; ++i) {
+		const struct limine_memmap_entry *entry = memory_map->entries[i];
+		if (!entry || entry->type != LIMINE_MEMMAP_USABLE) continue;
+
+		uintptr_t aligned_base = PAGE_ROUND_UP(entry->base);
+		uintptr_t end = (entry->base + entry->length) & ~(uint64_t)(PAGE_SIZE - 1);
+		if (aligned_base == frames_phys) aligned_base += frames_bytes;
 		if (aligned_base >= end) continue;
 
-		uint64_t pages_in_region = (end - aligned_base) / PAGE_SIZE;
-		total_pages += pages_in_region;
+		const uint64_t first = aligned_base / PAGE_SIZE;
+		const uint64_t pages = (end - aligned_base) / PAGE_SIZE;
+		for (uint64_t pfn = first; pfn < first + pages; pfn++)
+			frames[pfn].flags = 0;
+		spinlock_lock(&buddy_lock);
+		buddy_free_range(first, pages);
+		spinlock_unlock(&buddy_lock);
+		managed_pages_total += pages;
 		region_count++;
-
-		/* Attempt to add region - panic if we run out of space */
-		spinlock_lock(&regions_lock);
-		int result = append_region(aligned_base, end);
-		spinlock_unlock(&regions_lock);
-
-		if (result != 0) {
-			panic("init_mem: failed to register memory region - increase STATIC_REGION_POOL_SIZE");
-		}
 	}
 
 	mem_initialized = true;
-	ktprintf("Memory initialized: %lu regions, %lu free pages (%lu MB)\n",
-	         region_count, total_pages, (total_pages * PAGE_SIZE) / (1024 * 1024));
+	ktprintf("Memory initialized: %lu regions, %lu free pages (%lu MB), %lu KB of frame descriptors\n",
+	         region_count, managed_pages_total,
+	         (managed_pages_total * PAGE_SIZE) / (1024 * 1024), frames_bytes / 1024);
+}
 
-	/* Warn if we used a lot of static pool */
-	if (static_region_pool_idx > STATIC_REGION_POOL_SIZE / 2) {
-		ktprintf("WARNING: Used %d/%d static region pool entries. Consider increasing pool size.\n",
-		         static_region_pool_idx, STATIC_REGION_POOL_SIZE);
+/* Move a batch of frames from the buddy allocator into a magazine.
+ * Interrupts must be disabled. */
+static void magazine_refill(struct page_magazine *mag)
+{
+	spinlock_lock(&buddy_lock);
+	while (mag->count < PAGE_MAGAZINE_BATCH) {
+		const uint64_t pfn = buddy_alloc(0);
+		if (pfn == FRAME_NONE) break;
+		frames[pfn].flags |= FRAME_CACHED;
+		mag->frames[mag->count++] = pfn_to_virt(pfn);
 	}
+	spinlock_unlock(&buddy_lock);
+	mag->refills++;
 }
 
-/* kfree: push page to freepages list */
+/* Give the oldest half of a full magazine back to the buddy allocator.
+ * Interrupts must be disabled. */
+static void magazine_drain(struct page_magazine *mag)
+{
+	spinlock_lock(&buddy_lock);
+	for (uint32_t i = 0; i < PAGE_MAGAZINE_BATCH; i++) {
+		const uint64_t pfn = frame_pfn(mag->frames[i]);
+		frames[pfn].flags &= ~FRAME_CACHED;
+		buddy_free(pfn, 0);
+	}
+	spinlock_unlock(&buddy_lock);
+	mag->count -= PAGE_MAGAZINE_BATCH;
+	memmove(&mag->frames[0], &mag->frames[PAGE_MAGAZINE_BATCH],
+	        mag->count * sizeof(mag->frames[0]));
+	mag->drains++;
+}
+
+/* kfree: give a single page back to this core's magazine */
 void kfree(void *page)
 {
 	if (!page) return;
@@ -186,225 +353,402 @@ void kfree(void *page)
 	uint64_t phys = V2P(page);
 	if (phys & (PAGE_SIZE - 1)) panic("kfree: V2P produced unaligned phys");
 
-	spinlock_lock(&freepages_lock);
 #if defined(DEBUG)
 	memset(page, 0xAA, PAGE_SIZE);
 #endif
-	push_free_page(page);
-	spinlock_unlock(&freepages_lock);
-}
-
-/* Try to allocate a page from regions (bump allocator). */
-static void *alloc_from_regions_for_page_cache(void)
-{
-	spinlock_lock(&regions_lock);
-	struct mem_region *prev = NULL;
-	struct mem_region *it = regions;
-	while (it) {
-		if (it->phys_cur < it->phys_end) {
-			uintptr_t phys = it->phys_cur;
-			it->phys_cur += PAGE_SIZE;
-			if (it->phys_cur >= it->phys_end) {
-				/* Region exhausted - unlink it */
-				if (prev) prev->next = it->next;
-				else regions = it->next;
-			}
-			spinlock_unlock(&regions_lock);
-			void *va = P2V(phys);
-			return va;
-		}
-		prev = it;
-		it = it->next;
-	}
-	spinlock_unlock(&regions_lock);
-	return NULL;
+	const uint64_t pfn = phys / PAGE_SIZE;
+	check_owned(pfn, 1, "kfree: double free or foreign page");
+	if (page_drop_share(pfn))
+		return;
+
+	const uint64_t flags = irq_save();
+	struct page_magazine *mag = &cpu_local()->page_magazine;
+	mag->frees++;
+	if (mag->count == PAGE_MAGAZINE_SIZE)
+		magazine_drain(mag);
+	else
+		mag->free_hits++;
+	frames[pfn].flags |= FRAME_CACHED;
+	mag->frames[mag->count++] = page;
+	irq_restore(flags);
 }
 
-/* kalloc: return a page and memset with pattern 2 */
-void *kalloc(void)
+/* Allocate a single page without touching its contents */
+static void *alloc_page(void)
 {
-	spinlock_lock(&freepages_lock);
-	void *page = pop_free_page();
-	spinlock_unlock(&freepages_lock);
-	if (page) {
-		memset(page, 0, PAGE_SIZE);
-		return page;
+	void *page = NULL;
+	const uint64_t flags = irq_save();
+	struct page_magazine *mag = &cpu_local()->page_magazine;
+	mag->allocs++;
+	if (mag->count == 0)
+		magazine_refill(mag);
+	else
+		mag->alloc_hits++;
+	if (mag->count != 0) {
+		page = mag->frames[--mag->count];
+		frames[frame_pfn(page)].flags &= ~FRAME_CACHED;
 	}
-
-	page = alloc_from_regions_for_page_cache();
-	if (!page) return NULL;
-	memset(page, 2, PAGE_SIZE);
+	irq_restore(flags);
 	return page;
 }
 
-/* kalloc_for_page_cache: same as kalloc but avoid clearing */
-void *kalloc_for_page_cache(void)
+/* Clear a page with non-temporal stores. The zeroed lines go straight to
+ * memory instead of evicting the working set of whoever runs next. */
+static void zero_page_nt(void *page)
 {
-	spinlock_lock(&freepages_lock);
-	void *page = pop_free_page();
-	spinlock_unlock(&freepages_lock);
-	if (page) return page;
+	uint64_t *p = (uint64_t *)page;
+	for (size_t i = 0; i < PAGE_SIZE / sizeof(uint64_t); i += 8) {
+		__asm__ volatile("movnti %1, 0(%0)\n\t"
+		                 "movnti %1, 8(%0)\n\t"
+		                 "movnti %1, 16(%0)\n\t"
+		                 "movnti %1, 24(%0)\n\t"
+		                 "movnti %1, 32(%0)\n\t"
+		                 "movnti %1, 40(%0)\n\t"
+		                 "movnti %1, 48(%0)\n\t"
+		                 "movnti %1, 56(%0)"
+		                 :: "r"(p + i), "r"(0ull) : "memory");
+	}
+}
 
-	page = alloc_from_regions_for_page_cache();
+/* Take a frame from the pre-zeroed pool, or NULL if it is empty */
+static void *zero_pool_pop(void)
+{
+	void *page = NULL;
+	spinlock_lock(&zero_pool_lock);
+	if (zero_pool_head != FRAME_NONE) {
+		const uint64_t pfn = zero_pool_head;
+		zero_pool_head = frames[pfn].next;
+		frames[pfn].next = FRAME_NONE;
+		frames[pfn].flags &= ~FRAME_ZEROED;
+		zero_pool_count--;
+		zero_pool_hits++;
+		page = pfn_to_virt(pfn);
+	} else {
+		zero_pool_misses++;
+	}
+	spinlock_unlock(&zero_pool_lock);
 	return page;
 }
 
-/* kcalloc: allocate and zero a page */
-void *kcalloc(void)
+/* Zero up to max_pages frames and put them in the pre-zeroed pool. Called
+ * from the idle loop. Returns how many pages were zeroed, which is zero
+ * once the pool is full. */
+size_t mem_zero_pool_refill(size_t max_pages)
 {
-	spinlock_lock(&freepages_lock);
-	void *page = pop_free_page();
-	spinlock_unlock(&freepages_lock);
-	if (page) {
-		memset(page, 0, PAGE_SIZE);
-		return page;
+	size_t zeroed = 0;
+	while (zeroed < max_pages &&
+	       __atomic_load_n(&zero_pool_count, __ATOMIC_RELAXED) < ZERO_POOL_TARGET) {
+		void *page = alloc_page();
+		if (!page) break;
+		zero_page_nt(page);
+		zeroed++;
+
+		const uint64_t pfn = frame_pfn(page);
+		spinlock_lock(&zero_pool_lock);
+		frames[pfn].flags |= FRAME_ZEROED;
+		frames[pfn].next = zero_pool_head;
+		zero_pool_head = (uint32_t)pfn;
+		zero_pool_count++;
+		spinlock_unlock(&zero_pool_lock);
+	}
+	/* Non-temporal stores are weakly ordered. Make them visible before
+	 * anyone can map one of these pages. */
+	if (zeroed)
+		__asm__ volatile("sfence" ::: "memory");
+	return zeroed;
+}
+
+/* kalloc_flags: return a page, zeroed unless KALLOC_NOZERO is given */
+void *kalloc_flags(unsigned int flags)
+{
+	if (flags & KALLOC_NOZERO) {
+		void *page = alloc_page();
+		/* Low on memory, the zero pool still has some */
+		return page ? page : zero_pool_pop();
 	}
 
-	page = alloc_from_regions_for_page_cache();
+	void *page = zero_pool_pop();
+	if (page) return page;
+	page = alloc_page();
 	if (!page) return NULL;
 	memset(page, 0, PAGE_SIZE);
 	return page;
 }
 
-/* ========== Multi-page allocation support ========== */
-
-/* Allocate multiple contiguous pages from regions.
- * This tries to find a contiguous block in a single region.
- */
-static void *alloc_contiguous_from_regions(size_t num_pages)
+/* kalloc: return a zeroed page */
+void *kalloc(void)
 {
-	if (num_pages == 0) return NULL;
-
-	size_t bytes_needed = num_pages * PAGE_SIZE;
-
-	spinlock_lock(&regions_lock);
-	struct mem_region *prev = NULL;
-	struct mem_region *it = regions;
-
-	while (it) {
-		uintptr_t avail = it->phys_end - it->phys_cur;
-
-		if (avail >= bytes_needed) {
-			// Found a region with enough contiguous space
-			uintptr_t phys = it->phys_cur;
-			it->phys_cur += bytes_needed;
+	return kalloc_flags(0);
+}
 
-			// Remove region if exhausted
-			if (it->phys_cur >= it->phys_end) {
-				if (prev) prev->next = it->next;
-				else regions = it->next;
-			}
+/* kalloc_for_page_cache: for pages which are overwritten anyway, skip clearing */
+void *kalloc_for_page_cache(void)
+{
+	return kalloc_flags(KALLOC_NOZERO);
+}
 
-			spinlock_unlock(&regions_lock);
-			void *va = P2V(phys);
-			return va;
-		}
+/* kcalloc: allocate and zero a page */
+void *kcalloc(void)
+{
+	return kalloc_flags(0);
+}
 
-		prev = it;
-		it = it->next;
-	}
+/* ========== Multi-page allocation support ========== */
 
-	spinlock_unlock(&regions_lock);
-	return NULL;
+/* Allocate num_pages contiguous pages without touching them. The request is
+ * rounded up to a buddy block and the unused tail is given back right away. */
+static void *alloc_pages(size_t num_pages)
+{
+	const unsigned int order = pages_to_order(num_pages);
+	if (order > BUDDY_MAX_ORDER) return NULL;
+
+	spinlock_lock(&buddy_lock);
+	const uint64_t pfn = buddy_alloc(order);
+	if (pfn != FRAME_NONE && num_pages < ((size_t)1 << order))
+		buddy_free_range(pfn + num_pages, ((uint64_t)1 << order) - num_pages);
+	spinlock_unlock(&buddy_lock);
+	if (pfn == FRAME_NONE) return NULL;
+	return pfn_to_virt(pfn);
 }
 
-/* Try to allocate contiguous pages from the freelist.
- * This is a best-effort approach - we check if we can find
- * num_pages consecutive pages in the freelist.
- */
-static void *alloc_contiguous_from_freelist(size_t num_pages)
+/* kalloc_pages: allocate num_pages contiguous pages */
+void *kalloc_pages(size_t num_pages)
 {
-	if (num_pages <= 1) return NULL;
-
-	spinlock_lock(&freepages_lock);
-
-	// Try to find contiguous pages in freelist
-	// This is O(n) and not guaranteed to succeed even if enough pages exist
-	struct freepage_t *prev = NULL;
-	struct freepage_t *it = freepages;
+	if (num_pages == 0) return NULL;
+	if (num_pages == 1) return kalloc();
 
-	while (it) {
-		uintptr_t base_phys = V2P(it);
-		bool found = true;
-		struct freepage_t *scan = it;
-		struct freepage_t *scan_prev = prev;
+	void *pages = alloc_pages(num_pages);
+	if (!pages) return NULL;
+	memset(pages, 2, num_pages * PAGE_SIZE);
+	return pages;
+}
 
-		// Check if next num_pages-1 pages are contiguous
-		for (size_t i = 1; i < num_pages && scan && found; i++) {
-			if (!scan->next) {
-				found = false;
-				break;
-			}
+/* kfree_pages: free multiple contiguous pages, merging them on the way */
+void kfree_pages(void *ptr, size_t num_pages)
+{
+	if (!ptr || num_pages == 0) return;
 
-			uintptr_t expected_phys = base_phys + (i * PAGE_SIZE);
-			uintptr_t actual_phys = V2P(scan->next);
+	uintptr_t va = (uintptr_t)ptr;
+	if (va & (PAGE_SIZE - 1)) panic("kfree_pages: unaligned pointer");
 
-			if (expected_phys != actual_phys) {
-				found = false;
-				break;
-			}
+	const uint64_t pfn = frame_pfn(ptr);
+	check_owned(pfn, num_pages, "kfree_pages: double free or foreign page");
+	spinlock_lock(&buddy_lock);
+	buddy_free_range(pfn, num_pages);
+	spinlock_unlock(&buddy_lock);
+}
 
-			scan_prev = scan;
-			scan = scan->next;
-		}
+/* Allocate a naturally aligned block of HUGE_PAGE_PAGES pages. Buddy blocks
+ * are aligned to their size, so an order 9 block can be mapped as a 2 MiB
+ * page. */
+void *kalloc_huge_page(unsigned int flags)
+{
+	void *page = alloc_pages(HUGE_PAGE_PAGES);
+	if (!page) return NULL;
+	if (!(flags & KALLOC_NOZERO)) memset(page, 0, HUGE_PAGE_SIZE);
+	return page;
+}
 
-		if (found && scan) {
-			// Found contiguous block! Remove all pages from freelist
-			void *result = it;
+/* Free a block from kalloc_huge_page. Its owners are counted on the first
+ * frame. */
+void kfree_huge_page(void *page)
+{
+	const uint64_t pfn = frame_pfn(page);
+	if (pfn % HUGE_PAGE_PAGES != 0) panic("kfree_huge_page: unaligned pointer");
+	check_owned(pfn, 1, "kfree_huge_page: double free or foreign page");
+	if (page_drop_share(pfn)) return;
+	kfree_pages(page, HUGE_PAGE_PAGES);
+}
 
-			if (prev) {
-				prev->next = scan->next;
-			} else {
-				freepages = scan->next;
-			}
+/* ========== Slab backing pages ========== */
 
-			spinlock_unlock(&freepages_lock);
-			return result;
-		}
+/* Allocate 2^order contiguous pages for a slab without clearing them. Every
+ * page is tagged with the first PFN of the slab so mem_slab_of can find the
+ * slab header from any address inside it. */
+void *mem_alloc_slab(unsigned int order)
+{
+	void *slab = order == 0 ? kalloc_flags(KALLOC_NOZERO) : alloc_pages((size_t)1 << order);
+	if (!slab) return NULL;
+	const uint64_t pfn = frame_pfn(slab);
+	for (uint64_t i = 0; i < ((uint64_t)1 << order); i++) {
+		frames[pfn + i].flags |= FRAME_SLAB;
+		frames[pfn + i].next = (uint32_t)pfn;
+	}
+	return slab;
+}
 
-		prev = it;
-		it = it->next;
+/* Give the pages of a slab allocated with mem_alloc_slab back */
+void mem_free_slab(void *slab, unsigned int order)
+{
+	const uint64_t pfn = frame_pfn(slab);
+	const uint64_t num_pages = (uint64_t)1 << order;
+	if (pfn + num_pages > frame_count) panic("mem_free_slab: foreign pages");
+	for (uint64_t i = 0; i < num_pages; i++) {
+		if (!(frames[pfn + i].flags & FRAME_SLAB) || frames[pfn + i].next != pfn)
+			panic("mem_free_slab: not a slab");
+		frames[pfn + i].flags &= ~FRAME_SLAB;
+		frames[pfn + i].next = FRAME_NONE;
 	}
+	if (order == 0) kfree(slab);
+	else kfree_pages(slab, num_pages);
+}
 
-	spinlock_unlock(&freepages_lock);
-	return NULL;
+/* First page of the slab which contains addr, or NULL if addr is not in a
+ * slab */
+void *mem_slab_of(const void *addr)
+{
+	const uint64_t pfn = frame_pfn(addr);
+	if (pfn >= frame_count || !(frames[pfn].flags & FRAME_SLAB)) return NULL;
+	return pfn_to_virt(frames[pfn].next);
 }
 
-/* kalloc_pages: allocate num_pages contiguous pages */
-void *kalloc_pages(size_t num_pages)
+/* Add an owner to an allocated page. Each owner frees the page with kfree. */
+void mem_page_share(void *page)
 {
-	if (num_pages == 0) return NULL;
-	if (num_pages == 1) return kalloc();
+	const uint64_t pfn = frame_pfn(page);
+	check_owned(pfn, 1, "mem_page_share: not allocated");
+	if (__atomic_fetch_add(&frames[pfn].shares, 1, __ATOMIC_RELAXED) == UINT16_MAX)
+		panic("mem_page_share: too many owners");
+}
 
-	// First try to find contiguous pages in freelist (fast path, rarely succeeds)
-	void *pages = alloc_contiguous_from_freelist(num_pages);
-	if (pages) {
-		memset(pages, 2, num_pages * PAGE_SIZE);
-		return pages;
-	}
+/* Whether a page has more than one owner */
+bool mem_page_shared(const void *page)
+{
+	const uint64_t pfn = frame_pfn(page);
+	return pfn < frame_count && __atomic_load_n(&frames[pfn].shares, __ATOMIC_ACQUIRE) != 0;
+}
 
-	// Slow path: allocate from regions (guaranteed contiguous)
-	pages = alloc_contiguous_from_regions(num_pages);
-	if (pages) {
-		memset(pages, 2, num_pages * PAGE_SIZE);
-		return pages;
+/* Snapshot of the allocator state */
+void mem_get_stats(struct mem_stats *stats)
+{
+	spinlock_lock(&buddy_lock);
+	stats->managed_pages = managed_pages_total;
+	stats->free_pages = free_pages_total;
+	for (unsigned int order = 0; order <= BUDDY_MAX_ORDER; order++)
+		stats->free_blocks[order] = free_area_count[order];
+	spinlock_unlock(&buddy_lock);
+
+	spinlock_lock(&zero_pool_lock);
+	stats->zeroed_pages = zero_pool_count;
+	stats->zero_pool_hits = zero_pool_hits;
+	stats->zero_pool_misses = zero_pool_misses;
+	spinlock_unlock(&zero_pool_lock);
+
+	stats->cached_pages = 0;
+	stats->magazine_allocs = stats->magazine_alloc_hits = 0;
+	stats->magazine_frees = stats->magazine_free_hits = 0;
+	stats->magazine_refills = stats->magazine_drains = 0;
+	for (uint8_t cpu = 0; cpu < cpu_count(); cpu++) {
+		const struct page_magazine *mag = &cpu_local_of(cpu)->page_magazine;
+		stats->cached_pages += mag->count;
+		stats->magazine_allocs += mag->allocs;
+		stats->magazine_alloc_hits += mag->alloc_hits;
+		stats->magazine_frees += mag->frees;
+		stats->magazine_free_hits += mag->free_hits;
+		stats->magazine_refills += mag->refills;
+		stats->magazine_drains += mag->drains;
 	}
-
-	return NULL;
 }
 
-/* kfree_pages: free multiple contiguous pages */
-void kfree_pages(void *ptr, size_t num_pages)
+/* Percentage of free memory which can not satisfy an allocation of the
+ * given order, i.e. the unusable free space index. */
+uint64_t mem_fragmentation(const struct mem_stats *stats, unsigned int order)
 {
-	if (!ptr || num_pages == 0) return;
+	if (stats->free_pages == 0) return 0;
+	uint64_t usable = 0;
+	for (unsigned int o = order; o <= BUDDY_MAX_ORDER; o++)
+		usable += stats->free_blocks[o] << o;
+	return (stats->free_pages - usable) * 100 / stats->free_pages;
+}
 
-	uintptr_t va = (uintptr_t)ptr;
-	if (va & (PAGE_SIZE - 1)) panic("kfree_pages: unaligned pointer");
+#ifdef DZOS_BOOT_BENCHMARKS
+extern uint32_t rand_range(uint32_t max);
 
-	// Free each page individually to freelist
-	// They'll naturally be contiguous in memory
-	for (size_t i = 0; i < num_pages; i++) {
-		void *page = (void*)(va + i * PAGE_SIZE);
-		kfree(page);
+/* Allocates and frees blocks of random order and checks that everything
+ * merges back. Reports the cost per operation and the fragmentation. */
+void mem_stress_test(void)
+{
+	#define STRESS_SLOTS 256
+	#define STRESS_OPS 20000
+	static void *slot_ptr[STRESS_SLOTS];
+	static size_t slot_pages[STRESS_SLOTS];
+	struct mem_stats before, during, after;
+	mem_get_stats(&before);
+
+	uint64_t ops = 0, failures = 0;
+	const uint64_t start = get_tsc();
+	for (int i = 0; i < STRESS_OPS; i++) {
+		const uint32_t slot = rand_range(STRESS_SLOTS);
+		if (slot_ptr[slot]) {
+			kfree_pages(slot_ptr[slot], slot_pages[slot]);
+			slot_ptr[slot] = NULL;
+		} else {
+			/* Mostly small blocks, sometimes large, sometimes not a power of two */
+			const unsigned int order = rand_range(8) == 0 ? rand_range(BUDDY_MAX_ORDER + 1) : rand_range(4);
+			size_t pages = (size_t)1 << order;
+			if (pages > 2 && rand_range(2)) pages -= rand_range(pages / 2);
+			slot_ptr[slot] = alloc_pages(pages);
+			slot_pages[slot] = pages;
+			if (!slot_ptr[slot]) failures++;
+		}
+		ops++;
+	}
+	const uint64_t cycles = get_tsc() - start;
+	mem_get_stats(&during);
+
+	for (int i = 0; i < STRESS_SLOTS; i++) {
+		if (slot_ptr[i]) kfree_pages(slot_ptr[i], slot_pages[i]);
+		slot_ptr[i] = NULL;
+	}
+	mem_get_stats(&after);
+
+	const uint64_t tsc_hz = rtc_tsc_frequency();
+	ktprintf("[bench] buddy: %llu ops, %llu failed, %llu ns/op\n",
+	         ops, failures, tsc_hz ? cycles * 1000000000ull / tsc_hz / ops : 0);
+	ktprintf("[bench] buddy: fragmentation at order 9: before %llu%%, loaded %llu%%, after %llu%%\n",
+	         mem_fragmentation(&before, 9), mem_fragmentation(&during, 9),
+	         mem_fragmentation(&after, 9));
+	if (after.free_pages + after.cached_pages + after.zeroed_pages !=
+	    before.free_pages + before.cached_pages + before.zeroed_pages)
+		panic("mem_stress_test: pages leaked");
+
+	/* Single pages go through the per-CPU magazines */
+	static void *pages[STRESS_SLOTS];
+	const uint64_t single_start = get_tsc();
+	for (int round = 0; round < STRESS_OPS / STRESS_SLOTS; round++) {
+		const uint32_t burst = 1 + rand_range(STRESS_SLOTS);
+		for (uint32_t i = 0; i < burst; i++)
+			pages[i] = kalloc_for_page_cache();
+		for (uint32_t i = 0; i < burst; i++)
+			kfree(pages[i]);
 	}
+	const uint64_t single_cycles = get_tsc() - single_start;
+	mem_get_stats(&after);
+	ktprintf("[bench] magazines: %llu cycles per page alloc+free, alloc hit %llu%%, free hit %llu%%, %llu refills, %llu drains\n",
+	         single_cycles / (after.magazine_allocs - before.magazine_allocs),
+	         after.magazine_allocs ? after.magazine_alloc_hits * 100 / after.magazine_allocs : 0,
+	         after.magazine_frees ? after.magazine_free_hits * 100 / after.magazine_frees : 0,
+	         after.magazine_refills, after.magazine_drains);
+
+	/* Zeroed pages with a full pool and with the pool drained */
+	mem_zero_pool_refill(ZERO_POOL_TARGET);
+	uint64_t pool_cycles = get_tsc();
+	for (int i = 0; i < STRESS_SLOTS; i++)
+		pages[i] = kcalloc();
+	pool_cycles = get_tsc() - pool_cycles;
+	for (int i = 0; i < STRESS_SLOTS; i++)
+		kfree(pages[i]);
+	for (void *page; (page = zero_pool_pop()) != NULL; )
+		kfree(page);
+	uint64_t memset_cycles = get_tsc();
+	for (int i = 0; i < STRESS_SLOTS; i++)
+		pages[i] = kcalloc();
+	memset_cycles = get_tsc() - memset_cycles;
+	for (int i = 0; i < STRESS_SLOTS; i++)
+		kfree(pages[i]);
+	ktprintf("[bench] kcalloc: %llu cycles from the zero pool, %llu cycles zeroing inline\n",
+	         pool_cycles / STRESS_SLOTS, memset_cycles / STRESS_SLOTS);
+	#undef STRESS_SLOTS
+	#undef STRESS_OPS
 }
+#endif
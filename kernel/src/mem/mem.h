@@ -9,8 +9,15 @@
 /* Default page size of Intel CPUs */
 #define PAGE_SIZE 4096u
 
-/* Round size up to page boundary */
-#define PAGE_ROUND_UP(sz) (((sz) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1))
+/* Round size up to page boundary. The mask is widened to 64 bits first so
+ * addresses above 4 GiB keep their upper bits. */
+#define PAGE_ROUND_UP(sz) (((sz) + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1))
+/* Gets the lower boundry of the page which we are trying to access */
+#define PAGE_ROUND_DOWN(a) ((a) & ~(uint64_t)(PAGE_SIZE - 1))
+
+/* Size of a page mapped by a single page directory entry */
+#define HUGE_PAGE_SIZE (512 * (uint64_t)PAGE_SIZE)
+#define HUGE_PAGE_PAGES 512u
 
 /* HHDM offset used by Limine. Defined in mem.c */
 extern volatile uint64_t hhdm_offset;
@@ -20,6 +27,49 @@ extern volatile uint64_t phys_max_end;
 #define V2P(ptr) ((uint64_t)((uintptr_t)(ptr) - (uintptr_t)(hhdm_offset)))
 #define P2V(ptr) ((void *)((uintptr_t)(ptr) + (uintptr_t)(hhdm_offset)))
 
+/* Largest block the buddy allocator manages is 2^BUDDY_MAX_ORDER pages (4MB) */
+#define BUDDY_MAX_ORDER 10
+
+/* Capacity of a per-CPU page magazine and how many frames move at once
+ * between a magazine and the buddy allocator */
+#define PAGE_MAGAZINE_SIZE 64
+#define PAGE_MAGAZINE_BATCH 32
+
+/* Per-CPU cache of free frames. Lives in struct cpu_local_data and is only
+ * touched by its own core with interrupts disabled. */
+struct page_magazine {
+    uint32_t count;
+    void *frames[PAGE_MAGAZINE_SIZE];
+    uint64_t allocs;      /* single page allocations on this core */
+    uint64_t alloc_hits;  /* of which were served without the buddy lock */
+    uint64_t frees;       /* single page frees on this core */
+    uint64_t free_hits;   /* of which were absorbed without the buddy lock */
+    uint64_t refills;     /* batches taken from the buddy allocator */
+    uint64_t drains;      /* batches given back to the buddy allocator */
+};
+
+/* Snapshot of the physical memory allocator */
+struct mem_stats {
+    uint64_t managed_pages;
+    uint64_t free_pages;
+    uint64_t free_blocks[BUDDY_MAX_ORDER + 1];
+    /* Sum of all per-CPU magazines */
+    uint64_t cached_pages;
+    uint64_t magazine_allocs;
+    uint64_t magazine_alloc_hits;
+    uint64_t magazine_frees;
+    uint64_t magazine_free_hits;
+    uint64_t magazine_refills;
+    uint64_t magazine_drains;
+    /* Pre-zeroed pool */
+    uint64_t zeroed_pages;
+    uint64_t zero_pool_hits;
+    uint64_t zero_pool_misses;
+};
+
+/* Flags for kalloc_flags */
+#define KALLOC_NOZERO (1u << 0)  /* caller overwrites the whole page anyway */
+
 static inline bool phys_addr_valid(uint64_t pa)
 {
     return pa < phys_max_end && (pa % PAGE_SIZE) == 0;
@@ -33,13 +83,35 @@ void init_mem(uint64_t hhdm_offset,
               const struct limine_memmap_response *memory_map);
 void kfree(void *page);
 void *kalloc(void);
+void *kalloc_flags(unsigned int flags);
 void *kalloc_for_page_cache(void);
 void *kcalloc(void);
+size_t mem_zero_pool_refill(size_t max_pages);
 
 /* Multi-page allocation functions */
 void *kalloc_pages(size_t num_pages);
 void kfree_pages(void *ptr, size_t num_pages);
 
+/* HUGE_PAGE_SIZE aligned blocks for 2 MiB mappings. kalloc_huge_page takes
+ * the kalloc_flags flags. Shares work like for single pages. */
+void *kalloc_huge_page(unsigned int flags);
+void kfree_huge_page(void *page);
+
+/* Pages backing the slab allocator (see slab.c) */
+void *mem_alloc_slab(unsigned int order);
+void mem_free_slab(void *slab, unsigned int order);
+void *mem_slab_of(const void *addr);
+
+/* Pages with several owners, like user pages shared by fork */
+void mem_page_share(void *page);
+bool mem_page_shared(const void *page);
+
+void mem_get_stats(struct mem_stats *stats);
+uint64_t mem_fragmentation(const struct mem_stats *stats, unsigned int order);
+#ifdef DZOS_BOOT_BENCHMARKS
+void mem_stress_test(void);
+#endif
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,425 @@
+// slab.c
+#include "slab.h"
+#include "mem.h"
+#include "common/lib.h"
+#include "common/printf.h"
+#include "cpu/asm.h"
+#ifdef DZOS_BOOT_BENCHMARKS
+#include "device/rtc.h"
+#endif
+
+/*
+ * Slab allocator for fixed size kernel objects.
+ *
+ * A slab is 2^slab_order pages obtained from mem_alloc_slab. It starts with
+ * a struct slab header followed by a stack of the indexes of its free
+ * objects and then the objects themselves:
+ *
+ *   [struct slab | uint16_t free[objects_per_slab] | pad | obj 0 | obj 1 ...]
+ *
+ * Keeping the free indexes outside of the objects means the allocator never
+ * writes to an object, so the state set up by the constructor survives a
+ * free/alloc cycle. The page allocator tags every page of a slab, which is
+ * how kmem_cache_of finds the header from an object pointer.
+ */
+
+#define KMEM_SLAB_MAGIC 0x51AB51ABu
+#define KMEM_MIN_ALIGN 16u
+
+struct slab {
+	uint32_t magic;
+	uint16_t in_use;            /* objects handed out */
+	uint16_t free_top;          /* number of entries on the free stack */
+	struct kmem_cache *cache;
+	struct slab *prev;
+	struct slab *next;
+};
+
+/* The caches themselves come from this statically allocated cache */
+static struct kmem_cache cache_cache;
+static struct kmem_cache *cache_list = NULL;
+static struct spinlock cache_list_lock;
+
+static inline uint16_t *slab_free_stack(struct slab *slab)
+{
+	return (uint16_t *)(slab + 1);
+}
+
+static inline void *slab_object(const struct kmem_cache *cache, struct slab *slab, uint16_t index)
+{
+	return (uint8_t *)slab + cache->objects_offset + (size_t)index * cache->stride;
+}
+
+static inline size_t align_up(size_t value, size_t align)
+{
+	return (value + align - 1) & ~(align - 1);
+}
+
+/* Slab list helpers. Caller must hold the cache lock. */
+static void slab_list_push(struct slab **head, struct slab *slab)
+{
+	slab->prev = NULL;
+	slab->next = *head;
+	if (*head) (*head)->prev = slab;
+	*head = slab;
+}
+
+static void slab_list_remove(struct slab **head, struct slab *slab)
+{
+	if (slab->prev) slab->prev->next = slab->next;
+	else *head = slab->next;
+	if (slab->next) slab->next->prev = slab->prev;
+	slab->prev = slab->next = NULL;
+}
+
+/* Objects which fit in a slab of the given order with the given stride */
+static uint32_t objects_for_order(uint32_t order, uint32_t stride, uint32_t align, uint32_t *offset)
+{
+	const size_t bytes = (size_t)PAGE_SIZE << order;
+	uint32_t count = (uint32_t)((bytes - sizeof(struct slab)) / (stride + sizeof(uint16_t)));
+	while (count > 0) {
+		const size_t start = align_up(sizeof(struct slab) + count * sizeof(uint16_t), align);
+		if (start + (size_t)count * stride <= bytes) {
+			*offset = (uint32_t)start;
+			return count > UINT16_MAX ? UINT16_MAX : count;
+		}
+		count--;
+	}
+	return 0;
+}
+
+/* Fill in the geometry of a cache. The smallest slab which wastes at most
+ * an eighth of its space is used, or the least wasteful one otherwise. */
+static void cache_init(struct kmem_cache *cache, const char *name, size_t size,
+                       size_t align, void (*ctor)(void *))
+{
+	if (align == 0) align = KMEM_MIN_ALIGN;
+	if (align & (align - 1)) panic("kmem_cache_create: alignment not a power of two");
+
+	memset(cache, 0, sizeof(*cache));
+	cache->name = name;
+	cache->object_size = (uint32_t)size;
+	cache->align = (uint32_t)align;
+	cache->stride = (uint32_t)align_up(size ? size : 1, align);
+	cache->ctor = ctor;
+
+	size_t best_waste = 0, best_bytes = 0;
+	for (uint32_t order = 0; order <= KMEM_MAX_SLAB_ORDER; order++) {
+		uint32_t offset = 0;
+		const uint32_t count = objects_for_order(order, cache->stride, cache->align, &offset);
+		if (count == 0) continue;
+		const size_t bytes = (size_t)PAGE_SIZE << order;
+		const size_t waste = bytes - (size_t)count * cache->stride;
+		if (cache->objects_per_slab == 0 || waste * best_bytes < best_waste * bytes) {
+			best_waste = waste;
+			best_bytes = bytes;
+			cache->slab_order = order;
+			cache->objects_per_slab = count;
+			cache->objects_offset = offset;
+		}
+		if (waste * 8 <= bytes) break;
+	}
+	if (cache->objects_per_slab == 0) panic("kmem_cache_create: object too large");
+
+	/* Do not let large objects pile up in the per-CPU caches */
+	cache->cpu_limit = cache->stride <= KMEM_CPU_CACHE_SMALL ? KMEM_CPU_CACHE_SIZE : KMEM_CPU_CACHE_SIZE / 4;
+	cache->cpu_batch = cache->cpu_limit / 2;
+}
+
+/* Allocate a new slab and construct all of its objects */
+static struct slab *slab_create(struct kmem_cache *cache)
+{
+	struct slab *slab = mem_alloc_slab(cache->slab_order);
+	if (!slab) return NULL;
+	slab->magic = KMEM_SLAB_MAGIC;
+	slab->in_use = 0;
+	slab->cache = cache;
+	slab->prev = slab->next = NULL;
+	/* Hand out the lowest addresses first */
+	uint16_t *stack = slab_free_stack(slab);
+	for (uint32_t i = 0; i < cache->objects_per_slab; i++)
+		stack[i] = (uint16_t)(cache->objects_per_slab - 1 - i);
+	slab->free_top = (uint16_t)cache->objects_per_slab;
+	if (cache->ctor)
+		for (uint32_t i = 0; i < cache->objects_per_slab; i++)
+			cache->ctor(slab_object(cache, slab, (uint16_t)i));
+	return slab;
+}
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size, size_t align,
+                                     void (*ctor)(void *object))
+{
+	/* Bootstrap the cache of caches on first use */
+	if (cache_cache.name == NULL) {
+		cache_init(&cache_cache, "kmem_cache", sizeof(struct kmem_cache), 0, NULL);
+		cache_cache.next = cache_list;
+		cache_list = &cache_cache;
+	}
+
+	struct kmem_cache *cache = kmem_cache_alloc(&cache_cache);
+	if (!cache) return NULL;
+	cache_init(cache, name, size, align, ctor);
+
+	spinlock_lock(&cache_list_lock);
+	cache->next = cache_list;
+	cache_list = cache;
+	spinlock_unlock(&cache_list_lock);
+	return cache;
+}
+
+/* Take one object out of the slabs. Caller must hold the cache lock. The
+ * lock is dropped while a new slab is created. */
+static void *slab_alloc_locked(struct kmem_cache *cache)
+{
+	struct slab *slab = cache->partial;
+	if (!slab) {
+		slab = cache->empty;
+		if (slab) {
+			slab_list_remove(&cache->empty, slab);
+			cache->empty_count--;
+		} else {
+			/* The constructor may allocate as well, do not hold the lock */
+			spinlock_unlock(&cache->lock);
+			slab = slab_create(cache);
+			spinlock_lock(&cache->lock);
+			if (!slab) return NULL;
+			cache->total_slabs++;
+		}
+		slab_list_push(&cache->partial, slab);
+	}
+
+	const uint16_t index = slab_free_stack(slab)[--slab->free_top];
+	slab->in_use++;
+	if (slab->free_top == 0) {
+		slab_list_remove(&cache->partial, slab);
+		slab_list_push(&cache->full, slab);
+	}
+	cache->active_objects++;
+	return slab_object(cache, slab, index);
+}
+
+/* Return one object to its slab. Caller must hold the cache lock. A slab
+ * which becomes empty beyond KMEM_MAX_EMPTY_SLABS is pushed on release for
+ * the caller to free once the lock is dropped. */
+static void slab_free_locked(struct kmem_cache *cache, void *object, struct slab **release)
+{
+	struct slab *slab = mem_slab_of(object);
+	const size_t offset = (uint8_t *)object - (uint8_t *)slab - cache->objects_offset;
+	if (slab->in_use == 0) panic("kmem_cache_free: double free");
+	if (slab->free_top == 0) {
+		slab_list_remove(&cache->full, slab);
+		slab_list_push(&cache->partial, slab);
+	}
+	slab_free_stack(slab)[slab->free_top++] = (uint16_t)(offset / cache->stride);
+	slab->in_use--;
+	if (slab->in_use == 0) {
+		slab_list_remove(&cache->partial, slab);
+		if (cache->empty_count < KMEM_MAX_EMPTY_SLABS) {
+			slab_list_push(&cache->empty, slab);
+			cache->empty_count++;
+		} else {
+			cache->total_slabs--;
+			slab->next = *release;
+			*release = slab;
+		}
+	}
+	cache->active_objects--;
+}
+
+/* Free slabs collected by slab_free_locked */
+static void slab_release(struct kmem_cache *cache, struct slab *release)
+{
+	while (release) {
+		struct slab *next = release->next;
+		release->magic = 0;
+		mem_free_slab(release, cache->slab_order);
+		release = next;
+	}
+}
+
+/* Move up to cpu_batch objects from the slabs to an empty per-CPU
+ * cache. Called with interrupts disabled. */
+static void cpu_cache_refill(struct kmem_cache *cache, struct kmem_cpu_cache *cc)
+{
+	spinlock_lock(&cache->lock);
+	while (cc->count < cache->cpu_batch) {
+		/* Do not grow the cache by more than one slab for a refill */
+		if (cc->count != 0 && !cache->partial && !cache->empty)
+			break;
+		void *object = slab_alloc_locked(cache);
+		if (!object) break;
+		cc->objects[cc->count++] = object;
+	}
+	spinlock_unlock(&cache->lock);
+	cc->refills++;
+}
+
+/* Give the count oldest objects of a per-CPU cache back to the slabs.
+ * Called with interrupts disabled. */
+static void cpu_cache_flush(struct kmem_cache *cache, struct kmem_cpu_cache *cc, uint32_t count)
+{
+	struct slab *release = NULL;
+	spinlock_lock(&cache->lock);
+	for (uint32_t i = 0; i < count; i++)
+		slab_free_locked(cache, cc->objects[i], &release);
+	spinlock_unlock(&cache->lock);
+	cc->count -= count;
+	memmove(&cc->objects[0], &cc->objects[count], cc->count * sizeof(cc->objects[0]));
+	cc->flushes++;
+	slab_release(cache, release);
+}
+
+void *kmem_cache_alloc(struct kmem_cache *cache)
+{
+	void *object = NULL;
+	const uint64_t flags = irq_save();
+	struct kmem_cpu_cache *cc = &cache->cpu_cache[cpu_local()->cpuid];
+	cc->allocs++;
+	if (cc->count == 0)
+		cpu_cache_refill(cache, cc);
+	else
+		cc->alloc_hits++;
+	if (cc->count != 0)
+		object = cc->objects[--cc->count];
+	irq_restore(flags);
+	return object;
+}
+
+void kmem_cache_free(struct kmem_cache *cache, void *object)
+{
+	if (!object) return;
+	const struct slab *slab = mem_slab_of(object);
+	if (!slab || slab->magic != KMEM_SLAB_MAGIC || slab->cache != cache)
+		panic("kmem_cache_free: object not from this cache");
+	const size_t offset = (uint8_t *)object - (uint8_t *)slab - cache->objects_offset;
+	if (offset % cache->stride != 0 || offset / cache->stride >= cache->objects_per_slab)
+		panic("kmem_cache_free: bad object pointer");
+
+	const uint64_t flags = irq_save();
+	struct kmem_cpu_cache *cc = &cache->cpu_cache[cpu_local()->cpuid];
+	cc->frees++;
+	if (cc->count == cache->cpu_limit)
+		cpu_cache_flush(cache, cc, cache->cpu_batch);
+	else
+		cc->free_hits++;
+	cc->objects[cc->count++] = object;
+	irq_restore(flags);
+}
+
+size_t kmem_cache_shrink(struct kmem_cache *cache)
+{
+	/* Other cores' caches can only be touched by themselves */
+	const uint64_t flags = irq_save();
+	struct kmem_cpu_cache *cc = &cache->cpu_cache[cpu_local()->cpuid];
+	if (cc->count != 0)
+		cpu_cache_flush(cache, cc, cc->count);
+	irq_restore(flags);
+
+	spinlock_lock(&cache->lock);
+	struct slab *empty = cache->empty;
+	const size_t released = (size_t)cache->empty_count << cache->slab_order;
+	cache->total_slabs -= cache->empty_count;
+	cache->empty = NULL;
+	cache->empty_count = 0;
+	spinlock_unlock(&cache->lock);
+
+	slab_release(cache, empty);
+	return released;
+}
+
+struct kmem_cache *kmem_cache_of(const void *object)
+{
+	const struct slab *slab = mem_slab_of(object);
+	if (!slab || slab->magic != KMEM_SLAB_MAGIC) return NULL;
+	return slab->cache;
+}
+
+/* Sum of the per-CPU statistics of a cache */
+static void cpu_cache_totals(const struct kmem_cache *cache, struct kmem_cpu_cache *totals)
+{
+	memset(totals, 0, sizeof(*totals));
+	for (uint8_t cpu = 0; cpu < cpu_count(); cpu++) {
+		const struct kmem_cpu_cache *cc = &cache->cpu_cache[cpu];
+		totals->count += cc->count;
+		totals->allocs += cc->allocs;
+		totals->alloc_hits += cc->alloc_hits;
+		totals->frees += cc->frees;
+		totals->free_hits += cc->free_hits;
+		totals->refills += cc->refills;
+		totals->flushes += cc->flushes;
+	}
+}
+
+void kmem_cache_dump(void)
+{
+	spinlock_lock(&cache_list_lock);
+	for (struct kmem_cache *cache = cache_list; cache; cache = cache->next) {
+		struct kmem_cpu_cache totals;
+		cpu_cache_totals(cache, &totals);
+		ktprintf("[slab] %s: %llu B objects, %llu per %llu page slab, %llu active (%llu in CPU caches), "
+		         "%llu slabs, %llu allocs, %llu frees, %llu refills, %llu flushes\n",
+		         cache->name, (uint64_t)cache->object_size, (uint64_t)cache->objects_per_slab,
+		         (uint64_t)1 << cache->slab_order, cache->active_objects, (uint64_t)totals.count,
+		         cache->total_slabs, totals.allocs, totals.frees, totals.refills, totals.flushes);
+	}
+	spinlock_unlock(&cache_list_lock);
+}
+
+#ifdef DZOS_BOOT_BENCHMARKS
+extern uint32_t rand_range(uint32_t max);
+
+#define SLAB_TEST_OBJECTS 2048
+#define SLAB_TEST_MAGIC 0x0B1EC7ull
+
+static void slab_test_ctor(void *object)
+{
+	*(uint64_t *)object = SLAB_TEST_MAGIC;
+}
+
+/* Randomly allocates and frees objects of a constructed cache, checks that
+ * constructed state survives reuse and that empty slabs go back to the page
+ * allocator. Reports the cost per operation. */
+void slab_stress_test(void)
+{
+	static void *objects[SLAB_TEST_OBJECTS];
+	const uint64_t ops = 200000;
+	struct kmem_cache *cache = kmem_cache_create("slab_test", 200, 0, slab_test_ctor);
+	if (!cache) panic("slab_stress_test: OOM");
+	struct mem_stats before;
+	mem_get_stats(&before);
+
+	const uint64_t start = get_tsc();
+	for (uint64_t i = 0; i < ops; i++) {
+		const uint32_t slot = rand_range(SLAB_TEST_OBJECTS);
+		if (objects[slot]) {
+			if (*(uint64_t *)objects[slot] != SLAB_TEST_MAGIC)
+				panic("slab_stress_test: constructed state lost");
+			kmem_cache_free(cache, objects[slot]);
+			objects[slot] = NULL;
+		} else {
+			objects[slot] = kmem_cache_alloc(cache);
+			if (!objects[slot]) panic("slab_stress_test: OOM");
+			if (kmem_cache_of(objects[slot]) != cache)
+				panic("slab_stress_test: wrong owner");
+		}
+	}
+	const uint64_t cycles = get_tsc() - start;
+	const uint64_t peak_slabs = cache->total_slabs;
+
+	for (uint32_t i = 0; i < SLAB_TEST_OBJECTS; i++) {
+		kmem_cache_free(cache, objects[i]);
+		objects[i] = NULL;
+	}
+	kmem_cache_shrink(cache);
+	if (cache->active_objects != 0) panic("slab_stress_test: leaked objects");
+	if (cache->total_slabs != 0) panic("slab_stress_test: leaked slabs");
+
+	struct mem_stats after;
+	mem_get_stats(&after);
+	const uint64_t tsc_hz = rtc_tsc_frequency();
+	ktprintf("[bench] slab: %llu ops, %llu ns/op, %llu slabs at the end of the run, %lld pages not returned\n",
+	         ops, tsc_hz ? cycles * 1000000000ull / tsc_hz / ops : 0, peak_slabs,
+	         (int64_t)(before.free_pages + before.cached_pages) - (int64_t)(after.free_pages + after.cached_pages));
+	kmem_cache_dump();
+}
+#endif
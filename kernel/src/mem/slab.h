@@ -0,0 +1,107 @@
+// slab.h
+#pragma once
+#include "common/spinlock.h"
+#include "cpu/smp.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/* Largest slab is 2^KMEM_MAX_SLAB_ORDER pages */
+#define KMEM_MAX_SLAB_ORDER 3
+
+/* How many completely free slabs a cache keeps before giving them back to
+ * the page allocator */
+#define KMEM_MAX_EMPTY_SLABS 1
+
+/* Capacity of a per-CPU object cache. Caches of objects larger than
+ * KMEM_CPU_CACHE_SMALL bytes only use a quarter of it. Half of the capacity
+ * moves at once between a per-CPU cache and the slabs. */
+#define KMEM_CPU_CACHE_SIZE 32
+#define KMEM_CPU_CACHE_SMALL 512
+
+struct slab;
+
+/* Per-CPU stack of free objects in front of the slabs of a cache. Only
+ * touched by its own core with interrupts disabled. */
+struct kmem_cpu_cache {
+	uint32_t count;
+	void *objects[KMEM_CPU_CACHE_SIZE];
+	uint64_t allocs;      /* allocations on this core */
+	uint64_t alloc_hits;  /* of which were served without the cache lock */
+	uint64_t frees;       /* frees on this core */
+	uint64_t free_hits;   /* of which were absorbed without the cache lock */
+	uint64_t refills;     /* batches taken from the slabs */
+	uint64_t flushes;     /* batches given back to the slabs */
+};
+
+/**
+ * A cache of equally sized objects. Objects are carved out of slabs of
+ * 2^slab_order pages. Each slab is on exactly one of the partial, full or
+ * empty lists depending on how many of its objects are handed out.
+ *
+ * Allocations and frees go through a per-CPU cache of free objects first,
+ * so the common case takes no lock and no atomic operation.
+ *
+ * If a constructor is given, it runs once per object when its slab is
+ * created. Freed objects are expected to be returned in their constructed
+ * state, so an allocation does not run it again.
+ */
+struct kmem_cache {
+	const char *name;
+	uint32_t object_size;       /* size given to kmem_cache_create */
+	uint32_t stride;            /* object_size rounded up to the alignment */
+	uint32_t align;
+	uint32_t slab_order;
+	uint32_t objects_per_slab;
+	uint32_t objects_offset;    /* offset of the first object in a slab */
+	uint32_t cpu_limit;         /* objects a per-CPU cache may hold */
+	uint32_t cpu_batch;         /* objects moved per refill or flush */
+	void (*ctor)(void *object);
+
+	struct spinlock lock;
+	struct slab *partial;
+	struct slab *full;
+	struct slab *empty;
+	uint32_t empty_count;
+
+	/* Objects out of the slabs, including those in the per-CPU caches */
+	uint64_t active_objects;
+	uint64_t total_slabs;
+
+	struct kmem_cpu_cache cpu_cache[MAX_CORES];
+
+	struct kmem_cache *next;    /* all caches, for kmem_cache_dump */
+};
+
+/**
+ * Creates a cache of objects of the given size. align must be zero or a
+ * power of two; zero means the natural alignment of 16 bytes. ctor may be
+ * NULL. Panics if the object does not fit in the largest slab.
+ */
+struct kmem_cache *kmem_cache_create(const char *name, size_t size, size_t align,
+                                     void (*ctor)(void *object));
+/**
+ * Allocates an object from the cache. Returns NULL if out of memory.
+ */
+void *kmem_cache_alloc(struct kmem_cache *cache);
+/**
+ * Returns an object to the cache it was allocated from.
+ */
+void kmem_cache_free(struct kmem_cache *cache, void *object);
+/**
+ * Flushes the per-CPU cache of the calling core and gives every empty slab
+ * of the cache back to the page allocator. Returns the number of pages
+ * released.
+ */
+size_t kmem_cache_shrink(struct kmem_cache *cache);
+/**
+ * Returns the cache which owns the object or NULL if the address is not
+ * inside a slab.
+ */
+struct kmem_cache *kmem_cache_of(const void *object);
+/**
+ * Prints the statistics of every cache.
+ */
+void kmem_cache_dump(void);
+#ifdef DZOS_BOOT_BENCHMARKS
+void slab_stress_test(void);
+#endif
@@ -0,0 +1,73 @@
+// uaccess.c
+#include "uaccess.h"
+#include "vmm.h"
+#include "userspace/proc.h"
+#include <stdbool.h>
+
+/**
+ * An instruction of uaccess.S which touches user memory and where to
+ * continue if it faults
+ */
+struct exception_table_entry {
+	uint64_t insn;
+	uint64_t fixup;
+};
+
+/* Bounds of the __ex_table section. Defined in linker.ld */
+extern const struct exception_table_entry __ex_table_start[];
+extern const struct exception_table_entry __ex_table_end[];
+
+/* Copy routines of uaccess.S */
+size_t __copy_user(void *dest, const void *src, size_t n);
+long __strncpy_user(char *dest, const char *src, size_t n);
+
+/**
+ * Whether [addr, addr + n) is in the user half, which belongs entirely to
+ * the process, and not in an area which forbids the access. PROT_NONE
+ * pages stay present and only lose PTE_U, so the kernel would not fault
+ * on them.
+ */
+static bool user_range_ok(uint64_t addr, size_t n, bool write)
+{
+	if (addr < USERSPACE_VA_MIN || addr > USERSPACE_VA_MAX || n > USERSPACE_VA_MAX - addr)
+		return false;
+	const struct process *p = my_process();
+	return p == NULL || vma_allows(&p->vm, addr, n, write);
+}
+
+int copy_from_user(void *dest, const void *src, size_t n)
+{
+	if (!user_range_ok((uint64_t)src, n, false))
+		return -1;
+	return __copy_user(dest, src, n) == 0 ? 0 : -1;
+}
+
+int copy_to_user(void *dest, const void *src, size_t n)
+{
+	if (!user_range_ok((uint64_t)dest, n, true))
+		return -1;
+	return __copy_user(dest, src, n) == 0 ? 0 : -1;
+}
+
+long strncpy_from_user(char *dest, const char *src, size_t n)
+{
+	const uint64_t addr = (uint64_t)src;
+	if (n == 0 || !user_range_ok(addr, 1, false))
+		return -1;
+	// Do not run off the end of the user half
+	const size_t max = n < USERSPACE_VA_MAX - addr ? n : USERSPACE_VA_MAX - addr;
+	const long len = __strncpy_user(dest, src, max);
+	if (len < 0 || (size_t)len == max)
+		return -1;
+	// The length is only known now; check the string and its terminator
+	return user_range_ok(addr, (size_t)len + 1, false) ? len : -1;
+}
+
+uint64_t uaccess_fixup(uint64_t rip)
+{
+	// There are only a couple of entries
+	for (const struct exception_table_entry *e = __ex_table_start; e < __ex_table_end; e++)
+		if (e->insn == rip)
+			return e->fixup;
+	return 0;
+}
@@ -0,0 +1,28 @@
+// uaccess.h
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Copies n bytes from the user address src of the running process to the
+ * kernel buffer dest. Pages which were not touched yet are faulted in on
+ * the way. Returns 0, or -1 if part of the range is not readable user
+ * memory.
+ */
+int copy_from_user(void *dest, const void *src, size_t n);
+/**
+ * Copies n bytes from the kernel buffer src to the user address dest of
+ * the running process. Returns 0, or -1 if part of the range is not
+ * writable user memory; the bytes before it may have been written.
+ */
+int copy_to_user(void *dest, const void *src, size_t n);
+/**
+ * Copies a NUL terminated user string into dest, which holds n bytes.
+ * Returns the length of the string, or -1 if it faults or does not fit.
+ */
+long strncpy_from_user(char *dest, const char *src, size_t n);
+/**
+ * Returns where execution continues if the instruction at rip faults, or
+ * zero if it is not a user access.
+ */
+uint64_t uaccess_fixup(uint64_t rip);
@@ -0,0 +1,395 @@
+// vma.c
+#include "vma.h"
+#include "common/lib.h"
+#include "common/printf.h"
+#include "fs/fs.h"
+
+/**
+ * Converts the flags of an area to the permissions of its pages
+ */
+static pte_permissions vma_permissions(uint32_t flags)
+{
+	return (pte_permissions){
+	    .writable = (flags & VMA_WRITE) != 0,
+	    .executable = (flags & VMA_EXEC) != 0,
+	    .userspace = 1,
+	};
+}
+
+/* Access rights which mprotect may change */
+#define VMA_ACCESS (VMA_READ | VMA_WRITE | VMA_EXEC)
+
+/**
+ * Removes an area and drops its file reference
+ */
+static void vma_remove_at(struct vm_map *map, uint32_t i)
+{
+	if (map->areas[i].file != NULL)
+		fs_close(map->areas[i].file);
+	memmove(&map->areas[i], &map->areas[i + 1], (map->count - i - 1) * sizeof(map->areas[0]));
+	map->count--;
+}
+
+/**
+ * Inserts an area at index i. The caller passes its file reference on.
+ */
+static int vma_insert_at(struct vm_map *map, uint32_t i, const struct vm_area *area)
+{
+	if (map->count == VMA_MAX_AREAS)
+		return -1;
+	memmove(&map->areas[i + 1], &map->areas[i], (map->count - i) * sizeof(map->areas[0]));
+	map->areas[i] = *area;
+	map->count++;
+	return 0;
+}
+
+/**
+ * Whether b can be appended to a
+ */
+static bool vma_mergeable(const struct vm_area *a, const struct vm_area *b)
+{
+	return a->end == b->start && a->flags == b->flags && a->file == b->file &&
+	       (a->file == NULL || a->offset + (a->end - a->start) == b->offset);
+}
+
+/**
+ * Splits area i in two at addr, which must be inside the area.
+ */
+static int vma_split(struct vm_map *map, uint32_t i, uint64_t addr)
+{
+	struct vm_area upper = map->areas[i];
+	upper.start = addr;
+	upper.offset += addr - map->areas[i].start;
+	if (vma_insert_at(map, i + 1, &upper) < 0)
+		return -1;
+	map->areas[i].end = addr;
+	if (upper.file != NULL)
+		fs_dup(upper.file);
+	return 0;
+}
+
+/**
+ * Splits the areas which cross start or end so that [start, end) is made
+ * of whole areas. Returns the index of the first area in the range or -1.
+ */
+static int vma_split_range(struct vm_map *map, uint64_t start, uint64_t end)
+{
+	uint32_t i = 0;
+	while (i < map->count && map->areas[i].end <= start)
+		i++;
+	const uint32_t first = i < map->count && map->areas[i].start < start ? i + 1 : i;
+	if (first != i && vma_split(map, i, start) < 0)
+		return -1;
+	for (i = first; i < map->count && map->areas[i].start < end; i++)
+	{
+		if (map->areas[i].end > end)
+		{
+			if (vma_split(map, i, end) < 0)
+				return -1;
+			break;
+		}
+	}
+	return (int)first;
+}
+
+/**
+ * Merges every pair of neighbouring areas which can be merged
+ */
+static void vma_merge_all(struct vm_map *map)
+{
+	for (uint32_t i = 1; i < map->count;)
+	{
+		if (vma_mergeable(&map->areas[i - 1], &map->areas[i]))
+		{
+			map->areas[i - 1].end = map->areas[i].end;
+			vma_remove_at(map, i);
+		}
+		else
+			i++;
+	}
+}
+
+struct vm_area *vma_find(struct vm_map *map, uint64_t va)
+{
+	// There are only a handful of areas so a linear scan is enough
+	for (uint32_t i = 0; i < map->count; i++)
+	{
+		if (va < map->areas[i].start)
+			return NULL;
+		if (va < map->areas[i].end)
+			return &map->areas[i];
+	}
+	return NULL;
+}
+
+bool vma_allows(const struct vm_map *map, uint64_t va, size_t len, bool write)
+{
+	const uint64_t end = len > UINT64_MAX - va ? UINT64_MAX : va + len;
+	for (uint32_t i = 0; i < map->count && map->areas[i].start < end; i++)
+	{
+		const struct vm_area *area = &map->areas[i];
+		if (area->end <= va)
+			continue;
+		if (!(area->flags & VMA_ACCESS) || (write && !(area->flags & VMA_WRITE)))
+			return false;
+	}
+	return true;
+}
+
+int vma_map(struct vm_map *map, uint64_t start, uint64_t end, uint32_t flags)
+{
+	return vma_map_file(map, start, end, flags, NULL, 0);
+}
+
+int vma_map_file(struct vm_map *map, uint64_t start, uint64_t end, uint32_t flags,
+                 struct fs_inode *file, uint64_t offset)
+{
+	if (start % PAGE_SIZE != 0 || end % PAGE_SIZE != 0 || offset % PAGE_SIZE != 0)
+		panic("vma_map: not aligned");
+	if (start >= end || start < USERSPACE_VA_MIN || end > USERSPACE_VA_MAX)
+		return -1;
+
+	uint32_t i = 0;
+	while (i < map->count && map->areas[i].end <= start)
+		i++;
+	if (i < map->count && map->areas[i].start < end)
+		return -1; // overlap
+
+	const struct vm_area area = {
+	    .start = start, .end = end, .flags = flags, .file = file, .offset = offset};
+	struct vm_area *prev = i > 0 ? &map->areas[i - 1] : NULL;
+	struct vm_area *next = i < map->count ? &map->areas[i] : NULL;
+	const bool merge_prev = prev && vma_mergeable(prev, &area);
+	const bool merge_next = next && vma_mergeable(&area, next);
+	if (merge_prev && merge_next)
+	{
+		prev->end = next->end;
+		vma_remove_at(map, i);
+	}
+	else if (merge_prev)
+		prev->end = end;
+	else if (merge_next)
+	{
+		next->start = start;
+		next->offset = offset;
+	}
+	else
+	{
+		if (vma_insert_at(map, i, &area) < 0)
+			return -1;
+		if (file != NULL)
+			fs_dup(file);
+	}
+	return 0;
+}
+
+int vma_unmap(struct vm_map *map, pagetable_t pagetable, uint64_t start, uint64_t end)
+{
+	if (start % PAGE_SIZE != 0 || end % PAGE_SIZE != 0)
+		panic("vma_unmap: not aligned");
+	if (start >= end)
+		return 0;
+
+	const int first = vma_split_range(map, start, end);
+	if (first < 0)
+		return -1;
+	// Only the areas have pages behind them
+	while ((uint32_t)first < map->count && map->areas[first].start < end)
+	{
+		const struct vm_area *area = &map->areas[first];
+		if (vmm_user_unmap(pagetable, area->start, area->end - area->start) < 0)
+			return -1;
+		vma_remove_at(map, first);
+	}
+	return 0;
+}
+
+int vma_protect(struct vm_map *map, pagetable_t pagetable, uint64_t start, uint64_t end,
+                uint32_t flags)
+{
+	if (start % PAGE_SIZE != 0 || end % PAGE_SIZE != 0)
+		panic("vma_protect: not aligned");
+	if (start >= end)
+		return 0;
+
+	// The whole range must be mapped
+	for (uint64_t va = start; va < end;)
+	{
+		const struct vm_area *area = vma_find(map, va);
+		if (area == NULL)
+			return -1;
+		if ((area->flags & VMA_SHARED) && (flags & VMA_WRITE))
+			return -1;
+		va = area->end;
+	}
+
+	const int first = vma_split_range(map, start, end);
+	if (first < 0)
+		return -1;
+	int result = 0;
+	for (uint32_t i = first; i < map->count && map->areas[i].start < end; i++)
+	{
+		struct vm_area *area = &map->areas[i];
+		const uint32_t new_flags = (area->flags & ~VMA_ACCESS) | (flags & VMA_ACCESS);
+		pte_permissions permissions = vma_permissions(new_flags);
+		permissions.userspace = (new_flags & VMA_ACCESS) != 0;
+		if (vmm_user_protect(pagetable, area->start, area->end - area->start, permissions) < 0)
+		{
+			result = -1;
+			break;
+		}
+		area->flags = new_flags;
+	}
+	vma_merge_all(map);
+	return result;
+}
+
+uint64_t vma_find_free(struct vm_map *map, uint64_t size, uint64_t low, uint64_t high)
+{
+	if (size == 0 || size % PAGE_SIZE != 0)
+		return 0;
+	// Walk the gaps from the top down
+	uint64_t gap_end = high;
+	for (uint32_t i = map->count; i-- > 0;)
+	{
+		const struct vm_area *area = &map->areas[i];
+		if (area->start >= high)
+			continue;
+		if (area->end <= gap_end && gap_end - area->end >= size)
+			return gap_end - size >= low ? gap_end - size : 0;
+		gap_end = MIN_SAFE(gap_end, area->start);
+		if (gap_end < low)
+			return 0;
+	}
+	return gap_end >= low + size ? gap_end - size : 0;
+}
+
+void vma_dup(struct vm_map *dst, const struct vm_map *src)
+{
+	*dst = *src;
+	for (uint32_t i = 0; i < dst->count; i++)
+		if (dst->areas[i].file != NULL)
+			fs_dup(dst->areas[i].file);
+}
+
+void vma_release(struct vm_map *map)
+{
+	for (uint32_t i = 0; i < map->count; i++)
+		if (map->areas[i].file != NULL)
+			fs_close(map->areas[i].file);
+	map->count = 0;
+}
+
+/**
+ * Grows the user stack down to cover page if page is right below it.
+ * Returns the stack area or NULL.
+ */
+static struct vm_area *vma_grow_stack(struct vm_map *map, uint64_t page)
+{
+	// Only the user stack grows down, so there is a single limit
+	if (page < USER_STACK_BOTTOM)
+		return NULL;
+	for (uint32_t i = 0; i < map->count; i++)
+	{
+		struct vm_area *area = &map->areas[i];
+		if (area->start > page)
+		{
+			if (!(area->flags & VMA_GROWSDOWN))
+				return NULL;
+			area->start = page;
+			return area;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Maps the page of the file which belongs at page. The cached page of the
+ * file is mapped read-only, and copy-on-write if the area is writable, so
+ * all processes which read the file share it. A write gets a private copy
+ * right away.
+ */
+static int vma_fault_file(const struct vm_area *area, pagetable_t pagetable, uint64_t page,
+                          bool write)
+{
+	const uint64_t index = (area->offset + (page - area->start)) / PAGE_SIZE;
+	void *cached = fs_get_page(area->file, index);
+	if (cached == NULL)
+		return -1;
+
+	pte_permissions permissions = vma_permissions(area->flags);
+	void *frame = cached;
+	if (write)
+	{
+		frame = kalloc_flags(KALLOC_NOZERO);
+		if (frame == NULL)
+		{
+			kfree(cached);
+			return -1;
+		}
+		memcpy(frame, cached, PAGE_SIZE);
+		kfree(cached);
+	}
+	else if (permissions.writable)
+	{
+		permissions.writable = 0;
+		permissions.copy_on_write = 1;
+	}
+
+	if (vmm_map_pages(pagetable, page, PAGE_SIZE, V2P(frame), permissions) < 0)
+	{
+		kfree(frame);
+		return -1;
+	}
+	return 0;
+}
+
+int vma_fault(struct vm_map *map, pagetable_t pagetable, uint64_t va, bool write)
+{
+	if (va < USERSPACE_VA_MIN || va >= USERSPACE_VA_MAX)
+		return -1;
+	const uint64_t page = PAGE_ROUND_DOWN(va);
+
+	struct vm_area *area = vma_find(map, va);
+	if (area == NULL)
+		area = vma_grow_stack(map, page);
+	if (area == NULL)
+		return -1;
+	if (!(area->flags & VMA_ACCESS) || (write && !(area->flags & VMA_WRITE)))
+		return -1;
+	// A write to a present page is fine if it is a copy-on-write page.
+	// Anything else on a present page is a protection violation.
+	if (vmm_walkaddr(pagetable, page, true) != 0)
+		return write ? vmm_user_make_writable(pagetable, page) : -1;
+
+	if (area->file != NULL)
+		return vma_fault_file(area, pagetable, page, write);
+	// Anonymous memory is faulted in 2 MiB at a time where the area covers
+	// a whole aligned 2 MiB, which saves faults and TLB entries
+	const uint64_t huge = va & ~(HUGE_PAGE_SIZE - 1);
+	if (huge >= area->start && huge + HUGE_PAGE_SIZE <= area->end &&
+	    vmm_user_allocate_huge(pagetable, huge, vma_permissions(area->flags)) == 0)
+		return 0;
+	return vmm_allocate(pagetable, page, PAGE_SIZE, vma_permissions(area->flags), true);
+}
+
+size_t vma_populate(struct vm_map *map, pagetable_t pagetable, uint64_t va, size_t len, bool write)
+{
+	if (len == 0 || va < USERSPACE_VA_MIN || va >= USERSPACE_VA_MAX)
+		return 0;
+	// Present pages of PROT_NONE areas are not checked by vma_fault below
+	if (!vma_allows(map, va, len, write))
+		return 0;
+	const uint64_t end = len > USERSPACE_VA_MAX - va ? USERSPACE_VA_MAX : va + len;
+
+	uint64_t page = PAGE_ROUND_DOWN(va);
+	for (; page < end; page += PAGE_SIZE)
+	{
+		// Writes go through vma_fault even for present pages to break
+		// copy-on-write sharing
+		if ((write || vmm_walkaddr(pagetable, page, true) == 0) &&
+		    vma_fault(map, pagetable, page, write) < 0)
+			break;
+	}
+	return page <= va ? 0 : MIN_SAFE(page, end) - va;
+}
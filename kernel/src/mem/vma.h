@@ -0,0 +1,109 @@
+// vma.h
+#pragma once
+#include "vmm.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Access rights of a virtual memory area */
+#define VMA_READ      (1u << 0)
+#define VMA_WRITE     (1u << 1)
+#define VMA_EXEC      (1u << 2)
+/* The area extends downwards when the page just below it is touched */
+#define VMA_GROWSDOWN (1u << 3)
+/* The pages of the file are mapped as they are and never become private.
+ * Such areas can not be writable because nothing writes them back. */
+#define VMA_SHARED    (1u << 4)
+
+/* Most areas a process can have */
+#define VMA_MAX_AREAS 32
+
+struct fs_inode;
+
+/**
+ * A page aligned range [start, end) of the user address space which is
+ * backed by anonymous memory or by a file. Pages are only allocated, or
+ * read from the file, once they are touched.
+ */
+struct vm_area {
+	uint64_t start;
+	uint64_t end;
+	uint32_t flags;
+	/* The file which backs the area or NULL. The area holds a reference. */
+	struct fs_inode *file;
+	/* Offset in the file which start is mapped to */
+	uint64_t offset;
+};
+
+/**
+ * The areas of a process, sorted by address and never overlapping
+ */
+struct vm_map {
+	uint32_t count;
+	struct vm_area areas[VMA_MAX_AREAS];
+};
+
+/**
+ * Returns the area which contains va or NULL.
+ */
+struct vm_area *vma_find(struct vm_map *map, uint64_t va);
+/**
+ * Returns false if part of [va, va + len) is in an area which does not
+ * allow the access, like a PROT_NONE area whose pages are still present.
+ * Parts outside of the areas are left to the page fault handler.
+ */
+bool vma_allows(const struct vm_map *map, uint64_t va, size_t len, bool write);
+/**
+ * Reserves [start, end) with the given flags. Neighbouring areas with the
+ * same flags are merged. No memory is allocated. Returns -1 if the range
+ * overlaps an existing area or there are too many areas.
+ */
+int vma_map(struct vm_map *map, uint64_t start, uint64_t end, uint32_t flags);
+/**
+ * Like vma_map, but the area is backed by the file from the page aligned
+ * offset on. The area takes its own reference of the file.
+ */
+int vma_map_file(struct vm_map *map, uint64_t start, uint64_t end, uint32_t flags,
+                 struct fs_inode *file, uint64_t offset);
+/**
+ * Removes [start, end) from the areas and frees the pages which were
+ * allocated in it. Returns -1 if an area would have to be split but there
+ * is no room for another one.
+ */
+int vma_unmap(struct vm_map *map, pagetable_t pagetable, uint64_t start, uint64_t end);
+/**
+ * Changes the access rights (VMA_READ, VMA_WRITE and VMA_EXEC) of [start,
+ * end) and of the pages which were allocated in it. Returns -1 if part of
+ * the range is not mapped, if a shared file area would become writable or
+ * if there is no room to split an area.
+ */
+int vma_protect(struct vm_map *map, pagetable_t pagetable, uint64_t start, uint64_t end,
+                uint32_t flags);
+/**
+ * Finds a free page aligned range of size bytes in [low, high), as high as
+ * possible. Returns 0 if there is none.
+ */
+uint64_t vma_find_free(struct vm_map *map, uint64_t size, uint64_t low, uint64_t high);
+/**
+ * Copies the areas of src to dst for fork and takes references of their
+ * files.
+ */
+void vma_dup(struct vm_map *dst, const struct vm_map *src);
+/**
+ * Drops the file references of all areas and empties the map. The pages
+ * are freed with the pagetable.
+ */
+void vma_release(struct vm_map *map);
+/**
+ * Handles a fault at va by allocating a zeroed page, mapping a page of the
+ * file, or copying a copy-on-write page on a write, if va is inside an area
+ * which allows the access. Returns 0 if the access can be retried, -1 if it is invalid.
+ */
+int vma_fault(struct vm_map *map, pagetable_t pagetable, uint64_t va, bool write);
+/**
+ * Allocates every page of [va, va + len) which was not touched yet so the
+ * kernel can access the range by walking the pagetable. Returns how many
+ * bytes from va on are accessible, which is less than len if the range
+ * leaves the areas.
+ */
+size_t vma_populate(struct vm_map *map, pagetable_t pagetable, uint64_t va, size_t len, bool write);
@@ -3,7 +3,10 @@
 #include "device/pic.h"
 #include "common/lib.h"
 #include "common/printf.h"
+#include "common/spinlock.h"
 #include "cpu/asm.h"
+#include "cpu/smp.h"
+#include "device/rtc.h"
 
 /**
  * From a virtual address, get the index of PTE entry based on the level
@@ -18,9 +21,10 @@
 #define PAGETABLE_PTE_COUNT 512
 
 /**
- * Gets the lower boundry of the page which we are trying to access.
+ * First PML4 index which belongs to the kernel (upper) half of the
+ * address space. Everything from here on is shared by all pagetables.
  */
-#define PAGE_ROUND_DOWN(a) ((a) & ~(PAGE_SIZE - 1))
+#define KERNEL_PML4_FIRST (PAGETABLE_PTE_COUNT / 2)
 
 /**
  * Follow a PTE to the pagetable/frame it is pointing to.
@@ -63,6 +67,17 @@ static inline bool pte_is_writable(pte_t pte)
 	return (pte & PTE_W) != 0;
 }
 
+/**
+ * Physical address of the 4 KiB frame which holds va, given the leaf PTE
+ * or the 2 MiB page directory entry which maps it
+ */
+static inline uint64_t pte_frame(pte_t pte, uint64_t va)
+{
+	if (pte_is_huge(pte))
+		return pte_follow(pte) + PAGE_ROUND_DOWN(va & (HUGE_PAGE_SIZE - 1));
+	return pte_follow(pte);
+}
+
 /**
  * The kernel pagetable which Limine sets up for us. This is in virtual
  * address space.
@@ -85,28 +100,64 @@ static struct limine_kernel_address_response kernel_address;
 static uint64_t io_memmap_current_address = 0xfffffffff0000000;
 
 /**
- * Return the address of the PTE in page table pagetable that corresponds to
- * virtual address va. If alloc is true, create any required page-table pages.
- *
- * Intel has two page table types: 5 level and 4 level. For our purpose, we only
- * use 4 level paging. Each page in pagetable contains 512 (4096/8) PTEs.
- * Top 16 bits must be zero.
- * A 64-bit virtual address is split into five fields:
- *   48..63 -- must be zero.
- *   39..47 -- 9 bits of level-4 index.
- *   30..38 -- 9 bits of level-3 index.
- *   21..29 -- 9 bits of level-2 index.
- *   12..20 -- 9 bits of level-1 index.
- *    0..11 -- 12 bits of byte offset within the page.
+ * Replaces a 2 MiB user page by a leaf pagetable which maps the same memory
+ * with the same permissions, so parts of it can be changed on their own.
+ * The frames of a private huge page simply become 4 KiB pages; a shared
+ * one is copied into private pages first. Returns -1 if out of memory.
  */
-static pte_t *walk(pagetable_t pagetable, uint64_t va, bool alloc, bool io)
+static int split_huge(pte_t *pde, uint64_t va)
 {
-	if ((!io && va >= USERSPACE_VA_MAX) || va < USERSPACE_VA_MIN)
-		panic("walk");
+	pagetable_t table = (pagetable_t)kcalloc();
+	if (table == NULL)
+		return -1;
 
-	for (int level = 3; level > 0; level--)
+	const pte_t flags = *pde & ~(PTE_ADDR_MASK | PTE_PS);
+	uint8_t *huge = P2V(pte_follow(*pde));
+	if (mem_page_shared(huge))
+	{
+		for (size_t i = 0; i < PAGETABLE_PTE_COUNT; i++)
+		{
+			void *page = kalloc_flags(KALLOC_NOZERO);
+			if (page == NULL)
+			{
+				while (i-- > 0)
+					kfree(P2V(pte_follow(table[i])));
+				kfree(table);
+				return -1;
+			}
+			memcpy(page, huge + i * PAGE_SIZE, PAGE_SIZE);
+			table[i] = flags | PTE_SET_ADDR(V2P(page));
+		}
+		kfree_huge_page(huge); // drops our share
+	}
+	else
+	{
+		for (size_t i = 0; i < PAGETABLE_PTE_COUNT; i++)
+			table[i] = flags | PTE_SET_ADDR(V2P(huge) + i * PAGE_SIZE);
+	}
+
+	*pde = PTE_P | PTE_W | PTE_U | PTE_SET_ADDR(V2P(table));
+	vmm_invalidate_page(va);
+	return 0;
+}
+
+/**
+ * Walks from the top of pagetable down to the entry of va at the given
+ * level. A 2 MiB page on the way is returned as it is if alloc is false,
+ * and split otherwise, because the caller is going to change part of it.
+ */
+static pte_t *walk_to(pagetable_t pagetable, uint64_t va, bool alloc, int target)
+{
+	for (int level = 3; level > target; level--)
 	{
 		pte_t *pte = &pagetable[PTE_INDEX_FROM_VA(va, level)];
+		if (pte_is_present(*pte) && pte_is_huge(*pte))
+		{
+			if (!alloc)
+				return pte;
+			if (level != 1 || split_huge(pte, va) < 0)
+				return NULL;
+		}
 		if (pte_is_present(*pte))
 		{
 			// if PTE is here, just point to it
@@ -125,7 +176,42 @@ static pte_t *walk(pagetable_t pagetable, uint64_t va, bool alloc, bool io)
 		}
 	}
 
-	return &pagetable[PTE_INDEX_FROM_VA(va, 0)];
+	return &pagetable[PTE_INDEX_FROM_VA(va, target)];
+}
+
+/**
+ * Return the address of the PTE in page table pagetable that corresponds to
+ * virtual address va. If alloc is true, create any required page-table pages.
+ * If va is inside a 2 MiB page, the entry of the huge page is returned
+ * instead unless alloc is set; pte_frame finds the frame of va in either.
+ *
+ * Intel has two page table types: 5 level and 4 level. For our purpose, we only
+ * use 4 level paging. Each page in pagetable contains 512 (4096/8) PTEs.
+ * Top 16 bits must be zero.
+ * A 64-bit virtual address is split into five fields:
+ *   48..63 -- must be zero.
+ *   39..47 -- 9 bits of level-4 index.
+ *   30..38 -- 9 bits of level-3 index.
+ *   21..29 -- 9 bits of level-2 index.
+ *   12..20 -- 9 bits of level-1 index.
+ *    0..11 -- 12 bits of byte offset within the page.
+ */
+static pte_t *walk(pagetable_t pagetable, uint64_t va, bool alloc, bool io)
+{
+	if ((!io && va >= USERSPACE_VA_MAX) || va < USERSPACE_VA_MIN)
+		panic("walk");
+	return walk_to(pagetable, va, alloc, 0);
+}
+
+/**
+ * Like walk, but returns the page directory entry of va, which maps the
+ * 2 MiB around it
+ */
+static pte_t *walk_pde(pagetable_t pagetable, uint64_t va, bool alloc)
+{
+	if (va >= USERSPACE_VA_MAX || va < USERSPACE_VA_MIN)
+		panic("walk_pde");
+	return walk_to(pagetable, va, alloc, 1);
 }
 
 static pte_t *walk_kernel(pagetable_t pagetable, uint64_t va, bool alloc)
@@ -158,92 +244,288 @@ static pte_t *walk_kernel(pagetable_t pagetable, uint64_t va, bool alloc)
 	return &pagetable[PTE_INDEX_FROM_VA(va, 0)];
 }
 
-int vmm_map_kernel_pages(pagetable_t kernel_pagetable, uint64_t va, uint64_t pa,
-                         uint64_t size, pte_permissions perm)
-{
-	if (va % PAGE_SIZE != 0 || pa % PAGE_SIZE != 0 || size % PAGE_SIZE != 0)
-		panic("vmm_map_kernel_pages: alignment");
+/**
+ * Number of bytes mapped by one leaf pagetable
+ */
+#define LEAF_TABLE_SPAN ((uint64_t)PAGE_SIZE * PAGETABLE_PTE_COUNT)
 
-	const uint64_t pages = size / PAGE_SIZE;
-	for (uint64_t i = 0; i < pages; i++)
-	{
-		pte_t *pte = walk_kernel(kernel_pagetable, va + i * PAGE_SIZE, true);
-		if (!pte)
-			return -1; // OOM
+/**
+ * Above this many pages, unmapping or protecting a range flushes the TLB
+ * once at the end instead of invalidating every page
+ */
+#define VMM_INVLPG_MAX 32
 
-		if (pte_is_present(*pte))
-			panic("vmm_map_kernel_pages: remap");
+/**
+ * Passed as pa to map_range to give every page a new frame
+ */
+#define MAP_RANGE_ALLOCATE UINT64_MAX
+
+/**
+ * Returns where the leaf pagetable which maps va ends, or end if that is
+ * sooner
+ */
+static inline uint64_t leaf_table_end(uint64_t va, uint64_t end)
+{
+	const uint64_t table_end = (va | (LEAF_TABLE_SPAN - 1)) + 1;
+	return table_end < end && table_end != 0 ? table_end : end;
+}
 
-		// Build kernel mapping
-		*pte = PTE_P | PTE_SET_ADDR(pa + i * PAGE_SIZE);
-		if (perm.writable)
-			*pte |= PTE_W;
-		if (!perm.executable)
-			*pte |= PTE_XD;
-		// kernel-only: no PTE_U flag
+/**
+ * Looks up the leaf PTE of va without allocating. If a pagetable on the
+ * way is missing, returns NULL and sets *next to the first address after
+ * the range the missing entry would map. If va is in a 2 MiB page, its
+ * page directory entry is returned.
+ */
+static pte_t *lookup(pagetable_t pagetable, uint64_t va, uint64_t *next)
+{
+	for (int level = 3; level > 0; level--)
+	{
+		const pte_t pte = pagetable[PTE_INDEX_FROM_VA(va, level)];
+		if (!pte_is_present(pte))
+		{
+			const uint64_t span = 1ULL << (level * 9 + 12);
+			*next = (va | (span - 1)) + 1;
+			return NULL;
+		}
+		if (pte_is_huge(pte))
+		{
+			if (level != 1)
+				panic("vmm: huge page in range");
+			return &pagetable[PTE_INDEX_FROM_VA(va, level)];
+		}
+		pagetable = (pagetable_t)P2V(pte_follow(pte));
 	}
-	return 0;
+	return &pagetable[PTE_INDEX_FROM_VA(va, 0)];
 }
 
 /**
- * Deep copy the pagetable (and not the frames) to another pagetable.
+ * Builds the flags of a leaf PTE
  */
-static int copy_pagetable(pagetable_t dst, const pagetable_t src, int level)
+static inline pte_t pte_flags(pte_permissions permissions)
 {
-	// Copy the top-level PTEs (kernel mappings are okay to share)
-	memcpy(dst, src, PAGE_SIZE);
+	pte_t flags = PTE_P;
+	if (permissions.writable)
+		flags |= PTE_W;
+	if (!permissions.executable)
+		flags |= PTE_XD;
+	if (permissions.userspace)
+		flags |= PTE_U;
+	if (permissions.copy_on_write)
+		flags |= PTE_COW;
+	return flags;
+}
 
-	// If this is the leaf level (PT), nothing more to do
-	if (level == 0)
-		return 0;
+/**
+ * Maps a new 2 MiB page at the user address va if nothing was mapped in
+ * its range before. Returns -1 if there is a leaf pagetable already or
+ * no free 2 MiB block; the caller falls back to 4 KiB pages then.
+ */
+static int map_huge(pagetable_t pagetable, uint64_t va, pte_t flags, unsigned int alloc_flags)
+{
+	pte_t *pde = walk_pde(pagetable, va, true);
+	if (pde == NULL || *pde != 0)
+		return -1;
+	void *page = kalloc_huge_page(alloc_flags);
+	if (page == NULL)
+		return -1;
+	*pde = flags | PTE_PS | PTE_SET_ADDR(V2P(page));
+	return 0;
+}
 
-	// Iterate over all entries
-	for (size_t i = 0; i < PAGETABLE_PTE_COUNT; i++)
+/**
+ * Maps [va, va + size) to pa onwards, or to new frames allocated with
+ * alloc_flags if pa is MAP_RANGE_ALLOCATE. The pagetable is walked once
+ * per leaf pagetable and its PTEs are filled in a row. New user frames are
+ * 2 MiB pages wherever a whole aligned 2 MiB fits in the range. Returns -1
+ * if out of memory; the pages mapped so far stay mapped.
+ */
+static int map_range(pagetable_t pagetable, uint64_t va, uint64_t size, uint64_t pa,
+                     pte_t flags, unsigned int alloc_flags)
+{
+	const bool kernel = va >= KERNEL_VA_MIN;
+	const uint64_t end = va + size;
+	for (uint64_t current = va; current < end;)
 	{
-		const pte_t pte_src = src[i];
-
-		// Only recurse if entry is present and not a huge page
-		if (pte_is_present(pte_src) && !pte_is_huge(pte_src))
+		if (!kernel && pa == MAP_RANGE_ALLOCATE && current % HUGE_PAGE_SIZE == 0 &&
+		    end - current >= HUGE_PAGE_SIZE && map_huge(pagetable, current, flags, alloc_flags) == 0)
 		{
-			// Allocate a new inner pagetable
-			pagetable_t dst_inner = (pagetable_t)kalloc();
-			if (!dst_inner)
-				return 1; // OOM
-
-			memset(dst_inner, 0, PAGE_SIZE);
+			current += HUGE_PAGE_SIZE;
+			continue;
+		}
+		pte_t *pte = kernel ? walk_kernel(pagetable, current, true)
+		                    : walk(pagetable, current, true, false);
+		if (pte == NULL)
+			return -1; // OOM
+		for (const uint64_t table_end = leaf_table_end(current, end); current < table_end;
+		        current += PAGE_SIZE, pte++)
+		{
+			if (pte_is_present(*pte))
+				panic("vmm: remap");
+			uint64_t frame = pa + (current - va);
+			if (pa == MAP_RANGE_ALLOCATE)
+			{
+				void *page = kalloc_flags(alloc_flags);
+				if (page == NULL)
+					return -1;
+				frame = V2P(page);
+			}
+			*pte = flags | PTE_SET_ADDR(frame);
+		}
+	}
+	return 0;
+}
 
-			// Get the source inner pagetable
-			pagetable_t src_inner = (pagetable_t)P2V(pte_follow(pte_src));
+/**
+ * Flushes the TLB after a range of an installed pagetable changed
+ */
+static inline void flush_range(bool kernel)
+{
+	if (kernel)
+		vmm_flush_tlb_all(); // kernel mappings are global
+	else
+		vmm_flush_tlb();
+}
 
-			// Recursively copy inner pagetable
-			if (copy_pagetable(dst_inner, src_inner, level - 1) != 0)
+/**
+ * Removes the present pages in [va, va + size) from an installed pagetable
+ * and frees their frames if free_frames is set. Small ranges are
+ * invalidated page by page; for large ones the frames are freed in batches
+ * after flushing the whole TLB. 2 MiB pages which are only partly in the
+ * range are split first, which may fail with -1 if out of memory.
+ */
+static int unmap_range(pagetable_t pagetable, uint64_t va, uint64_t size, bool free_frames)
+{
+	const bool kernel = va >= KERNEL_VA_MIN;
+	const bool flush_all = size / PAGE_SIZE > VMM_INVLPG_MAX;
+	void *frames[VMM_INVLPG_MAX];
+	uint32_t count = 0;
+	bool unmapped = false;
+	int result = 0;
+
+	const uint64_t end = va + size;
+	for (uint64_t current = va; current < end;)
+	{
+		uint64_t next;
+		pte_t *pte = lookup(pagetable, current, &next);
+		if (pte == NULL)
+		{
+			current = next > current ? next : end;
+			continue;
+		}
+		if (pte_is_huge(*pte))
+		{
+			const uint64_t huge_end = (current | (HUGE_PAGE_SIZE - 1)) + 1;
+			if (current % HUGE_PAGE_SIZE != 0 || huge_end > end)
 			{
-				kfree(dst_inner);
-				return 1; // propagate OOM
+				if (split_huge(pte, current) < 0)
+				{
+					result = -1;
+					break;
+				}
+				continue; // look the leaf pagetable up again
 			}
-
-			// Update parent PTE to point to new inner table
-			dst[i] = PTE_P | PTE_SET_ADDR(V2P(dst_inner));
-			if (pte_is_writable(pte_src))
-				dst[i] |= PTE_W;
-			if (pte_is_user(pte_src))
-				dst[i] |= PTE_U;
-			if (pte_src & PTE_XD)
-				dst[i] |= PTE_XD;
+			// One invlpg drops the whole 2 MiB TLB entry
+			void *frame = P2V(pte_follow(*pte));
+			*pte = 0;
+			vmm_invalidate_page(current);
+			if (free_frames)
+				kfree_huge_page(frame);
+			current = huge_end;
+			continue;
+		}
+		for (const uint64_t table_end = leaf_table_end(current, end); current < table_end;
+		        current += PAGE_SIZE, pte++)
+		{
+			if (!pte_is_present(*pte))
+				continue;
+			const uint64_t pa = pte_follow(*pte);
+			*pte = 0;
+			unmapped = true;
+			if (!flush_all)
+				vmm_invalidate_page(current);
+			if (!free_frames)
+				continue;
+			// Frames may only be reused once no TLB entry points to them
+			if (count == VMM_INVLPG_MAX)
+			{
+				if (flush_all)
+					flush_range(kernel);
+				for (uint32_t i = 0; i < count; i++)
+					kfree(frames[i]);
+				count = 0;
+			}
+			frames[count++] = P2V(pa);
 		}
 	}
 
-	return 0;
+	if (flush_all && unmapped)
+		flush_range(kernel);
+	for (uint32_t i = 0; i < count; i++)
+		kfree(frames[i]);
+	return result;
+}
+
+int vmm_map_kernel_pages(pagetable_t kernel_pagetable, uint64_t va, uint64_t pa,
+                         uint64_t size, pte_permissions perm)
+{
+	if (va % PAGE_SIZE != 0 || pa % PAGE_SIZE != 0 || size % PAGE_SIZE != 0)
+		panic("vmm_map_kernel_pages: alignment");
+
+	// Kernel mappings are the same in every address space, so they can stay
+	// in the TLB across pagetable switches. No PTE_U: kernel-only.
+	perm.userspace = 0;
+	perm.copy_on_write = 0;
+	return map_range(kernel_pagetable, va, size, pa, pte_flags(perm) | PTE_G, 0);
 }
 
 /**
- * We just save the limine_kernel_address_response to be later accessed.
+ * Sets the global bit of every leaf below a kernel pagetable
+ */
+static void vmm_mark_global(pagetable_t pagetable, int level)
+{
+	for (size_t i = 0; i < PAGETABLE_PTE_COUNT; i++)
+	{
+		const pte_t pte = pagetable[i];
+		if (!pte_is_present(pte))
+			continue;
+		if (level == 0 || pte_is_huge(pte))
+			pagetable[i] |= PTE_G;
+		else
+			vmm_mark_global((pagetable_t)P2V(pte_follow(pte)), level - 1);
+	}
+}
+
+/**
+ * We save the limine_kernel_address_response to be later accessed and
+ * populate every upper-half PML4 slot of the kernel pagetable.
+ *
+ * Kernel mappings are global so they survive pagetable switches once
+ * vmm_init_pcid has enabled CR4.PGE.
+ *
+ * User pagetables alias the kernel half by copying these top-level PTEs
+ * instead of deep copying the whole tree. Because every slot already points
+ * to a PDPT, any kernel mapping created later (IO memmaps, kernel stacks...)
+ * lands in a lower level table which is shared by all address spaces.
  */
 void vmm_init_kernel(const struct limine_kernel_address_response _kernel_address)
 {
 	kernel_address = _kernel_address;
 	kernel_pagetable = (pagetable_t)P2V(get_installed_pagetable());
 
+	for (size_t i = KERNEL_PML4_FIRST; i < PAGETABLE_PTE_COUNT; i++)
+	{
+		if (pte_is_present(kernel_pagetable[i]))
+		{
+			// The mappings of Limine are the same in every address space
+			vmm_mark_global((pagetable_t)P2V(pte_follow(kernel_pagetable[i])), 2);
+			continue;
+		}
+		pagetable_t pdpt = (pagetable_t)kcalloc();
+		if (pdpt == NULL)
+			panic("vmm_init_kernel: OOM");
+		kernel_pagetable[i] = PTE_P | PTE_W | PTE_SET_ADDR(V2P(pdpt));
+	}
+
 	// Map essential kernel devices (example: IOAPIC)
 	// vmm_map_kernel_pages(
 	//     kernel_pagetable,
@@ -267,6 +549,258 @@ void vmm_init_lapic(uint64_t lapic_addr)
 	);
 }
 
+/*
+ * PCIDs let the TLB keep the entries of several address spaces at once, so
+ * a pagetable switch does not have to flush it. Each user address space
+ * gets an ASID: a PCID together with the generation it was handed out in.
+ * PCIDs are never reused within a generation, so a core only flushes its
+ * TLB when it sees a new generation, which starts once all PCIDs are used
+ * up. The ASIDs which are installed at that point stay reserved so their
+ * cores can keep using them.
+ */
+#define ASID_GENERATION(asid) ((asid) / VMM_PCID_COUNT)
+#define ASID_PCID(asid) ((asid) % VMM_PCID_COUNT)
+/* Bit of CR3 which keeps the TLB entries of the new PCID */
+#define CR3_NOFLUSH (1ULL << 63)
+
+static bool pcid_enabled;
+
+static struct {
+	struct spinlock lock;
+	uint64_t generation;
+	uint64_t next_pcid;
+	uint64_t used[VMM_PCID_COUNT / 64];
+} asids = {.generation = 1, .next_pcid = 1, .used = {1}};
+
+/**
+ * Starts a new ASID generation. Caller must hold asids.lock.
+ */
+static void asid_rollover(void)
+{
+	asids.generation++;
+	memset(asids.used, 0, sizeof(asids.used));
+	asids.used[0] = 1; // the kernel pagetable
+	asids.next_pcid = 1;
+	for (uint8_t cpu = 0; cpu < cpu_count(); cpu++)
+	{
+		struct cpu_local_data *local = cpu_local_of(cpu);
+		// A core which switched to nothing new since the last rollover
+		// still runs on its reserved ASID
+		uint64_t asid = __atomic_exchange_n(&local->active_asid, 0, __ATOMIC_RELAXED);
+		if (asid == 0)
+			asid = local->reserved_asid;
+		local->reserved_asid = asid;
+		if (asid != 0)
+			asids.used[ASID_PCID(asid) / 64] |= 1ULL << (ASID_PCID(asid) % 64);
+	}
+}
+
+/**
+ * Gives an address space whose ASID is from an old generation a new one.
+ * Caller must hold asids.lock.
+ */
+static uint64_t asid_new(uint64_t asid)
+{
+	if (asid != 0)
+	{
+		// Keep the PCID if it was reserved at the rollover
+		const uint64_t renewed = asids.generation * VMM_PCID_COUNT + ASID_PCID(asid);
+		bool reserved = false;
+		for (uint8_t cpu = 0; cpu < cpu_count(); cpu++)
+		{
+			struct cpu_local_data *local = cpu_local_of(cpu);
+			if (local->reserved_asid == asid)
+			{
+				local->reserved_asid = renewed;
+				reserved = true;
+			}
+		}
+		if (reserved)
+			return renewed;
+	}
+
+	for (int attempt = 0; attempt < 2; attempt++)
+	{
+		for (uint64_t pcid = asids.next_pcid; pcid < VMM_PCID_COUNT; pcid++)
+		{
+			if (asids.used[pcid / 64] & (1ULL << (pcid % 64)))
+				continue;
+			asids.used[pcid / 64] |= 1ULL << (pcid % 64);
+			asids.next_pcid = pcid + 1;
+			return asids.generation * VMM_PCID_COUNT + pcid;
+		}
+		asid_rollover();
+	}
+	panic("asid_new: out of PCIDs");
+}
+
+/**
+ * Enables global pages and, if the CPU supports them, PCIDs on this core.
+ * Must run on the kernel pagetable.
+ */
+void vmm_init_pcid(void)
+{
+	uint32_t eax, ebx, ecx, edx;
+	cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+	uint64_t cr4 = read_cr4() | CR4_PGE;
+	// CR4.PCIDE can only be set while PCID 0 is installed
+	install_pagetable(V2P(kernel_pagetable));
+	if (ecx & (1u << 17)) // CPUID.01H:ECX.PCID
+	{
+		cr4 |= CR4_PCIDE;
+		pcid_enabled = true;
+	}
+	write_cr4(cr4);
+	cpu_local()->asid_generation = __atomic_load_n(&asids.generation, __ATOMIC_RELAXED);
+	ktprintf("PCID %s, global kernel pages enabled\n", pcid_enabled ? "enabled" : "not supported");
+}
+
+/**
+ * Installs a user pagetable. asid is the ASID of the address space, which
+ * must start as zero and is only touched by this function and
+ * vmm_migrate_asid. Nothing happens if the address space is installed
+ * already; otherwise the TLB entries of the address space from the last
+ * time it ran on this core are kept if they can be.
+ */
+void vmm_switch_pagetable(pagetable_t pagetable, uint64_t *asid)
+{
+	struct cpu_local_data *local = cpu_local();
+	uint64_t id = __atomic_load_n(asid, __ATOMIC_RELAXED);
+	// This core may still run on the pagetable of an address space which
+	// ran elsewhere since, see vmm_migrate_asid
+	if (id != 0 && get_installed_pagetable() == V2P(pagetable) &&
+	    __atomic_load_n(&local->active_asid, __ATOMIC_RELAXED) == id)
+		return;
+	if (!pcid_enabled)
+	{
+		// Without PCIDs the ASID only tells the address spaces apart
+		static uint64_t next_id;
+		if (id == 0)
+		{
+			id = __atomic_add_fetch(&next_id, 1, __ATOMIC_RELAXED);
+			__atomic_store_n(asid, id, __ATOMIC_RELAXED);
+		}
+		local->active_asid = id;
+		// Flushes everything but the global kernel mappings
+		install_pagetable(V2P(pagetable));
+		__atomic_store_n(&local->user_pagetable, pagetable, __ATOMIC_RELEASE);
+		return;
+	}
+
+	uint64_t active = __atomic_load_n(&local->active_asid, __ATOMIC_RELAXED);
+	const uint64_t generation = __atomic_load_n(&asids.generation, __ATOMIC_RELAXED);
+	// Fast path: the ASID is current and no rollover took our active ASID
+	// away meanwhile
+	bool flush = false;
+	if (active == 0 || ASID_GENERATION(id) != generation || local->asid_generation != generation ||
+	    !__atomic_compare_exchange_n(&local->active_asid, &active, id, false,
+	                                 __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+	{
+		spinlock_lock(&asids.lock);
+		id = *asid;
+		if (ASID_GENERATION(id) != asids.generation)
+		{
+			id = asid_new(id);
+			__atomic_store_n(asid, id, __ATOMIC_RELAXED);
+		}
+		if (local->asid_generation != asids.generation)
+		{
+			local->asid_generation = asids.generation;
+			flush = true;
+		}
+		__atomic_store_n(&local->active_asid, id, __ATOMIC_RELAXED);
+		spinlock_unlock(&asids.lock);
+	}
+
+	// The PCIDs of the old generation may be reused by other address
+	// spaces now
+	if (flush)
+		vmm_flush_tlb_all();
+	__asm__ volatile("mov %0, %%cr3" ::"r"(V2P(pagetable) | ASID_PCID(id) | CR3_NOFLUSH) : "memory");
+	__atomic_store_n(&local->user_pagetable, pagetable, __ATOMIC_RELEASE);
+}
+
+/**
+ * Makes an address space which moves to another core get a new ASID the
+ * next time it is installed. The core it leaves may keep TLB entries of
+ * the old ASID, which would be stale if the address space changes its
+ * mappings elsewhere and then comes back. PCIDs are not reused within a
+ * generation, so nobody else can pick these entries up either.
+ */
+void vmm_migrate_asid(uint64_t *asid)
+{
+	__atomic_store_n(asid, 0, __ATOMIC_RELAXED);
+}
+
+/**
+ * Installs the kernel pagetable without flushing the TLB
+ */
+void vmm_switch_to_kernel(void)
+{
+	const uint64_t cr3 = V2P(kernel_pagetable);
+	if (pcid_enabled)
+		__asm__ volatile("mov %0, %%cr3" ::"r"(cr3 | CR3_NOFLUSH) : "memory");
+	else
+		install_pagetable(cr3);
+	__atomic_store_n(&cpu_local()->user_pagetable, NULL, __ATOMIC_RELEASE);
+}
+
+/**
+ * Flushes the whole TLB of this core, including the global kernel mappings
+ * and the entries of every PCID. Toggling CR4.PGE does exactly that.
+ */
+void vmm_flush_tlb_all(void)
+{
+	const uint64_t cr4 = read_cr4();
+	write_cr4(cr4 ^ CR4_PGE);
+	write_cr4(cr4);
+}
+
+/*
+ * Kernel mappings are global, so unmapping one has to flush the TLB of
+ * every core. Instead of interrupting the other cores, whoever unmaps
+ * starts a new epoch and the cores flush their TLB once they notice it in
+ * vmm_tlb_sync, which the scheduler calls on every tick. The unmapped
+ * addresses are only reused when every core is past that epoch.
+ */
+static uint64_t kernel_tlb_epoch = 0;
+
+void vmm_tlb_sync(void)
+{
+	struct cpu_local_data *local = cpu_local();
+	const uint64_t epoch = __atomic_load_n(&kernel_tlb_epoch, __ATOMIC_ACQUIRE);
+	if (local->tlb_epoch == epoch)
+		return;
+	vmm_flush_tlb_all();
+	__atomic_store_n(&local->tlb_epoch, epoch, __ATOMIC_RELEASE);
+}
+
+/**
+ * Starts a new kernel TLB epoch after some kernel pages were unmapped and
+ * flushes the TLB of this core. Returns the epoch.
+ */
+static uint64_t tlb_epoch_begin(void)
+{
+	const uint64_t epoch = __atomic_add_fetch(&kernel_tlb_epoch, 1, __ATOMIC_ACQ_REL);
+	vmm_tlb_sync();
+	// Idle cores have no timer armed and would not flush until their
+	// next interrupt
+	for (uint8_t cpu = 0; cpu < cpu_count(); cpu++)
+		smp_kick(cpu);
+	return epoch;
+}
+
+/**
+ * Whether every core has flushed its TLB since epoch began
+ */
+static bool tlb_epoch_done(uint64_t epoch)
+{
+	for (uint8_t cpu = 0; cpu < cpu_count(); cpu++)
+		if (__atomic_load_n(&cpu_local_of(cpu)->tlb_epoch, __ATOMIC_ACQUIRE) < epoch)
+			return false;
+	return true;
+}
+
 /**
  * Gets the physical addres of a virtual address from a page table.
  * If user is true, the page must be in user mode. Otherwise it should be
@@ -285,7 +819,7 @@ uint64_t vmm_walkaddr(pagetable_t pagetable, uint64_t va, bool user)
 		return 0;
 	if (pte_is_user(*pte) != user)
 		return 0;
-	return pte_follow(*pte);
+	return pte_frame(*pte, va);
 }
 
 /**
@@ -306,28 +840,7 @@ int vmm_map_pages(pagetable_t pagetable, uint64_t va, uint64_t size,
 	if (size == 0)
 		panic("vmm_map_pages: size");
 
-	// Map each page individually
-	const uint64_t pages_to_map = size / PAGE_SIZE;
-	for (uint64_t i = 0; i < pages_to_map; i++)
-	{
-		const uint64_t current_va = va + i * PAGE_SIZE;
-		const uint64_t current_pa = pa + i * PAGE_SIZE;
-		pte_t *pte = walk(pagetable, current_va, true, false);
-		if (pte == NULL)
-			return -1; // OOM
-		if (pte_is_present(*pte))
-			panic("vmm_map_pages: remap");
-
-		// Build PTE with specified permissions
-		*pte = PTE_P | PTE_SET_ADDR(current_pa);
-		if (permissions.writable)
-			*pte |= PTE_W;
-		if (!permissions.executable)
-			*pte |= PTE_XD;
-		if (permissions.userspace)
-			*pte |= PTE_U;
-	}
-	return 0;
+	return map_range(pagetable, va, size, pa, pte_flags(permissions), 0);
 }
 
 /**
@@ -335,7 +848,7 @@ int vmm_map_pages(pagetable_t pagetable, uint64_t va, uint64_t size,
  * must be devisable by page size. Returns 0 on success, -1 if walk() couldn't
  * allocate a needed pagetable page.
  *
- * If clear is set, the allocated page will be filled with zero, otherwise 2.
+ * If clear is set, the allocated page is guaranteed to be zero filled.
  */
 int vmm_allocate(pagetable_t pagetable, uint64_t va, uint64_t size,
                  pte_permissions permissions, bool clear)
@@ -348,36 +861,21 @@ int vmm_allocate(pagetable_t pagetable, uint64_t va, uint64_t size,
 	if (size == 0)
 		panic("vmm_allocate: size");
 
-	// Allocate pages
-	const uint64_t pages_to_alloc = size / PAGE_SIZE;
-	for (uint64_t i = 0; i < pages_to_alloc; i++)
-	{
-		const uint64_t current_va = va + i * PAGE_SIZE;
-		void *frame;
-		if (clear)
-			frame = kcalloc();  // This already zeros
-		else
-			frame = kalloc();   // This fills with 0x02
-		if (frame == NULL)
-			return -1;
-		pte_t *pte = walk(pagetable, current_va, true, false);
-		if (pte == NULL) {
-			kfree(frame);
-			return -1;
-		}
-		if (pte_is_present(*pte))
-			panic("vmm_allocate: remap");
+	// Pages are zeroed either way, from the pre-zeroed pool if possible:
+	// even without clear we never hand stale kernel data to userspace
+	return map_range(pagetable, va, size, MAP_RANGE_ALLOCATE, pte_flags(permissions), 0);
+}
 
-		// Build PTE
-		*pte = PTE_P | PTE_SET_ADDR(V2P(frame));
-		if (permissions.writable)
-			*pte |= PTE_W;
-		if (!permissions.executable)
-			*pte |= PTE_XD;
-		if (permissions.userspace)
-			*pte |= PTE_U;
-	}
-	return 0;
+/**
+ * Maps a zeroed 2 MiB page at the 2 MiB aligned user address va. Returns
+ * -1 if part of the range is mapped with 4 KiB pages already or there is
+ * no free 2 MiB block.
+ */
+int vmm_user_allocate_huge(pagetable_t pagetable, uint64_t va, pte_permissions permissions)
+{
+	if (va % HUGE_PAGE_SIZE != 0)
+		panic("vmm_user_allocate_huge: va not aligned");
+	return map_huge(pagetable, va, pte_flags(permissions), 0);
 }
 
 /**
@@ -398,33 +896,22 @@ void *vmm_io_memmap(uint64_t pa, uint64_t size)
 	uint64_t va =
 	    __atomic_fetch_add(&io_memmap_current_address, size, __ATOMIC_RELAXED);
 
-	// Map each page individually
-	const uint64_t pages_to_map = size / PAGE_SIZE;
-	for (uint64_t i = 0; i < pages_to_map; i++)
-	{
-		const uint64_t current_va = va + i * PAGE_SIZE;
-		const uint64_t current_pa = pa + i * PAGE_SIZE;
-		pte_t *pte = walk(kernel_pagetable, current_va, true, true);
-		if (pte == NULL)
-			return NULL; // OOM
-		if (pte_is_present(*pte))
-			panic("vmm_io_memmap: remap");
-
-		// Build IO mapping: writable, not executable, not user, cache-disabled
-		*pte = PTE_P | PTE_W | PTE_PWT | PTE_PCD | PTE_XD | PTE_SET_ADDR(current_pa);
-	}
+	// Build IO mapping: writable, not executable, not user, cache-disabled
+	if (map_range(kernel_pagetable, va, size, pa,
+	              PTE_P | PTE_W | PTE_PWT | PTE_PCD | PTE_XD | PTE_G, 0) < 0)
+		return NULL; // OOM
 	return (void *)va;
 }
 
 /**
  * Create a pagetable for a program running in userspace.
- * This is done by at first deep copying the kernel pagetable and then mapping
- * the user stuff in the lower addresses. The memory layout is almost as same as
+ * This is done by at first aliasing the upper half PML4 entries of the kernel
+ * pagetable and then mapping the user stuff in the lower addresses. The memory layout is almost as same as
  * https://i.sstatic.net/Ufj7o.png
  *
- * This method does not allocate pages for code, data and heap and only
- * allocates trap pages and the kernel address space. However, a single stack
- * page is allocated.
+ * This method does not allocate pages for code, data, heap and the user
+ * stack and only shares the kernel address space. The user memory is
+ * allocated on demand by the page fault handler.
  */
 pagetable_t vmm_user_pagetable_new()
 {
@@ -432,53 +919,14 @@ pagetable_t vmm_user_pagetable_new()
     pagetable_t pagetable = (pagetable_t)kcalloc();
     if (pagetable == NULL)
         return NULL;
-    memset(pagetable, 0, PAGE_SIZE);
-
-    // Deep copy kernel pagetable so upper-half is accessible in this CR3
-    if (copy_pagetable(pagetable, kernel_pagetable, 3) != 0)
-        return NULL;
 
-    // Create dedicated pages (contiguous to match mapped sizes)
-    void *user_stack = NULL, *int_stack = NULL, *syscall_stack = NULL;
-    size_t user_pages = USER_STACK_SIZE / PAGE_SIZE;
-    size_t int_pages = INTSTACK_SIZE / PAGE_SIZE;
-    size_t syscall_pages = SYSCALLSTACK_SIZE / PAGE_SIZE;
-    if ((user_stack = kalloc_pages(user_pages)) == NULL)
-        goto failed;
-    if ((int_stack = kalloc_pages(int_pages)) == NULL)
-        goto failed;
-    if ((syscall_stack = kalloc_pages(syscall_pages)) == NULL)
-        goto failed;
-
-    // Map pages
-    vmm_map_pages(
-        pagetable, USER_STACK_BOTTOM, USER_STACK_SIZE, V2P(user_stack),
-    (pte_permissions) {
-        .writable = 1, .executable = 0, .userspace = 1
-    });
-    vmm_map_pages(
-        pagetable, INTSTACK_VIRTUAL_ADDRESS_BOTTOM, INTSTACK_SIZE, V2P(int_stack),
-    (pte_permissions) {
-        .writable = 1, .executable = 0, .userspace = 0
-    });
-    vmm_map_pages(
-        pagetable, SYSCALLSTACK_VIRTUAL_ADDRESS_BOTTOM, SYSCALLSTACK_SIZE,
-        V2P(syscall_stack),
-    (pte_permissions) {
-        .writable = 1, .executable = 0, .userspace = 0
-    });
+    // Share the kernel half. vmm_init_kernel made sure all of these are
+    // present, so lower level kernel tables are never copied.
+    memcpy(&pagetable[KERNEL_PML4_FIRST], &kernel_pagetable[KERNEL_PML4_FIRST],
+           (PAGETABLE_PTE_COUNT - KERNEL_PML4_FIRST) * sizeof(pte_t));
 
     // Done
     return pagetable;
-
-failed:
-    if (user_stack != NULL)
-        kfree_pages(user_stack, user_pages);
-    if (int_stack != NULL)
-        kfree_pages(int_stack, int_pages);
-    if (syscall_stack != NULL)
-        kfree_pages(syscall_stack, syscall_pages);
-    return NULL;
 }
 
 /**
@@ -518,9 +966,14 @@ static void vmm_user_pagetable_free_recursive(pagetable_t pagetable,
             (current_va_high < USERSPACE_VA_MIN && current_va_low < USERSPACE_VA_MIN))
             continue;
 
-        // User mappings should never be huge; skip defensively if encountered
+        // 2 MiB user pages are freed whole
         if (pte_is_huge(pte))
+        {
+            if (level == 1 && phys_addr_valid(pte_follow(pte)))
+                kfree_huge_page(P2V(pte_follow(pte)));
+            pagetable[i] = 0;
             continue;
+        }
         uint64_t child_pa = pte_follow(pte);
         if (!phys_addr_valid(child_pa)) { pagetable[i] = 0; continue; }
         pagetable_t child = (pagetable_t)P2V(child_pa);
@@ -533,74 +986,242 @@ static void vmm_user_pagetable_free_recursive(pagetable_t pagetable,
 
 /**
  * Frees all pages of a user program from a pagetable.
- * After that, the page table pages are also deleted.
+ * After that, the page table pages are also deleted. The shared kernel half
+ * is outside of the userspace window and thus never touched.
  */
 void vmm_user_pagetable_free(pagetable_t pagetable)
 {
+    // The scheduler keeps running on the pagetable of the last process,
+    // and the process may have run on other cores before it exited here.
+    // They leave it once they run something else or go idle, which they
+    // do with interrupts off, so the wait is short.
+    if (get_installed_pagetable() == V2P(pagetable))
+        vmm_switch_to_kernel();
+    for (uint8_t cpu = 0; cpu < cpu_count(); cpu++)
+        while (__atomic_load_n(&cpu_local_of(cpu)->user_pagetable, __ATOMIC_ACQUIRE) == pagetable)
+            __asm__ volatile("pause");
+
     // Recursively free all lower-half (userspace) mappings and page tables
     vmm_user_pagetable_free_recursive(pagetable, 0, 3);
 }
 
 /**
- * For an sbrk with positive delta it will allocate the new pages (if needed)
- * and return the new sbrk value to set in the PCB.
+ * Removes the pages in [va, va + size) from a user pagetable and frees
+ * their frames. Pages which were never touched are skipped. va and size
+ * must be page aligned. Returns -1 if a 2 MiB page had to be split but
+ * there was no memory; the pages before it are unmapped then.
+ */
+int vmm_user_unmap(pagetable_t pagetable, uint64_t va, uint64_t size)
+{
+	if (va % PAGE_SIZE != 0 || size % PAGE_SIZE != 0)
+		panic("vmm_user_unmap: not aligned");
+
+	// Syscalls run on the pagetable of the process, so this is the
+	// installed pagetable
+	return unmap_range(pagetable, va, size, true);
+}
+
+/**
+ * Shares the page which pte maps with the child entry for fork. A writable
+ * page becomes copy-on-write in both.
  */
-uint64_t vmm_user_sbrk_allocate(pagetable_t pagetable, uint64_t old_sbrk,
-                                uint64_t delta)
+static void share_user_page(pte_t *child, pte_t *pte)
 {
-	uint64_t new_sbrk = old_sbrk + delta;
-	old_sbrk = PAGE_ROUND_UP(old_sbrk);
-	for (uint64_t currently_allocating = old_sbrk;
-	        currently_allocating < new_sbrk; currently_allocating += PAGE_SIZE)
+	if (pte_is_writable(*pte))
+		*pte = (*pte & ~PTE_W) | PTE_COW;
+	mem_page_share(P2V(pte_follow(*pte)));
+	*child = *pte;
+}
+
+/**
+ * Shares the user pages of source with destination for fork. Writable pages
+ * become read-only copy-on-write pages in both pagetables, so the caller
+ * must flush the TLB if source is installed. Kernel-only pages in the user
+ * half are left alone, but PROT_NONE pages are shared. Returns -1 if out of memory; the
+ * pages shared so far stay in destination and are released when it is
+ * freed.
+ */
+static int vmm_user_pagetable_copy_recursive(pagetable_t destination, pagetable_t source,
+        const uint64_t initial_va, int level)
+{
+	for (size_t i = 0; i < PAGETABLE_PTE_COUNT; i++)
 	{
-		if (vmm_allocate(
-		            pagetable, currently_allocating, PAGE_SIZE,
-		(pte_permissions) {
-		.writable = 1, .executable = 0, .userspace = 1
-	},
-	true) < 0)
+		pte_t *pte = &source[i];
+		if (!pte_is_present(*pte))
+			continue;
+		const uint64_t current_va = initial_va | (i << (level * 9 + 12));
+
+		if (level == 0)
+		{
+			if (!pte_is_user(*pte) && !(*pte & PTE_NONE))
+				continue;
+			pte_t *child_pte = walk(destination, current_va, true, false);
+			if (child_pte == NULL)
+				return -1;
+			share_user_page(child_pte, pte);
+			continue;
+		}
+
+		// Only descend into the userspace window
+		const uint64_t current_va_end = current_va + (1ULL << (level * 9 + 12));
+		if (current_va >= USERSPACE_VA_MAX || current_va_end <= USERSPACE_VA_MIN)
+			continue;
+		if (pte_is_huge(*pte))
 		{
-			// TODO: handle OOM
-			panic("sbrk: OOM");
-			break;
+			// A 2 MiB page is shared whole
+			if (level != 1 || (!pte_is_user(*pte) && !(*pte & PTE_NONE)))
+				continue;
+			pte_t *child_pde = walk_pde(destination, current_va, true);
+			if (child_pde == NULL)
+				return -1;
+			share_user_page(child_pde, pte);
+			continue;
 		}
+		if (vmm_user_pagetable_copy_recursive(destination, (pagetable_t)P2V(pte_follow(*pte)),
+		                                      current_va, level - 1) < 0)
+			return -1;
 	}
-	return new_sbrk;
+	return 0;
+}
+
+int vmm_user_pagetable_copy(pagetable_t destination, pagetable_t source)
+{
+	return vmm_user_pagetable_copy_recursive(destination, source, 0, 3);
 }
 
 /**
- * Deallocated memory in a range of [old_sbrk, old_sbrk - delta].
- * Will not partially remove allocated pages.
- * Will return the new sbrk value set to old_sbrk - delta. This function
- * will not fail unless the page table contains unallocated pages.
+ * vmm_user_make_writable for a 2 MiB copy-on-write page. A shared one is
+ * copied into a new 2 MiB page, or split into private 4 KiB pages if
+ * there is no free 2 MiB block.
  */
-uint64_t vmm_user_sbrk_deallocate(pagetable_t pagetable, uint64_t old_sbrk,
-                                  uint64_t delta)
+static int make_huge_writable(pagetable_t pagetable, pte_t *pde, uint64_t va)
 {
-	uint64_t new_sbrk = old_sbrk - delta;
-	old_sbrk = PAGE_ROUND_DOWN(old_sbrk);
-	for (uint64_t currently_deallocating = old_sbrk;
-	        currently_deallocating > new_sbrk; currently_deallocating -= PAGE_SIZE)
+	void *old_page = P2V(pte_follow(*pde));
+	if (mem_page_shared(old_page))
 	{
-		// Find the frame allocated
-		pte_t *pte = walk(pagetable, currently_deallocating, false, false);
-		if (pte == NULL)
-			panic("vmm_user_sbrk_deallocate: non-existant page");
-
-		// Save physical address before clearing PTE
-		uint64_t pa = pte_follow(*pte);
+		void *new_page = kalloc_huge_page(KALLOC_NOZERO);
+		if (new_page == NULL)
+		{
+			if (split_huge(pde, va) < 0)
+				return -1;
+			return vmm_user_make_writable(pagetable, va);
+		}
+		memcpy_fpu(new_page, old_page, HUGE_PAGE_SIZE);
+		*pde = (*pde & ~PTE_ADDR_MASK) | PTE_SET_ADDR(V2P(new_page));
+		kfree_huge_page(old_page); // drops our share
+	}
+	*pde = (*pde & ~PTE_COW) | PTE_W;
+	vmm_invalidate_page(va);
+	return 0;
+}
 
-		// Mark it invalid in the page table
-		*pte = 0; // Clear entire PTE
+/**
+ * Makes a present user page writable for a write fault. A copy-on-write
+ * page is copied unless this pagetable is its last owner, in which case it
+ * is simply taken over. Returns -1 if the page is read-only for real.
+ */
+int vmm_user_make_writable(pagetable_t pagetable, uint64_t va)
+{
+	va = PAGE_ROUND_DOWN(va);
+	pte_t *pte = walk(pagetable, va, false, false);
+	if (pte == NULL || !pte_is_present(*pte) || !pte_is_user(*pte))
+		return -1;
+	if (pte_is_writable(*pte))
+		return 0; // stale TLB entry, nothing to do
+	if (!(*pte & PTE_COW))
+		return -1;
+	if (pte_is_huge(*pte))
+		return make_huge_writable(pagetable, pte, va);
+
+	void *old_page = P2V(pte_follow(*pte));
+	if (mem_page_shared(old_page))
+	{
+		void *new_page = kalloc_flags(KALLOC_NOZERO);
+		if (new_page == NULL)
+			return -1;
+		memcpy(new_page, old_page, PAGE_SIZE);
+		*pte = (*pte & ~PTE_ADDR_MASK) | PTE_SET_ADDR(V2P(new_page));
+		kfree(old_page); // drops our share
+	}
+	*pte = (*pte & ~PTE_COW) | PTE_W;
+	vmm_invalidate_page(va);
+	return 0;
+}
 
-		// Invalidate TLB entry if this is the current pagetable
-		// Note: You'll need to check if pagetable == current CR3
-		vmm_invalidate_page(currently_deallocating);
+/**
+ * Returns a present user PTE or 2 MiB entry with the permissions changed
+ * like vmm_user_protect describes
+ */
+static pte_t protect_entry(pte_t pte, pte_permissions permissions)
+{
+	pte_t entry = pte & ~(PTE_W | PTE_U | PTE_XD | PTE_COW | PTE_NONE);
+	if (permissions.writable)
+		entry |= pte_is_writable(pte) ? PTE_W : PTE_COW;
+	if (!permissions.executable)
+		entry |= PTE_XD;
+	entry |= permissions.userspace ? PTE_U : PTE_NONE;
+	return entry;
+}
 
-		// Delete the frame
-		kfree((void *)P2V(pa));
+/**
+ * Changes the permissions of the present pages in [va, va + size) of a
+ * user pagetable which must be installed. Pages which become writable are
+ * marked copy-on-write instead, so the next write goes through
+ * vmm_user_make_writable which copies them if they are shared. If
+ * permissions.userspace is clear, the pages become inaccessible from
+ * userspace but keep their contents. 2 MiB pages which are only partly in
+ * the range are split; returns -1 if that runs out of memory.
+ */
+int vmm_user_protect(pagetable_t pagetable, uint64_t va, uint64_t size,
+                     pte_permissions permissions)
+{
+	if (va % PAGE_SIZE != 0 || size % PAGE_SIZE != 0)
+		panic("vmm_user_protect: not aligned");
+
+	const bool flush_all = size / PAGE_SIZE > VMM_INVLPG_MAX;
+	bool changed = false;
+	int result = 0;
+	const uint64_t end = va + size;
+	for (uint64_t current = va; current < end;)
+	{
+		uint64_t next;
+		pte_t *pte = lookup(pagetable, current, &next);
+		if (pte == NULL)
+		{
+			current = next > current ? next : end;
+			continue;
+		}
+		if (pte_is_huge(*pte))
+		{
+			const uint64_t huge_end = (current | (HUGE_PAGE_SIZE - 1)) + 1;
+			if (current % HUGE_PAGE_SIZE != 0 || huge_end > end)
+			{
+				if (split_huge(pte, current) < 0)
+				{
+					result = -1;
+					break;
+				}
+				continue; // look the leaf pagetable up again
+			}
+			*pte = protect_entry(*pte, permissions);
+			vmm_invalidate_page(current);
+			current = huge_end;
+			continue;
+		}
+		for (const uint64_t table_end = leaf_table_end(current, end); current < table_end;
+		        current += PAGE_SIZE, pte++)
+		{
+			if (!pte_is_present(*pte))
+				continue;
+			*pte = protect_entry(*pte, permissions);
+			changed = true;
+			if (!flush_all)
+				vmm_invalidate_page(current);
+		}
 	}
-	return new_sbrk;
+	if (flush_all && changed)
+		vmm_flush_tlb();
+	return result;
 }
 
 /**
@@ -625,7 +1246,7 @@ int vmm_memcpy(pagetable_t pagetable, uint64_t destination_virtual_address,
 		        pte_is_user(*pte) != userspace || !pte_is_writable(*pte))
 			return -1; // invalid page
 
-		uint64_t pa0 = (uint64_t)P2V(pte_follow(*pte));
+		uint64_t pa0 = (uint64_t)P2V(pte_frame(*pte, va0));
 		uint64_t n = PAGE_SIZE - (destination_virtual_address - va0);
 		if (n > len)
 			n = len;
@@ -660,198 +1281,505 @@ void *vmm_map_physical(uint64_t phys_start, uint64_t phys_end) {
 		panic("vmm_map_physical: invalid range");
 
 	// Align down to page boundary for safety
-	uint64_t aligned_start = phys_start & ~(PAGE_SIZE - 1);
+	uint64_t aligned_start = phys_start & ~(uint64_t)(PAGE_SIZE - 1);
 	uint64_t offset = phys_start - aligned_start;
 
 	uint64_t size = phys_end - aligned_start;
 	if (size % PAGE_SIZE)
-		size = (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+		size = (size + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
 
 	void *va = vmm_io_memmap(aligned_start, size);
 
 	return (void *)((uintptr_t)va + offset);
 }
 
+/* ========== Kernel stacks ========== */
+
+/*
+ * Kernel stacks live in fixed slots of the KERNEL_STACK_BASE window, each
+ * above a guard page whose PTE is simply left empty, so guards cost no
+ * memory. A slot is mapped the first time it is handed out and stays
+ * mapped: freed stacks go back to a pool and the next process gets one as
+ * it is, so creating and reaping processes does not touch the pagetable.
+ */
+static uint32_t kernel_stack_pool[KERNEL_STACK_SLOTS]; /* free mapped slots, LIFO */
+static uint32_t kernel_stack_pool_count = 0;
+static uint32_t kernel_stack_next = 0;                 /* first slot never mapped */
+static struct spinlock kernel_stack_lock;
+
+/**
+ * Maps the stack of a slot which was never used. Returns -1 if out of
+ * memory, with nothing of the slot left mapped.
+ */
+static int kernel_stack_map(uint32_t slot)
+{
+	const uint64_t stack_va = KERNEL_STACK_BASE + slot * KERNEL_STACK_TOTAL_SIZE + KERNEL_STACK_GUARD_SIZE;
+	if (map_range(kernel_pagetable, stack_va, KERNEL_STACK_SIZE, MAP_RANGE_ALLOCATE,
+	              PTE_P | PTE_W | PTE_XD | PTE_G, KALLOC_NOZERO) < 0)
+	{
+		// So the slot can be mapped again later
+		unmap_range(kernel_pagetable, stack_va, KERNEL_STACK_SIZE, true);
+		return -1;
+	}
+	return 0;
+}
+
 /**
- * Allocate a kernel stack for a process with a guard page at the bottom.
- * Layout:
- *   [Guard Page (unmapped)] [Stack (16KB)] <- SP starts here
- *   ^base                   ^base+4KB      ^base+20KB (top)
- */
-uint64_t vmm_allocate_proc_kernel_stack(uint64_t i)
-{
-	uint64_t kernel_va = KERNEL_STACK_BASE + i * KERNEL_STACK_TOTAL_SIZE;
-	
-	// 1. Map guard page as NOT PRESENT (will page fault on access)
-	uint64_t guard_va = kernel_va;
-	pte_t *guard_pte = walk_kernel(kernel_pagetable, guard_va, true);
-	if (!guard_pte) {
-		panic("vmm_allocate_proc_kernel_stack: failed to allocate guard page PTE");
-	}
-	
-	// Allocate physical page but mark as not present
-	void *guard_page = kalloc_for_page_cache();
-	if (!guard_page) {
-		panic("vmm_allocate_proc_kernel_stack: out of memory for guard page");
-	}
-	
-	// Set PTE with NOT PRESENT bit (no PTE_P flag)
-	*guard_pte = PTE_SET_ADDR(V2P(guard_page)); // Intentionally omit PTE_P
-	vmm_invalidate_page(guard_va);
-	
-	// 2. Allocate actual stack pages (16KB = 4 pages)
-	uint64_t stack_va = kernel_va + KERNEL_STACK_GUARD_SIZE;
-	uint64_t stack_remaining = KERNEL_STACK_SIZE;
-	
-	while (stack_remaining) {
-		void *proc_page = kalloc_for_page_cache();
-		if (!proc_page) {
-			panic("vmm_allocate_proc_kernel_stack: out of memory for stack pages");
+ * Maps the first KERNEL_STACK_POOL_INITIAL stacks so the first processes
+ * do not have to
+ */
+void vmm_init_kernel_stacks(void)
+{
+	for (uint32_t slot = 0; slot < KERNEL_STACK_POOL_INITIAL; slot++)
+		if (kernel_stack_map(slot) < 0)
+			panic("vmm_init_kernel_stacks: out of memory");
+	// Hand out the lowest slots first
+	for (uint32_t slot = KERNEL_STACK_POOL_INITIAL; slot-- > 0;)
+		kernel_stack_pool[kernel_stack_pool_count++] = slot;
+	kernel_stack_next = KERNEL_STACK_POOL_INITIAL;
+}
+
+/**
+ * Takes a kernel stack from the pool, or maps a new one if the pool is
+ * empty. Returns the top of the stack, or 0 if every slot is taken or
+ * there is no memory for a new one.
+ *   [Guard Page (not present)] [Stack (16KB)] <- SP starts here
+ *   ^base                      ^base+4KB      ^base+20KB (top)
+ */
+uint64_t vmm_allocate_proc_kernel_stack(void)
+{
+	spinlock_lock(&kernel_stack_lock);
+	uint32_t slot;
+	if (kernel_stack_pool_count > 0)
+		slot = kernel_stack_pool[--kernel_stack_pool_count];
+	else if (kernel_stack_next < KERNEL_STACK_SLOTS && kernel_stack_map(kernel_stack_next) == 0)
+		slot = kernel_stack_next++;
+	else
+	{
+		spinlock_unlock(&kernel_stack_lock);
+		return 0;
+	}
+	spinlock_unlock(&kernel_stack_lock);
+	return KERNEL_STACK_BASE + (slot + 1) * KERNEL_STACK_TOTAL_SIZE;
+}
+
+/**
+ * Gives a kernel stack back to the pool. It stays mapped.
+ */
+void vmm_free_proc_kernel_stack(uint64_t stack_top)
+{
+	const uint64_t offset = stack_top - KERNEL_STACK_BASE;
+	if (stack_top <= KERNEL_STACK_BASE || offset % KERNEL_STACK_TOTAL_SIZE != 0 ||
+	    offset / KERNEL_STACK_TOTAL_SIZE > kernel_stack_next)
+		panic("vmm_free_proc_kernel_stack: not a kernel stack");
+	spinlock_lock(&kernel_stack_lock);
+	kernel_stack_pool[kernel_stack_pool_count++] = offset / KERNEL_STACK_TOTAL_SIZE - 1;
+	spinlock_unlock(&kernel_stack_lock);
+}
+
+/* ========== vmalloc ========== */
+
+/*
+ * The vmalloc window is managed with a bitmap of its pages. Every area is
+ * followed by an unmapped guard page which is marked in vmalloc_end, so
+ * vfree can find the end of an area without any other metadata.
+ *
+ * Freed areas are unmapped right away but their addresses are not reused
+ * until the next purge, which flushes the TLB once for up to
+ * VMALLOC_LAZY_MAX areas instead of invalidating every page on each vfree.
+ * The other cores flush theirs on their next tick, so purged areas wait in
+ * vmalloc_stale until every core is past the epoch of the purge.
+ */
+#define VMALLOC_PAGES (VMALLOC_SIZE / PAGE_SIZE)
+#define VMALLOC_LAZY_MAX 64
+
+static uint64_t vmalloc_used[VMALLOC_PAGES / 64];  /* taken, guard pages included */
+static uint64_t vmalloc_end[VMALLOC_PAGES / 64];   /* guard page closing an area */
+static struct {
+	uint32_t first;
+	uint32_t pages;
+} vmalloc_lazy[VMALLOC_LAZY_MAX];                  /* freed, waiting for a purge */
+static uint32_t vmalloc_lazy_count = 0;
+static uint64_t vmalloc_stale[VMALLOC_PAGES / 64]; /* purged, maybe in a TLB */
+static uint64_t vmalloc_stale_epoch = 0;           /* of the last purge, 0 if none */
+static uint64_t vmalloc_next = 0;                  /* next fit search start */
+static uint64_t vmalloc_purges = 0;
+static struct spinlock vmalloc_lock;
+
+static inline bool vmalloc_bit(const uint64_t *map, uint64_t page)
+{
+	return (map[page / 64] >> (page % 64)) & 1;
+}
+
+static inline void vmalloc_set_bits(uint64_t *map, uint64_t first, uint64_t pages, bool value)
+{
+	for (uint64_t page = first; page < first + pages; page++)
+	{
+		if (value)
+			map[page / 64] |= 1ULL << (page % 64);
+		else
+			map[page / 64] &= ~(1ULL << (page % 64));
+	}
+}
+
+/**
+ * Finds pages free pages in a row, starting from vmalloc_next and wrapping
+ * around once. Returns VMALLOC_PAGES if there are none. Caller must hold
+ * vmalloc_lock.
+ */
+static uint64_t vmalloc_find(uint64_t pages)
+{
+	uint64_t run = 0;
+	for (uint64_t scanned = 0, page = vmalloc_next; scanned < VMALLOC_PAGES + pages; scanned++, page++)
+	{
+		if (page == VMALLOC_PAGES)
+		{
+			page = 0;
+			run = 0;
+		}
+		// Skip fully used words
+		if (page % 64 == 0 && vmalloc_used[page / 64] == UINT64_MAX && scanned + 64 < VMALLOC_PAGES + pages)
+		{
+			run = 0;
+			page += 63;
+			scanned += 63;
+			continue;
 		}
-		
-		uint64_t kernel_pa = V2P(proc_page);
-		
-		// Map one page at a time
-		if (vmm_map_kernel_pages(
-		            kernel_pagetable,
-		            stack_va + (KERNEL_STACK_SIZE - stack_remaining),
-		            kernel_pa,
-		            PAGE_SIZE,
-		(pte_permissions) {
-			.writable=1, .executable=0, .userspace=0
-		}) < 0) {
-			panic("vmm_allocate_proc_kernel_stack: failed to map stack page");
+		if (vmalloc_bit(vmalloc_used, page))
+		{
+			run = 0;
+			continue;
 		}
-		
-		stack_remaining -= PAGE_SIZE;
-	}
-	
-	// Return top of stack (grows downward)
-	return stack_va + KERNEL_STACK_SIZE;
-}
-
-/**
- * Free kernel stack including guard page.
- */
-void vmm_free_proc_kernel_stack(uint64_t i)
-{
-	uint64_t kernel_va = KERNEL_STACK_BASE + i * KERNEL_STACK_TOTAL_SIZE;
-	
-	// 1. Free guard page
-	pte_t *guard_pte = walk_kernel(kernel_pagetable, kernel_va, false);
-	if (guard_pte) {
-		uint64_t guard_pa = pte_follow(*guard_pte);
-		*guard_pte = 0; // Clear PTE
-		vmm_invalidate_page(kernel_va);
-		kfree((void*)P2V(guard_pa));
-	}
-	
-	// 2. Free stack pages
-	uint64_t stack_va = kernel_va + KERNEL_STACK_GUARD_SIZE;
-	uint64_t stack_remaining = KERNEL_STACK_SIZE;
-	
-	while (stack_remaining) {
-		uint64_t va = stack_va + (KERNEL_STACK_SIZE - stack_remaining);
-		pte_t *pte = walk_kernel(kernel_pagetable, va, false);
-		if (!pte || !pte_is_present(*pte)) {
-			panic("vmm_free_proc_kernel_stack: missing PTE for stack page");
+		if (++run == pages)
+			return page + 1 - pages;
+	}
+	return VMALLOC_PAGES;
+}
+
+/**
+ * Makes the purged areas available again if no core can have them in its
+ * TLB anymore. Caller must hold vmalloc_lock.
+ */
+static void vmalloc_release_stale(void)
+{
+	if (vmalloc_stale_epoch == 0 || !tlb_epoch_done(vmalloc_stale_epoch))
+		return;
+	for (uint64_t i = 0; i < VMALLOC_PAGES / 64; i++)
+	{
+		vmalloc_used[i] &= ~vmalloc_stale[i];
+		vmalloc_stale[i] = 0;
+	}
+	vmalloc_stale_epoch = 0;
+}
+
+/**
+ * Flushes the TLB for the lazily freed areas and makes them available
+ * again, right away if this is the only core. Caller must hold
+ * vmalloc_lock.
+ */
+static void vmalloc_purge(void)
+{
+	vmalloc_release_stale();
+	if (vmalloc_lazy_count == 0)
+		return;
+	for (uint32_t i = 0; i < vmalloc_lazy_count; i++)
+		vmalloc_set_bits(vmalloc_stale, vmalloc_lazy[i].first, vmalloc_lazy[i].pages, true);
+	vmalloc_lazy_count = 0;
+	// vmalloc mappings are global. Areas which are still stale from an
+	// earlier purge now wait for this epoch too.
+	vmalloc_stale_epoch = tlb_epoch_begin();
+	vmalloc_purges++;
+	vmalloc_release_stale();
+}
+
+/**
+ * Allocates size bytes of virtually contiguous kernel memory backed by
+ * pages which do not need to be physically contiguous. The memory is not
+ * cleared. Returns NULL if out of memory or address space.
+ */
+void *vmalloc(size_t size)
+{
+	const uint64_t pages = PAGE_ROUND_UP(size) / PAGE_SIZE;
+	if (pages == 0 || pages >= VMALLOC_PAGES)
+		return NULL;
+
+	spinlock_lock(&vmalloc_lock);
+	uint64_t first = vmalloc_find(pages + 1);
+	if (first == VMALLOC_PAGES)
+	{
+		vmalloc_purge();
+		first = vmalloc_find(pages + 1);
+	}
+	if (first == VMALLOC_PAGES)
+	{
+		spinlock_unlock(&vmalloc_lock);
+		return NULL;
+	}
+	vmalloc_set_bits(vmalloc_used, first, pages + 1, true);
+	vmalloc_set_bits(vmalloc_end, first + pages, 1, true);
+	vmalloc_next = first + pages + 1;
+	spinlock_unlock(&vmalloc_lock);
+
+	const uint64_t va = VMALLOC_START + first * PAGE_SIZE;
+	for (uint64_t i = 0; i < pages; i++)
+	{
+		void *frame = kalloc_flags(KALLOC_NOZERO);
+		pte_t *pte = frame ? walk_kernel(kernel_pagetable, va + i * PAGE_SIZE, true) : NULL;
+		if (pte == NULL)
+		{
+			kfree(frame);
+			vfree((void *)va);
+			return NULL;
 		}
-		
-		uint64_t pa = pte_follow(*pte);
-		*pte = 0; // Clear entire PTE
-		vmm_invalidate_page(va);
-		kfree((void*)P2V(pa));
-		stack_remaining -= PAGE_SIZE;
+		*pte = PTE_P | PTE_W | PTE_XD | PTE_G | PTE_SET_ADDR(V2P(frame));
 	}
+	return (void *)va;
 }
 
 /**
- * Check if a virtual address range is valid for user access.
- * Ensures:
- * 1. Address is in user space range
- * 2. All pages are mapped and present
- * 3. All pages have user bit set
- * 4. If writable=true, all pages are writable
+ * Frees memory allocated with vmalloc.
  */
-bool vmm_validate_user_ptr(pagetable_t pagetable, const void *ptr, size_t len, bool writable)
+void vfree(void *addr)
 {
-	if (!ptr || len == 0) return false;
+	if (addr == NULL)
+		return;
+	if (!is_vmalloc_addr(addr) || (uint64_t)addr % PAGE_SIZE != 0)
+		panic("vfree: not a vmalloc address");
+	const uint64_t first = ((uint64_t)addr - VMALLOC_START) / PAGE_SIZE;
+	if (!vmalloc_bit(vmalloc_used, first) || vmalloc_bit(vmalloc_end, first))
+		panic("vfree: not allocated");
+
+	// Unmap and free the frames. Pages past a failed vmalloc are not mapped.
+	uint64_t page = first;
+	for (; !vmalloc_bit(vmalloc_end, page); page++)
+	{
+		pte_t *pte = walk_kernel(kernel_pagetable, VMALLOC_START + page * PAGE_SIZE, false);
+		if (pte == NULL || !pte_is_present(*pte))
+			continue;
+		kfree(P2V(pte_follow(*pte)));
+		*pte = 0;
+	}
 
-	uintptr_t start = (uintptr_t)ptr;
-	uintptr_t end = start + len;
+	spinlock_lock(&vmalloc_lock);
+	vmalloc_set_bits(vmalloc_end, page, 1, false);
+	if (vmalloc_lazy_count == VMALLOC_LAZY_MAX)
+		vmalloc_purge();
+	vmalloc_lazy[vmalloc_lazy_count].first = (uint32_t)first;
+	vmalloc_lazy[vmalloc_lazy_count].pages = (uint32_t)(page + 1 - first);
+	vmalloc_lazy_count++;
+	spinlock_unlock(&vmalloc_lock);
+}
 
-	// Check for overflow
-	if (end < start) return false;
+#ifdef DZOS_BOOT_BENCHMARKS
+/**
+ * Counts the pagetable pages reachable from a table, including itself.
+ * Frames mapped by the leaves are not counted.
+ */
+static uint64_t count_table_pages(const pagetable_t pagetable, int level)
+{
+	uint64_t pages = 1;
+	if (level == 0)
+		return pages;
+	for (size_t i = 0; i < PAGETABLE_PTE_COUNT; i++)
+	{
+		const pte_t pte = pagetable[i];
+		if (pte_is_present(pte) && !pte_is_huge(pte))
+			pages += count_table_pages((pagetable_t)P2V(pte_follow(pte)), level - 1);
+	}
+	return pages;
+}
 
-	// Must be in user space
-	if (start >= USERSPACE_VA_MAX || end > USERSPACE_VA_MAX) return false;
-	if (start < USERSPACE_VA_MIN) return false;
+/**
+ * Boot-time benchmark of address space creation. Reports the latency of
+ * creating and destroying a user pagetable and the number of pagetable
+ * pages each process pays for, compared to deep copying the kernel half.
+ */
+void vmm_bench_pagetables(void)
+{
+	const int rounds = 64;
+	const uint64_t tsc_hz = rtc_tsc_frequency();
 
-	// Check each page in the range
-	uintptr_t page_start = PAGE_ROUND_DOWN(start);
-	uintptr_t page_end = PAGE_ROUND_UP(end);
+	uint64_t deep_copy_pages = 1;
+	for (size_t i = KERNEL_PML4_FIRST; i < PAGETABLE_PTE_COUNT; i++)
+		deep_copy_pages += count_table_pages((pagetable_t)P2V(pte_follow(kernel_pagetable[i])), 2);
 
-	for (uintptr_t va = page_start; va < page_end; va += PAGE_SIZE) {
-		pte_t *pte = walk(pagetable, va, false, false);
-		if (!pte) return false;
-		if (!pte_is_present(*pte)) return false;
-		if (!pte_is_user(*pte)) return false;
-		if (writable && !pte_is_writable(*pte)) return false;
+	uint64_t shared_pages = 0;
+	const uint64_t start = get_tsc();
+	for (int r = 0; r < rounds; r++)
+	{
+		pagetable_t pagetable = vmm_user_pagetable_new();
+		if (pagetable == NULL)
+			panic("vmm_bench_pagetables: OOM");
+		if (r == 0)
+		{
+			shared_pages = 1;
+			for (size_t i = 0; i < KERNEL_PML4_FIRST; i++)
+				if (pte_is_present(pagetable[i]))
+					shared_pages += count_table_pages((pagetable_t)P2V(pte_follow(pagetable[i])), 2);
+		}
+		vmm_user_pagetable_free(pagetable);
 	}
+	const uint64_t cycles = (get_tsc() - start) / rounds;
 
-	return true;
+	ktprintf("[bench] user pagetable new+free: %llu cycles (%llu ns)\n",
+	         cycles, tsc_hz ? cycles * 1000000000ull / tsc_hz : 0);
+	ktprintf("[bench] pagetable pages per process: %llu (%llu KiB), deep copy: %llu (%llu KiB)\n",
+	         shared_pages, shared_pages * PAGE_SIZE / 1024,
+	         deep_copy_pages, deep_copy_pages * PAGE_SIZE / 1024);
 }
 
 /**
- * Safely copy a string from user space to kernel space.
- * Validates each page as we cross page boundaries.
+ * Boot-time benchmark of vmalloc against physically contiguous
+ * allocations of the same size, and of how many TLB flushes the lazy purge
+ * saves.
  */
-int vmm_copy_user_string(pagetable_t pagetable, const char *user_str, char *kernel_buf, size_t max_len)
+void vmm_bench_vmalloc(void)
 {
-	if (!user_str || !kernel_buf || max_len == 0) return -1;
+	const int rounds = 256;
+	const size_t size = 64 * 1024;
+	const uint64_t tsc_hz = rtc_tsc_frequency();
+	const uint64_t purges_before = vmalloc_purges;
+
+	uint64_t start = get_tsc();
+	for (int r = 0; r < rounds; r++)
+	{
+		void *p = vmalloc(size);
+		if (p == NULL)
+			panic("vmm_bench_vmalloc: OOM");
+		((volatile uint8_t *)p)[size - 1] = 1;
+		vfree(p);
+	}
+	const uint64_t vmalloc_cycles = (get_tsc() - start) / rounds;
+
+	start = get_tsc();
+	for (int r = 0; r < rounds; r++)
+	{
+		void *p = kalloc_pages(size / PAGE_SIZE);
+		if (p == NULL)
+			panic("vmm_bench_vmalloc: OOM");
+		kfree_pages(p, size / PAGE_SIZE);
+	}
+	const uint64_t pages_cycles = (get_tsc() - start) / rounds;
 
-	uintptr_t user_addr = (uintptr_t)user_str;
-	
-	// Must start in user space
-	if (user_addr >= USERSPACE_VA_MAX || user_addr < USERSPACE_VA_MIN) return -1;
+	ktprintf("[bench] 64 KiB vmalloc+vfree: %llu ns, kalloc_pages+kfree_pages: %llu ns, %llu TLB flushes for %d frees\n",
+	         tsc_hz ? vmalloc_cycles * 1000000000ull / tsc_hz : 0,
+	         tsc_hz ? pages_cycles * 1000000000ull / tsc_hz : 0,
+	         vmalloc_purges - purges_before, rounds);
+}
 
-	size_t copied = 0;
-	uintptr_t current_page = PAGE_ROUND_DOWN(user_addr);
-	bool current_page_valid = false;
+/**
+ * Touches one byte of each page so the TLB has to map them
+ */
+static void touch_pages(uint64_t va, size_t pages)
+{
+	for (size_t i = 0; i < pages; i++)
+		(void)((volatile const uint8_t *)va)[i * PAGE_SIZE];
+}
 
-	while (copied < max_len - 1) {
-		uintptr_t va = user_addr + copied;
+/**
+ * Boot-time benchmark of switching between two processes. Each round
+ * installs one of two address spaces and touches some of its user pages
+ * and some kernel pages, like a process and the scheduler would. The old
+ * way flushes the whole TLB when entering the process and again when going
+ * back to the kernel pagetable. CR4.PGE is already on, so it toggles PGE
+ * to lose the kernel entries too, as before global pages. The new way
+ * switches PCIDs and keeps the global kernel mappings.
+ */
+void vmm_bench_context_switch(void)
+{
+	const int rounds = 1024;
+	const size_t user_pages = 16, kernel_pages = 32;
+	const uint64_t tsc_hz = rtc_tsc_frequency();
+
+	pagetable_t pagetables[2];
+	uint64_t asid[2] = {0, 0};
+	void *kernel_buffer = kalloc_pages(kernel_pages);
+	for (int i = 0; i < 2; i++)
+	{
+		pagetables[i] = vmm_user_pagetable_new();
+		if (pagetables[i] == NULL || kernel_buffer == NULL ||
+		    vmm_allocate(pagetables[i], USERSPACE_VA_MIN, user_pages * PAGE_SIZE,
+		                 (pte_permissions){.writable = 1, .userspace = 1}, true) < 0)
+			panic("vmm_bench_context_switch: OOM");
+	}
 
-		// Check if we crossed into a new page
-		if (PAGE_ROUND_DOWN(va) != current_page) {
-			current_page = PAGE_ROUND_DOWN(va);
-			current_page_valid = false;
-		}
+	uint64_t start = get_tsc();
+	for (int r = 0; r < rounds; r++)
+	{
+		install_pagetable(V2P(pagetables[r % 2]));
+		vmm_flush_tlb_all();
+		touch_pages(USERSPACE_VA_MIN, user_pages);
+		install_pagetable(V2P(kernel_pagetable));
+		vmm_flush_tlb_all();
+		touch_pages((uint64_t)kernel_buffer, kernel_pages);
+	}
+	const uint64_t flush_cycles = (get_tsc() - start) / rounds;
 
-		// Validate page on first access
-		if (!current_page_valid) {
-			pte_t *pte = walk(pagetable, current_page, false, false);
-			if (!pte || !pte_is_present(*pte) || !pte_is_user(*pte)) {
-				return -1;
-			}
-			current_page_valid = true;
-		}
+	start = get_tsc();
+	for (int r = 0; r < rounds; r++)
+	{
+		vmm_switch_pagetable(pagetables[r % 2], &asid[r % 2]);
+		touch_pages(USERSPACE_VA_MIN, user_pages);
+		touch_pages((uint64_t)kernel_buffer, kernel_pages);
+	}
+	const uint64_t pcid_cycles = (get_tsc() - start) / rounds;
 
-		// Get physical address and read character
-		uint64_t pa = vmm_walkaddr(pagetable, va, true);
-		if (pa == 0) return -1;
+	vmm_switch_to_kernel();
+	for (int i = 0; i < 2; i++)
+		vmm_user_pagetable_free(pagetables[i]);
+	kfree_pages(kernel_buffer, kernel_pages);
 
-		char c = *(char *)P2V(pa);
-		kernel_buf[copied] = c;
+	ktprintf("[bench] context switch with TLB flushes: %llu cycles (%llu ns), %s: %llu cycles (%llu ns)\n",
+	         flush_cycles, tsc_hz ? flush_cycles * 1000000000ull / tsc_hz : 0,
+	         pcid_enabled ? "with PCID" : "without PCID", pcid_cycles,
+	         tsc_hz ? pcid_cycles * 1000000000ull / tsc_hz : 0);
+}
 
-		if (c == '\0') {
-			return (int)copied; // Success - found null terminator
-		}
+/**
+ * Boot-time benchmark of 2 MiB user pages. Maps the same amount of memory
+ * with 2 MiB pages and with 4 KiB pages and times passes which touch every
+ * 4 KiB of it, which is dominated by TLB misses for the small pages.
+ */
+void vmm_bench_huge_pages(void)
+{
+	const int rounds = 64;
+	const uint64_t base = 1ULL << 30, size = 4 * HUGE_PAGE_SIZE;
+	const size_t pages = size / PAGE_SIZE;
+	const pte_permissions permissions = {.writable = 1, .userspace = 1};
+	const uint64_t tsc_hz = rtc_tsc_frequency();
+
+	pagetable_t huge = vmm_user_pagetable_new();
+	pagetable_t small = vmm_user_pagetable_new();
+	if (huge == NULL || small == NULL ||
+	    vmm_allocate(huge, base, size, permissions, true) < 0)
+		panic("vmm_bench_huge_pages: OOM");
+	for (size_t i = 0; i < pages; i++)
+	{
+		void *page = kcalloc();
+		if (page == NULL ||
+		    vmm_map_pages(small, base + i * PAGE_SIZE, PAGE_SIZE, V2P(page), permissions) < 0)
+			panic("vmm_bench_huge_pages: OOM");
+	}
 
-		copied++;
+	uint64_t cycles[2];
+	pagetable_t pagetables[2] = {huge, small};
+	for (int i = 0; i < 2; i++)
+	{
+		install_pagetable(V2P(pagetables[i]));
+		vmm_flush_tlb();
+		touch_pages(base, pages);
+		const uint64_t start = get_tsc();
+		for (int r = 0; r < rounds; r++)
+			touch_pages(base, pages);
+		cycles[i] = (get_tsc() - start) / rounds;
 	}
 
-	// String too long - truncate and null-terminate
-	kernel_buf[max_len - 1] = '\0';
-	return -1; // Indicate truncation
+	vmm_switch_to_kernel();
+	vmm_user_pagetable_free(huge);
+	vmm_user_pagetable_free(small);
+
+	ktprintf("[bench] touching %llu MiB: 2 MiB pages %llu cycles (%llu ns), 4 KiB pages %llu cycles (%llu ns)\n",
+	         size / (1024 * 1024), cycles[0], tsc_hz ? cycles[0] * 1000000000ull / tsc_hz : 0,
+	         cycles[1], tsc_hz ? cycles[1] * 1000000000ull / tsc_hz : 0);
 }
+#endif
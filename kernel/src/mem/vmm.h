@@ -25,49 +25,51 @@
 #define USER_STACK_TOP USERSPACE_VA_MAX
 
 /**
- * Where we should put the bottom of the stack in the virtual address space
+ * The user stack starts as USER_STACK_SIZE bytes below the top and grows on
+ * demand down to USER_STACK_BOTTOM. Its pages are allocated on first touch.
  */
 #define USER_STACK_SIZE 0x8000
-#define USER_STACK_BOTTOM (USER_STACK_TOP - USER_STACK_SIZE)
+#define USER_STACK_MAX_SIZE 0x800000
+#define USER_STACK_BOTTOM (USER_STACK_TOP - USER_STACK_MAX_SIZE)
 
 /**
- * Interrupt stack virtual address. Used when userspace is switching to kernel
- * space to store the interrupt stack. Interrupt stack is one page only.
+ * The heap may grow up to a guard page below the user stack. Syscalls and
+ * interrupts run on the kernel stack of the process, so nothing of the
+ * kernel lives in the user half.
  */
-#define INTSTACK_SIZE 0x8000
-#define INTSTACK_VIRTUAL_ADDRESS_TOP (USER_STACK_BOTTOM - PAGE_SIZE) /* guard page below user stack */
-#define INTSTACK_VIRTUAL_ADDRESS_BOTTOM                                        \
-  (INTSTACK_VIRTUAL_ADDRESS_TOP - INTSTACK_SIZE)
-
-/**
- * The stack which we can use for syscall of user programs. The first values
- * (top 16 bytes) is the RSP and then RAX of the user program. Note that
- * the RAX value will get overwritten in the syscall subroutine.
- * View trampoline.S for more info.
- * (This points to top of stack)
- */
-#define SYSCALLSTACK_SIZE 0x8000
-#define SYSCALLSTACK_VIRTUAL_ADDRESS_TOP (INTSTACK_VIRTUAL_ADDRESS_BOTTOM - PAGE_SIZE) /* guard page below INT stack */
-#define SYSCALLSTACK_VIRTUAL_ADDRESS_BOTTOM                                    \
-  (SYSCALLSTACK_VIRTUAL_ADDRESS_TOP - SYSCALLSTACK_SIZE)
+#define USER_HEAP_MAX (USER_STACK_BOTTOM - PAGE_SIZE)
 
 #define KERNEL_STACK_SIZE 0x4000
 #define KERNEL_STACK_GUARD_SIZE PAGE_SIZE
 #define KERNEL_STACK_TOTAL_SIZE (KERNEL_STACK_SIZE + KERNEL_STACK_GUARD_SIZE)
 #define KERNEL_VA_MIN (1ULL << 47)
 #define KERNEL_STACK_BASE 0xFFFF900000000000ULL
+/* Kernel stack slots; there is one stack per process (MAX_PROCESSES) */
+#define KERNEL_STACK_SLOTS 64
+/* Stacks mapped at boot */
+#define KERNEL_STACK_POOL_INITIAL 8
+
+/**
+ * Kernel virtual address window which vmalloc maps scattered frames into
+ */
+#define VMALLOC_START 0xFFFFA00000000000ULL
+#define VMALLOC_SIZE (1ULL << 30)
+
+/**
+ * Number of PCIDs the TLB can tag entries with. PCID 0 is the kernel
+ * pagetable, the others are handed out to user address spaces.
+ */
+#define VMM_PCID_COUNT 4096
 
 
 #ifndef __ASSEMBLER__
 /* Compile-time invariants for stack layout and sizes */
 _Static_assert((USER_STACK_SIZE % PAGE_SIZE) == 0, "USER_STACK_SIZE must be page aligned");
-_Static_assert((INTSTACK_SIZE % PAGE_SIZE) == 0, "INTSTACK_SIZE must be page aligned");
-_Static_assert((SYSCALLSTACK_SIZE % PAGE_SIZE) == 0, "SYSCALLSTACK_SIZE must be page aligned");
+_Static_assert((USER_STACK_MAX_SIZE % PAGE_SIZE) == 0, "USER_STACK_MAX_SIZE must be page aligned");
+_Static_assert(USER_STACK_SIZE <= USER_STACK_MAX_SIZE, "USER_STACK_SIZE must fit in USER_STACK_MAX_SIZE");
 
 _Static_assert(USER_STACK_TOP == USERSPACE_VA_MAX, "USER_STACK_TOP must equal USERSPACE_VA_MAX");
-_Static_assert((USER_STACK_BOTTOM - INTSTACK_VIRTUAL_ADDRESS_TOP) == PAGE_SIZE, "Guard page between USER and INT stacks");
-_Static_assert((INTSTACK_VIRTUAL_ADDRESS_BOTTOM - SYSCALLSTACK_VIRTUAL_ADDRESS_TOP) == PAGE_SIZE, "Guard page between INT and SYSCALL stacks");
-_Static_assert(SYSCALLSTACK_VIRTUAL_ADDRESS_BOTTOM >= USERSPACE_VA_MIN, "Stacks must remain within userspace VA window");
+_Static_assert(USER_HEAP_MAX >= USERSPACE_VA_MIN, "The heap must remain within userspace VA window");
 
 /* PTE bit definitions (Intel x86-64 format) */
 #define PTE_P       (1ULL << 0)   // Present
@@ -81,6 +83,10 @@ _Static_assert(SYSCALLSTACK_VIRTUAL_ADDRESS_BOTTOM >= USERSPACE_VA_MIN, "Stacks
 #define PTE_G       (1ULL << 8)   // Global
 #define PTE_XD      (1ULL << 63)  // Execute disable
 
+/* Bits ignored by the MMU which we use ourselves */
+#define PTE_COW     (1ULL << 9)   // Shared by fork, copy before writing
+#define PTE_NONE    (1ULL << 10)  // User page made inaccessible by mprotect
+
 /* Physical address mask (bits 12-45 for standard 4-level paging) */
 #define PTE_ADDR_MASK  0x000FFFFFFFFFF000ULL
 #define PTE_ADDR_SHIFT 12
@@ -100,6 +106,8 @@ typedef struct {
   uint8_t executable : 1;
   // If 1, this is a userspace page
   uint8_t userspace : 1;
+  // If 1, the page is read-only until a write fault copies it
+  uint8_t copy_on_write : 1;
 } pte_permissions;
 
 /**
@@ -116,6 +124,12 @@ extern pagetable_t kernel_pagetable;
 
 void vmm_init_kernel(const struct limine_kernel_address_response);
 void vmm_init_lapic(uint64_t lapic_addr);
+void vmm_init_pcid(void);
+void vmm_switch_pagetable(pagetable_t pagetable, uint64_t *asid);
+void vmm_switch_to_kernel(void);
+void vmm_migrate_asid(uint64_t *asid);
+void vmm_flush_tlb_all(void);
+void vmm_tlb_sync(void);
 uint64_t vmm_walkaddr(pagetable_t pagetable, uint64_t va, bool user);
 int vmm_map_pages(pagetable_t pagetable, uint64_t va, uint64_t size,
                   uint64_t pa, pte_permissions permissions);
@@ -127,46 +141,48 @@ int vmm_map_kernel_pages(
   pte_permissions perm);
 int vmm_allocate(pagetable_t pagetable, uint64_t va, uint64_t size,
                  pte_permissions permissions, bool clear);
+int vmm_user_allocate_huge(pagetable_t pagetable, uint64_t va, pte_permissions permissions);
 void *vmm_io_memmap(uint64_t pa, uint64_t size);
 pagetable_t vmm_user_pagetable_new();
 void vmm_user_pagetable_free(pagetable_t pagetable);
-uint64_t vmm_user_sbrk_allocate(pagetable_t pagetable, uint64_t old_sbrk,
-                                uint64_t delta);
-uint64_t vmm_user_sbrk_deallocate(pagetable_t pagetable, uint64_t old_sbrk,
-                                  uint64_t delta);
+int vmm_user_unmap(pagetable_t pagetable, uint64_t va, uint64_t size);
+int vmm_user_pagetable_copy(pagetable_t destination, pagetable_t source);
+int vmm_user_make_writable(pagetable_t pagetable, uint64_t va);
+int vmm_user_protect(pagetable_t pagetable, uint64_t va, uint64_t size,
+                     pte_permissions permissions);
 int vmm_memcpy(pagetable_t pagetable, uint64_t destination_virtual_address,
                const void *source, size_t len, bool userspace);
 int vmm_zero(pagetable_t pagetable, uint64_t vaddr, uint64_t len);
 void *vmm_map_physical(uint64_t phys_start, uint64_t phys_end);
 
-uint64_t vmm_allocate_proc_kernel_stack(uint64_t i);
-void vmm_free_proc_kernel_stack(uint64_t i);
+void *vmalloc(size_t size);
+void vfree(void *addr);
 
-/**
- * Validate that a user pointer points to valid, mapped, user-accessible memory.
- * @param pagetable The page table to check against
- * @param ptr User pointer to validate
- * @param len Length of the memory region
- * @param writable If true, also check that memory is writable
- * @return true if valid, false otherwise
- */
-bool vmm_validate_user_ptr(pagetable_t pagetable, const void *ptr, size_t len, bool writable);
+static inline bool is_vmalloc_addr(const void *addr)
+{
+  return (uint64_t)addr >= VMALLOC_START && (uint64_t)addr < VMALLOC_START + VMALLOC_SIZE;
+}
 
-/**
- * Validate and copy a null-terminated string from user space.
- * @param pagetable The page table to check against
- * @param user_str User pointer to string
- * @param kernel_buf Kernel buffer to copy into
- * @param max_len Maximum length to copy (including null terminator)
- * @return Number of bytes copied (excluding null), or -1 on error
- */
-int vmm_copy_user_string(pagetable_t pagetable, const char *user_str, char *kernel_buf, size_t max_len);
+void vmm_init_kernel_stacks(void);
+uint64_t vmm_allocate_proc_kernel_stack(void);
+void vmm_free_proc_kernel_stack(uint64_t stack_top);
+
+#ifdef DZOS_BOOT_BENCHMARKS
+void vmm_bench_pagetables(void);
+void vmm_bench_vmalloc(void);
+void vmm_bench_context_switch(void);
+void vmm_bench_huge_pages(void);
+#endif
 
 static inline void vmm_invalidate_page(uint64_t va)
 {
     __asm__ volatile("invlpg (%0)" ::"r"(va) : "memory");
 }
 
+/**
+ * Flushes the non-global TLB entries of the address space which is
+ * installed. Use vmm_flush_tlb_all for kernel mappings.
+ */
 static inline void vmm_flush_tlb(void)
 {
     uint64_t cr3;
@@ -9,13 +9,13 @@
 #include <zos/exec.h>
 #include <zos/file.h>
 #include "mem/mem.h"
+#include "mem/vma.h"
 #include "mem/vmm.h"
 #include "mem/kmalloc.h"
+#include "mem/uaccess.h"
 #include "userspace/proc.h"
 
 char *validate_user_string(const char *user_str, size_t max_len);
-bool validate_user_read(const void *ptr, size_t len);
-bool validate_user_write(void *ptr, size_t len);
 
 // "\x7FELF" in little endian
 #define ELF_MAGIC 0x464C457FU
@@ -73,6 +73,27 @@ static pte_permissions flags2perm(int flags)
     return perm;
 }
 
+static uint32_t flags2vma(int flags)
+{
+    uint32_t vma_flags = VMA_READ;
+    if (flags & ELF_PROG_FLAG_EXEC)
+        vma_flags |= VMA_EXEC;
+    if (flags & ELF_PROG_FLAG_WRITE)
+        vma_flags |= VMA_WRITE;
+    return vma_flags;
+}
+
+/**
+ * Copies data to the stack of a new process. The stack pages are
+ * allocated here as they are reached.
+ */
+static int stack_push(struct process *proc, uint64_t sp, const void *data, size_t len)
+{
+    if (vma_populate(&proc->vm, proc->pagetable, sp, len, true) < len)
+        return -1;
+    return vmm_memcpy(proc->pagetable, sp, data, len, true);
+}
+
 /**
  * Loads a segment from the ELF file to the memory. The pages of the ELF file
  * must be already allocated.
@@ -129,17 +150,15 @@ uint64_t sys_exec(const char* path, const char* args[])
 		return -1;
 	}
 
-	// Validate args array pointer
-	if (args && !validate_user_read(args, sizeof(char *) * MAX_ARGV)) {
-		kmfree(kernel_path);
-		return -1;
-	}
-
-	// Copy args to kernel space
+	// Copy args to kernel space. The array ends at a NULL or MAX_ARGV.
 	char *kernel_args[MAX_ARGV] = {NULL};
 	if (args) {
-		for (int i = 0; i < MAX_ARGV && args[i]; i++) {
-			kernel_args[i] = validate_user_string(args[i], MAX_PATH_LENGTH);
+		for (int i = 0; i < MAX_ARGV; i++) {
+			const char *arg = NULL;
+			const bool readable = copy_from_user(&arg, &args[i], sizeof(arg)) == 0;
+			if (readable && arg == NULL)
+				break;
+			kernel_args[i] = readable ? validate_user_string(arg, MAX_PATH_LENGTH) : NULL;
 			if (!kernel_args[i]) {
 				// Cleanup already copied args
 				for (int j = 0; j < i; j++) {
@@ -215,7 +234,7 @@ uint64_t proc_exec(const char *path, const char *args[], struct fs_inode *workin
         }
 
         uint64_t mapped_va = ph.vaddr + load_bias;
-        uint64_t map_start = mapped_va & ~(PAGE_SIZE - 1);
+        uint64_t map_start = mapped_va & ~(uint64_t)(PAGE_SIZE - 1);
         uint64_t map_offset = mapped_va - map_start;
         uint64_t alloc_size = PAGE_ROUND_UP(map_offset + ph.memsz);
 
@@ -223,18 +242,19 @@ uint64_t proc_exec(const char *path, const char *args[], struct fs_inode *workin
             goto bad;
         }
 
-        if (vmm_allocate(proc->pagetable, map_start, alloc_size, flags2perm(ph.flags), false) == -1) {
+        if (vma_map(&proc->vm, map_start, map_start + alloc_size, flags2vma(ph.flags)) < 0) {
             goto bad;
         }
 
+        // Only the pages holding file data are allocated now. They come
+        // zeroed, so the part of .bss sharing a page with them is done too.
+        // The rest of .bss is allocated on first touch.
         if (ph.filesz > 0) {
-            if (load_segment(proc->pagetable, proc_inode, map_start + map_offset, ph.off, ph.filesz) < 0) {
+            uint64_t file_size = PAGE_ROUND_UP(map_offset + ph.filesz);
+            if (vmm_allocate(proc->pagetable, map_start, file_size, flags2perm(ph.flags), true) == -1) {
                 goto bad;
             }
-        }
-        
-        if (ph.memsz > ph.filesz) {
-            if (vmm_zero(proc->pagetable, map_start + map_offset + ph.filesz, ph.memsz - ph.filesz) < 0) {
+            if (load_segment(proc->pagetable, proc_inode, map_start + map_offset, ph.off, ph.filesz) < 0) {
                 goto bad;
             }
         }
@@ -242,6 +262,12 @@ uint64_t proc_exec(const char *path, const char *args[], struct fs_inode *workin
         proc->initial_data_segment = MAX_SAFE(proc->initial_data_segment, map_start + alloc_size);
     }
 
+    // Reserve the stack. It grows down on demand from here.
+    if (vma_map(&proc->vm, USER_STACK_TOP - USER_STACK_SIZE, USER_STACK_TOP,
+                VMA_READ | VMA_WRITE | VMA_GROWSDOWN) < 0) {
+        goto bad;
+    }
+
     const char *envp[] = {0};
 
     uint64_t sp = USER_STACK_TOP;
@@ -254,7 +280,7 @@ uint64_t proc_exec(const char *path, const char *args[], struct fs_inode *workin
         for (; argc < MAX_ARGV && args[argc]; argc++) {
             size_t len = strlen(args[argc]);
             sp -= len + 1;
-            vmm_memcpy(proc->pagetable, sp, args[argc], len + 1, true);
+            if (stack_push(proc, sp, args[argc], len + 1) < 0) goto bad;
             argv_ptrs[argc] = sp;
         }
     }
@@ -264,7 +290,7 @@ uint64_t proc_exec(const char *path, const char *args[], struct fs_inode *workin
     for (; envc < MAX_ENVP && envp[envc]; envc++) {
         size_t len = strlen(envp[envc]);
         sp -= len + 1;
-        vmm_memcpy(proc->pagetable, sp, envp[envc], len + 1, true);
+        if (stack_push(proc, sp, envp[envc], len + 1) < 0) goto bad;
         envp_ptrs[envc] = sp;
     }
     // }
@@ -272,26 +298,26 @@ uint64_t proc_exec(const char *path, const char *args[], struct fs_inode *workin
     // Push envp array
     sp -= 8;
     uint64_t zero = 0;
-    vmm_memcpy(proc->pagetable, sp, &zero, 8, true); // envp NULL
+    if (stack_push(proc, sp, &zero, 8) < 0) goto bad; // envp NULL
     for (int i = envc - 1; i >= 0; i--) {
         sp -= 8;
-        vmm_memcpy(proc->pagetable, sp, &envp_ptrs[i], 8, true);
+        if (stack_push(proc, sp, &envp_ptrs[i], 8) < 0) goto bad;
     }
     uint64_t envp_base = sp;
 
     // Push argv array
     sp -= 8;
-    vmm_memcpy(proc->pagetable, sp, &zero, 8, true); // argv NULL
+    if (stack_push(proc, sp, &zero, 8) < 0) goto bad; // argv NULL
     for (int i = argc - 1; i >= 0; i--) {
         sp -= 8;
-        vmm_memcpy(proc->pagetable, sp, &argv_ptrs[i], 8, true);
+        if (stack_push(proc, sp, &argv_ptrs[i], 8) < 0) goto bad;
     }
     uint64_t argv_base = sp;
 
     // Push argc
     sp -= 8;
     uint64_t argc64 = argc;
-    vmm_memcpy(proc->pagetable, sp, &argc64, 8, true);
+    if (stack_push(proc, sp, &argc64, 8) < 0) goto bad;
 
     // Align to 16 bytes (SysV ABI) and adjust for no caller-return
     // For _start entry there is no call return address on the stack.
@@ -300,7 +326,7 @@ uint64_t proc_exec(const char *path, const char *args[], struct fs_inode *workin
     sp &= ~0xFULL;   // align down to 16
     sp -= 8;         // simulate a caller return slot
     uint64_t fake_ret = 0;
-    vmm_memcpy(proc->pagetable, sp, &fake_ret, 8, true);
+    if (stack_push(proc, sp, &fake_ret, 8) < 0) goto bad;
 
     // Fill context for sysretq transition
     uint64_t entry_virtual = load_bias + elf.entry;
@@ -331,7 +357,8 @@ uint64_t proc_exec(const char *path, const char *args[], struct fs_inode *workin
     proc->initial_data_segment = PAGE_ROUND_UP(proc->initial_data_segment);
     proc->current_sbrk = proc->initial_data_segment;
 
-    proc->kernel_stack_top = vmm_allocate_proc_kernel_stack(proc->i);
+    proc->kernel_stack_top = vmm_allocate_proc_kernel_stack();
+    if (proc->kernel_stack_top == 0) goto bad;
     proc->kernel_stack_base = proc->kernel_stack_top - KERNEL_STACK_SIZE;
 
     memset(&proc->ctx, 0, sizeof(proc->ctx));
@@ -368,6 +395,6 @@ uint64_t proc_exec(const char *path, const char *args[], struct fs_inode *workin
 
 bad:
     if (proc_inode) fs_close(proc_inode);
-    if (proc) { vmm_user_pagetable_free(proc->pagetable); proc->state = UNUSED; proc->pid = 0; }
+    if (proc) proc_discard(proc);
     return -1;
 }
@@ -9,7 +9,10 @@
 #include "device/pic.h"
 #include "device/rtc.h"
 #include "fs/fs.h"
+#include "mem/slab.h"
+#include "mem/uaccess.h"
 #include "userspace/exec.h"
+#include "userspace/syscall.h"
 
 /**
  * The kernel stackpointer which we used just before we have switched to
@@ -17,8 +20,6 @@
  */
 static uint64_t kernel_stackpointer;
 
-struct cpu_context kernel_context;
-
 /**
  * Next PID to assign to a program
  */
@@ -30,6 +31,16 @@ static uint64_t next_pid = 1;
 uint64_t process_count = 0;
 uint64_t process_min_index = 0;
 struct process* processes[MAX_PROCESSES];
+/**
+ * Guards processes, process_count and process_min_index. It is taken
+ * before the lock of any process, which is taken before any runqueue lock.
+ */
+struct spinlock process_table_lock;
+
+/**
+ * Slab cache of struct process, created in userspace_init
+ */
+static struct kmem_cache *process_cache;
 
 /**
  * Atomically get the next PID
@@ -38,6 +49,8 @@ static inline uint64_t get_next_pid(void) {
   return __atomic_fetch_add(&next_pid, 1, __ATOMIC_RELAXED);
 }
 
+extern void coelesce_processes(size_t i);
+
 extern void context_switch_to_user(struct cpu_context *to_context, struct cpu_context *from_context);
 
 extern void context_switch_to_kernel(struct cpu_context *to_context, struct cpu_context *user_context, interrupt_frame_t* frame);
@@ -57,7 +70,9 @@ struct process* is_valid_process_init(size_t i)
   static int sz = sizeof(struct process);
   if (processes[i])
     return NULL;
-  struct process* proc = (struct process*)kalloc();
+  struct process* proc = kmem_cache_alloc(process_cache);
+  if (proc == NULL)
+    panic("out of memory");
   memset(proc, 0, sz);
   processes[i] = proc;
   proc->orig_i = proc->i = i;
@@ -73,9 +88,47 @@ struct process* is_valid_process_init(size_t i)
   proc->current_sbrk = 0;
   proc->initial_data_segment = 0;
   memset(&proc->additional_data, 0, sizeof(proc->additional_data));
+  proc->additional_data.fpu_state = fpu_state_alloc();
+  if (proc->additional_data.fpu_state == NULL)
+    panic("out of memory");
   return proc;
 }
 
+/**
+ * Frees a process allocated by proc_allocate. Its pagetable and kernel stack
+ * must already be freed.
+ */
+void proc_free(struct process *proc) {
+  fpu_state_free(proc->additional_data.fpu_state);
+  kmem_cache_free(process_cache, proc);
+}
+
+/**
+ * Removes a process from the process table and frees it. Its pagetable and
+ * kernel stack must already be freed.
+ */
+void proc_release(struct process *proc) {
+  spinlock_lock(&process_table_lock);
+  proc->state = UNUSED;
+  proc->pid = 0;
+  size_t idx = proc->i;
+  proc_free(proc);
+  processes[idx] = NULL;
+  coelesce_processes(idx);
+  spinlock_unlock(&process_table_lock);
+}
+
+/**
+ * Undoes proc_allocate and whatever was set up since for a process which
+ * never ran, e.g. when fork or exec fails halfway
+ */
+void proc_discard(struct process *proc) {
+  if (proc->kernel_stack_top != 0)
+    vmm_free_proc_kernel_stack(proc->kernel_stack_top);
+  vmm_user_pagetable_free(proc->pagetable);
+  proc_release(proc);
+}
+
 /**
  * Finds first value in the given process range (start or min end)
  * 
@@ -95,6 +148,7 @@ struct process* is_valid_process_init(size_t i)
  */
 struct process *proc_allocate(void) {
   struct process *proc = NULL;
+  spinlock_lock(&process_table_lock);
   // Find a free process slot
   INIT_PROCESS_RANGE(0, process_min_index + 1, 1)
 _end_range:
@@ -117,32 +171,10 @@ _return:
     panic("hit process limit - 1");
   }
 _end:
+  spinlock_unlock(&process_table_lock);
   return proc;
 }
 
-/**
- * Wakes up one or all processes which are waiting on a waiting channel
- */
-void proc_wakeup(void *waiting_channel, bool everyone) {
-  struct process *p = my_process();
-  bool done = false;
-  for (size_t i = 0; i < MAX_PROCESSES; i++) {
-    if (!processes[i] || p == processes[i]) // avoid deadlock
-      continue;
-    condvar_lock(&processes[i]->lock);
-    if (processes[i]->state == SLEEPING &&
-        processes[i]->waiting_channel == waiting_channel) {
-      // Enqueue back to runqueue and mark RUNNABLE
-      sched_wakeup(processes[i]);
-      // If we should wake up one thread only, then we are done
-      done = !everyone;
-    }
-    condvar_unlock(&processes[i]->lock);
-    if (done)
-      break;
-  }
-}
-
 /**
  * Allocates a file descriptor of the running process.
  * This function is not thread safe and a process shall not call this
@@ -180,6 +212,8 @@ void proc_exit(int exit_code) {
       proc->open_files[i].type = FD_EMPTY; // I don't think I need this
     }
   }
+  // Mapped files too. The pages go with the pagetable.
+  vma_release(&proc->vm);
 
   if (!spinlock_locked(&proc->lock.lock))
     panic("proc should be locked");
@@ -199,6 +233,84 @@ void sys_exit(int ec)
   proc_exit(ec);
 }
 
+/**
+ * Creates a copy of the running process which continues from the same
+ * syscall. The user pages are shared copy-on-write, so nothing is copied
+ * until one of the processes writes to a page.
+ *
+ * Returns the PID of the child to the parent and zero to the child, or -1
+ * if out of memory.
+ */
+uint64_t proc_fork(void) {
+  struct process *parent = my_process();
+  const struct syscall_frame *frame = parent->syscall_frame;
+  struct process *child = proc_allocate();
+  if (child == NULL)
+    return -1;
+
+  child->kernel_stack_top = vmm_allocate_proc_kernel_stack();
+  if (child->kernel_stack_top == 0) {
+    proc_discard(child);
+    return -1;
+  }
+  child->kernel_stack_base = child->kernel_stack_top - KERNEL_STACK_SIZE;
+
+  const int copied = vmm_user_pagetable_copy(child->pagetable, parent->pagetable);
+  // Our own writable pages just became read-only, even if the copy failed
+  // halfway
+  vmm_flush_tlb();
+  if (copied < 0) {
+    proc_discard(child);
+    return -1;
+  }
+
+  vma_dup(&child->vm, &parent->vm);
+  child->initial_data_segment = parent->initial_data_segment;
+  child->current_sbrk = parent->current_sbrk;
+
+  for (int i = 0; i < MAX_OPEN_FILES; i++) {
+    child->open_files[i] = parent->open_files[i];
+    if (child->open_files[i].type == FD_INODE)
+      fs_dup(child->open_files[i].structures.inode);
+  }
+  fs_dup(parent->working_directory);
+  child->working_directory = parent->working_directory;
+
+  child->additional_data.gs_base = parent->additional_data.gs_base;
+  // Our user FPU state may still be in the registers
+  fpu_state_sync(parent);
+  fpu_state_copy(child->additional_data.fpu_state,
+                 parent->additional_data.fpu_state);
+
+  proc_init_stack_canary(child);
+
+  // The child returns from the syscall with zero
+  memset(&child->ctx, 0, sizeof(child->ctx));
+  child->ctx.rip = frame->rip;
+  child->ctx.rsp = frame->rsp;
+  child->ctx.rflags = frame->rflags;
+  child->ctx.rbx = frame->rbx;
+  child->ctx.rbp = frame->rbp;
+  child->ctx.r12 = frame->r12;
+  child->ctx.r13 = frame->r13;
+  child->ctx.r14 = frame->r14;
+  child->ctx.r15 = frame->r15;
+  child->ctx.rax = 0;
+
+  sched_fork(child);
+  sched_set_priority(child, parent->sched.static_priority);
+  sched_nice(child, parent->sched.nice);
+  child->state = USED;
+  sched_wakeup(child);
+
+  return child->pid;
+}
+
+uint64_t sys_fork(void)
+{
+  return proc_fork();
+}
+
 /**
  * Waits until a process is finished and returns its exit value.
  * Will return -1 if the pid does not exist.
@@ -213,22 +325,31 @@ void sys_exit(int ec)
 int proc_wait(uint64_t target_pid) {
   struct process *target_process = NULL;
 
-  // Look for the process with the given pid
-  for (size_t i = 0; i < MAX_PROCESSES; i++) {
-    if (!processes[i])
-      continue;
-    condvar_lock(&processes[i]->lock);
-    if (processes[i]->pid == target_pid) {
-      target_process = processes[i];
-      break;
+  // Look for the process with the given pid. The PIDs only change with
+  // the process table lock held. The target may be running on another
+  // core, which holds its lock and may need the table lock meanwhile, so
+  // never wait for the lock of the target while holding the table lock.
+  for (;;) {
+    spinlock_lock(&process_table_lock);
+    for (size_t i = 0; i < MAX_PROCESSES; i++) {
+      if (processes[i] && processes[i]->pid == target_pid) {
+        target_process = processes[i];
+        break;
+      }
+    }
+    // Did we find the given process?
+    if (target_process == NULL) {
+      spinlock_unlock(&process_table_lock);
+      return -1;
     }
-    condvar_unlock(&processes[i]->lock);
+    const bool locked = spinlock_trylock(&target_process->lock.lock);
+    spinlock_unlock(&process_table_lock);
+    if (locked)
+      break;
+    target_process = NULL;
+    __asm__ volatile("pause");
   }
 
-  // Did we find the given process?
-  if (target_process == NULL)
-    return -1;
-
   // Wait until the status is exited
   while (target_process->state != EXITED)
     condvar_wait(&target_process->lock);
@@ -246,24 +367,32 @@ int sys_wait(uint64_t target_pid)
 
 /**
  * Allocates are deallocates memory by increasing or decreasing the top of the
- * data segment.
+ * data segment. Growing only reserves the address range; the pages are
+ * allocated on first touch by the page fault handler.
  */
 void *proc_sbrk(int64_t how_much) {
   struct process *p = my_process();
-  void *before = (void *)p->current_sbrk;
-
-  if (how_much > 0) { // allocating memory
-    p->current_sbrk =
-        vmm_user_sbrk_allocate(p->pagetable, p->current_sbrk, how_much);
-  } else if (how_much < 0) { // deallocating memory
-    if (p->initial_data_segment <= p->current_sbrk + how_much) {
-      // Do not deallocate memory which is not allocated with sbrk
-      how_much = p->initial_data_segment - p->current_sbrk;
-    }
-    p->current_sbrk =
-        vmm_user_sbrk_deallocate(p->pagetable, p->current_sbrk, -how_much);
+  const uint64_t before = p->current_sbrk;
+  uint64_t after = before + how_much;
+
+  if (how_much > 0 && (after < before || after > USER_HEAP_MAX))
+    return (void *)-1;
+  if (how_much < 0 && (uint64_t)-how_much > before - p->initial_data_segment) {
+    // Do not deallocate memory which is not allocated with sbrk
+    after = p->initial_data_segment;
   }
-  return before;
+
+  const uint64_t old_end = PAGE_ROUND_UP(before);
+  const uint64_t new_end = PAGE_ROUND_UP(after);
+  if (new_end > old_end &&
+      vma_map(&p->vm, old_end, new_end, VMA_READ | VMA_WRITE) < 0)
+    return (void *)-1;
+  if (new_end < old_end &&
+      vma_unmap(&p->vm, p->pagetable, new_end, old_end) < 0)
+    return (void *)-1;
+
+  p->current_sbrk = after;
+  return (void *)before;
 }
 
 void* sys_sbrk(int64_t how_much)
@@ -271,25 +400,165 @@ void* sys_sbrk(int64_t how_much)
   return proc_sbrk(how_much);
 }
 
+/**
+ * Converts PROT_ flags to the access rights of an area
+ */
+static uint32_t prot2vma(int prot) {
+  uint32_t flags = 0;
+  if (prot & PROT_READ)
+    flags |= VMA_READ;
+  if (prot & PROT_WRITE)
+    flags |= VMA_WRITE;
+  if (prot & PROT_EXEC)
+    flags |= VMA_EXEC;
+  return flags;
+}
+
+/**
+ * Maps anonymous memory or a file in the address space of the running
+ * process. Nothing is allocated or read here; the pages are filled by the
+ * page fault handler on first touch. Mappings are placed top-down below
+ * the heap limit unless the address hint is free or MAP_FIXED is given.
+ *
+ * Shared mappings of files can not be writable because nothing writes the
+ * pages back, and shared anonymous memory is not supported at all.
+ *
+ * Returns the address of the mapping or MAP_FAILED.
+ */
+void *proc_mmap(const struct mmap_args *args) {
+  struct process *p = my_process();
+  const int type = args->flags & (MAP_SHARED | MAP_PRIVATE);
+  if (args->length == 0 || args->length > USER_HEAP_MAX ||
+      (type != MAP_SHARED && type != MAP_PRIVATE) ||
+      (args->flags & ~(MAP_SHARED | MAP_PRIVATE | MAP_FIXED | MAP_ANONYMOUS)) ||
+      (args->prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC)))
+    return MAP_FAILED;
+  const uint64_t size = PAGE_ROUND_UP(args->length);
+  uint32_t flags = prot2vma(args->prot);
+
+  struct fs_inode *file = NULL;
+  uint64_t offset = 0;
+  if (args->flags & MAP_ANONYMOUS) {
+    if (type == MAP_SHARED)
+      return MAP_FAILED;
+  } else {
+    const int fd = args->fd;
+    if (fd < 0 || fd >= MAX_OPEN_FILES || p->open_files[fd].type != FD_INODE ||
+        !p->open_files[fd].readble)
+      return MAP_FAILED;
+    file = p->open_files[fd].structures.inode;
+    if (file->type != INODE_FILE || args->offset < 0 ||
+        args->offset % PAGE_SIZE != 0)
+      return MAP_FAILED;
+    offset = args->offset;
+    if (type == MAP_SHARED) {
+      if (args->prot & PROT_WRITE)
+        return MAP_FAILED;
+      flags |= VMA_SHARED;
+    }
+  }
+
+  uint64_t addr = (uint64_t)args->addr;
+  const bool hint_usable = addr % PAGE_SIZE == 0 && addr >= USERSPACE_VA_MIN &&
+                           addr <= USER_HEAP_MAX - size;
+  if (args->flags & MAP_FIXED) {
+    // Whatever was mapped there goes away
+    if (!hint_usable || vma_unmap(&p->vm, p->pagetable, addr, addr + size) < 0 ||
+        vma_map_file(&p->vm, addr, addr + size, flags, file, offset) < 0)
+      return MAP_FAILED;
+    return (void *)addr;
+  }
+  if (hint_usable &&
+      vma_map_file(&p->vm, addr, addr + size, flags, file, offset) == 0)
+    return (void *)addr;
+  addr = 0;
+  if (file == NULL && size >= HUGE_PAGE_SIZE) {
+    // Large anonymous mappings start on a 2 MiB boundary so they can be
+    // faulted in with huge pages
+    addr = vma_find_free(&p->vm, size + HUGE_PAGE_SIZE - PAGE_SIZE,
+                         USERSPACE_VA_MIN, USER_HEAP_MAX);
+    if (addr != 0)
+      addr = (addr + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+  }
+  if (addr == 0)
+    addr = vma_find_free(&p->vm, size, USERSPACE_VA_MIN, USER_HEAP_MAX);
+  if (addr == 0 ||
+      vma_map_file(&p->vm, addr, addr + size, flags, file, offset) < 0)
+    return MAP_FAILED;
+  return (void *)addr;
+}
+
+void *sys_mmap(struct mmap_args *args)
+{
+  struct mmap_args kernel_args;
+  if (copy_from_user(&kernel_args, args, sizeof(kernel_args)) < 0)
+    return MAP_FAILED;
+  return proc_mmap(&kernel_args);
+}
+
+/**
+ * Removes the mappings in [addr, addr + len) of the running process.
+ * Returns -1 if the range is invalid.
+ */
+int proc_munmap(void *addr, size_t len) {
+  struct process *p = my_process();
+  const uint64_t start = (uint64_t)addr;
+  if (start % PAGE_SIZE != 0 || len == 0 || start < USERSPACE_VA_MIN ||
+      len > USERSPACE_VA_MAX - start)
+    return -1;
+  return vma_unmap(&p->vm, p->pagetable, start, start + PAGE_ROUND_UP(len));
+}
+
+int sys_munmap(void *addr, size_t len)
+{
+  return proc_munmap(addr, len);
+}
+
+/**
+ * Changes the access rights of [addr, addr + len) of the running process.
+ * Returns -1 if part of the range is not mapped.
+ */
+int proc_mprotect(void *addr, size_t len, int prot) {
+  struct process *p = my_process();
+  const uint64_t start = (uint64_t)addr;
+  if (start % PAGE_SIZE != 0 || start < USERSPACE_VA_MIN ||
+      len > USERSPACE_VA_MAX - start ||
+      (prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC)))
+    return -1;
+  return vma_protect(&p->vm, p->pagetable, start, start + PAGE_ROUND_UP(len),
+                     prot2vma(prot));
+}
+
+int sys_mprotect(void *addr, size_t len, int prot)
+{
+  return proc_mprotect(addr, len, prot);
+}
+
+/**
+ * Wakes up the process whose sleep timer fired
+ */
+static void sys_sleep_timer_fired(struct timer *timer) {
+  struct process *proc =
+      (struct process *)((char *)timer - offsetof(struct process, sleep_timer));
+  // The process holds its own lock until it has given its core back
+  condvar_lock(&proc->lock);
+  sched_wakeup(proc);
+  condvar_unlock(&proc->lock);
+}
+
 /**
  * Sleep the current process for at least the number of milliseconds given as
  * the argument.
  */
 void sys_sleep(uint64_t msec) {
   struct process *proc = my_process();
-  const uint64_t target_epoch_wakeup = rtc_now() + msec;
-  /**
-   * For now, we simply use busy waiting. Just wait until we have
-   * reached the desired sleep duration. In each step, we switch back
-   * to the scheduler to allow other processes to run.
-   */
-
-  condvar_lock(&my_process()->lock); // lock before switch back
-  while (target_epoch_wakeup > rtc_now()) {
-    proc->state = RUNNABLE;  // we can run this again
-    scheduler_switch_back(0); // switch back to allow other processes to run
-  }
-  condvar_unlock(&my_process()->lock);
+  condvar_lock(&proc->lock); // lock before switch back
+  // Park the process until the timer interrupt of this core wakes it up.
+  // The timer is its own waiting channel, so nothing else wakes it.
+  sched_sleep(proc, &proc->sleep_timer);
+  timer_add(&proc->sleep_timer, rtc_now() + msec * 1000, sys_sleep_timer_fired);
+  scheduler_switch_back(0);
+  condvar_unlock(&proc->lock);
 }
 
 /**
@@ -297,11 +566,22 @@ void sys_sleep(uint64_t msec) {
  */
 void userspace_init(void) {
   const char *args[] = {"/init", NULL};
+  process_cache = kmem_cache_create("process", sizeof(struct process),
+                                    __alignof__(struct process), NULL);
+  if (process_cache == NULL)
+    panic("userspace_init: out of memory");
+  fpu_state_cache_init();
+#ifdef DZOS_BOOT_BENCHMARKS
+  const uint64_t exec_start = get_tsc();
+#endif
   // Run the program
   if (proc_exec("/init", args, NULL) == (uint64_t)-1)
     panic("cannot create /init process");
   if (proc_exec("/init", args, NULL) == (uint64_t)-1)
     panic("cannot create /init process");
+#ifdef DZOS_BOOT_BENCHMARKS
+  ktprintf("[bench] exec /init: %llu cycles\n", (get_tsc() - exec_start) / 2);
+#endif
   ktprintf("Initialized first userprog\n");
 }
 
@@ -318,11 +598,9 @@ void scheduler_switch_back(interrupt_frame_t* frame) {
     panic("scheduler_switch_back: not locked");
   if (proc->state == RUNNING)
     panic("scheduler_switch_back: RUNNING");
-  context_switch_to_kernel(&kernel_context, &proc->ctx, frame);
+  context_switch_to_kernel(&cpu_local()->kernel_context, &proc->ctx, frame);
 }
 
-uint64_t process_kstack;
-
 void proc_init_stack_canary(struct process *proc)
 {
 	// Use TSC + PID for unique canary
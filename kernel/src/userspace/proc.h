@@ -2,10 +2,15 @@
 #pragma once
 #include "scheduler.h"
 #include "common/condvar.h"
+#include "common/timer.h"
 #include "fs/file.h"
+#include "mem/vma.h"
 #include "mem/vmm.h"
 #include <stddef.h>
 #include <stdint.h>
+#include <zos/mman.h>
+
+struct syscall_frame;
 
 #define STACK_CANARY_MAGIC 0xDEADBEEFCAFEBABEULL
 
@@ -56,6 +61,7 @@ struct cpu_context {
  * Maximum number of processes (TODO: set to 64bit range)
  */
 #define MAX_PROCESSES 64
+_Static_assert(MAX_PROCESSES <= KERNEL_STACK_SLOTS, "every process needs a kernel stack");
 
 /**
  * Process specific metadata which we restore just before switching to this
@@ -64,8 +70,9 @@ struct cpu_context {
 struct process_data {
   // The GS segment base which we store in MSR
   uint64_t gs_base;
-  // FPU state loaded and saved with fxsave/fxrstor
-  __attribute__((aligned(16))) uint8_t fpu_state[512];
+  // FPU state in the format of the XSAVE (or FXSAVE) instruction in use,
+  // sized for the enabled features. See fpu_state_alloc.
+  void *fpu_state;
 };
 
 /**
@@ -106,16 +113,22 @@ struct process {
   // uint64_t resume_stack_pointer;
   // The pagetable of this process
   pagetable_t pagetable;
+  // Tags the TLB entries of the pagetable. See vmm_switch_pagetable.
+  uint64_t asid;
   // Files open for this process. The index is the fd in the process.
   struct process_file open_files[MAX_OPEN_FILES];
   // Top of the initial data segment.
   uint64_t initial_data_segment;
   // The value returned by sbrk(0)
   uint64_t current_sbrk;
+  // The reserved ranges of the user address space
+  struct vm_map vm;
   // Current working directory inode
   struct fs_inode *working_directory;
 
   struct cpu_context ctx;
+  // User registers of the syscall in progress
+  struct syscall_frame *syscall_frame;
   // Store some more specific process data here.
   // We avoid saving/loading these data if the the next process which
   // is going to be scheduled is the same as the old process.
@@ -126,6 +139,8 @@ struct process {
   struct condvar lock;
   // On what object are we waiting on if sleeping?
   void *waiting_channel;
+  // Wakes the process up at the end of sys_sleep
+  struct timer sleep_timer;
   // The exit status of this application
   int exit_status;
   // What is going on in this process?
@@ -138,11 +153,17 @@ struct process {
 
 struct process *my_process(void);
 struct process *proc_allocate(void);
-void proc_wakeup(void *waiting_channel, bool everyone);
+void proc_free(struct process *proc);
+void proc_release(struct process *proc);
+void proc_discard(struct process *proc);
 int proc_allocate_fd(void);
 void proc_exit(int exit_code);
+uint64_t proc_fork(void);
 int proc_wait(uint64_t pid);
 void *proc_sbrk(int64_t how_much);
+void *proc_mmap(const struct mmap_args *args);
+int proc_munmap(void *addr, size_t len);
+int proc_mprotect(void *addr, size_t len, int prot);
 void sys_sleep(uint64_t msec);
 void userspace_init(void);
 
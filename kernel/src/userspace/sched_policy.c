@@ -0,0 +1,303 @@
+#include "sched_policy.h"
+
+#include <stddef.h>
+
+// ============================================================================
+// RUNQUEUE OPERATIONS
+// ============================================================================
+
+static inline sched_entity_t *sched_node_entity(const struct rb_node *node) {
+    return node ? (sched_entity_t *)((char *)node - offsetof(sched_entity_t, run_node)) : NULL;
+}
+
+/**
+ * Inserts se into the vruntime tree of its level. Equal vruntimes go to
+ * the right, so they are picked in the order they were queued.
+ */
+static void sched_tree_insert(struct rb_root *tree, sched_entity_t *se) {
+    struct rb_node **link = &tree->node, *parent = NULL;
+    bool leftmost = true;
+    while (*link) {
+        parent = *link;
+        if (se->vruntime < sched_node_entity(parent)->vruntime) {
+            link = &parent->left;
+        } else {
+            link = &parent->right;
+            leftmost = false;
+        }
+    }
+    rb_insert(tree, &se->run_node, parent, link, leftmost);
+}
+
+void sched_rq_enqueue(runqueue_t *rq, sched_entity_t *se) {
+    uint8_t prio = se->dynamic_priority;
+    
+    if (prio >= SCHED_PRIORITY_LEVELS)
+        prio = SCHED_PRIORITY_LEVELS - 1;
+    
+    se->runqueue_prio = prio;
+    se->in_runqueue = 1;
+    
+    if (prio <= PRIO_RT_MAX) {
+        // Add to tail of priority queue
+        se->next = NULL;
+        se->prev = rq->queue_tails[prio];
+        if (rq->queue_tails[prio]) {
+            rq->queue_tails[prio]->next = se;
+        } else {
+            rq->queue_heads[prio] = se;
+        }
+        rq->queue_tails[prio] = se;
+    } else {
+        sched_tree_insert(&rq->queue_trees[prio], se);
+    }
+    
+    rq->nonempty |= 1ULL << prio;
+    rq->queue_sizes[prio]++;
+    rq->total_runnable++;
+    rq->total_weight += sched_entity_weight(se);
+}
+
+void sched_rq_dequeue(runqueue_t *rq, sched_entity_t *se) {
+    // Always use the recorded bucket to remove from the correct list
+    uint8_t prio = se->runqueue_prio;
+    
+    // The running process is not on the list; unlinking it would drop the
+    // head of its bucket
+    if (prio >= SCHED_PRIORITY_LEVELS || !se->in_runqueue)
+        return;
+    
+    if (prio <= PRIO_RT_MAX) {
+        // Remove from doubly-linked list
+        if (se->prev)
+            se->prev->next = se->next;
+        else
+            rq->queue_heads[prio] = se->next;
+        
+        if (se->next)
+            se->next->prev = se->prev;
+        else
+            rq->queue_tails[prio] = se->prev;
+        
+        se->next = se->prev = NULL;
+    } else {
+        rb_erase(&rq->queue_trees[prio], &se->run_node);
+    }
+    se->in_runqueue = 0;
+    
+    if (--rq->queue_sizes[prio] == 0)
+        rq->nonempty &= ~(1ULL << prio);
+    rq->total_runnable--;
+    rq->total_weight -= sched_entity_weight(se);
+}
+
+sched_entity_t *sched_rq_pick(const runqueue_t *rq) {
+    return sched_rq_pick_except(rq, NULL);
+}
+
+/**
+ * Like sched_rq_pick, but never returns skip
+ */
+sched_entity_t *sched_rq_pick_except(const runqueue_t *rq, const sched_entity_t *skip) {
+    // Go through the non-empty levels from the highest priority
+    for (uint64_t levels = rq->nonempty; levels != 0; levels &= levels - 1) {
+        const int prio = __builtin_ctzll(levels);
+        sched_entity_t *se;
+        if (prio <= PRIO_RT_MAX) {
+            // For RT tasks, simple FIFO
+            se = rq->queue_heads[prio];
+            if (se == skip)
+                se = se->next;
+        } else {
+            // For normal tasks, the smallest vruntime
+            se = sched_node_entity(rb_first(&rq->queue_trees[prio]));
+            if (se == skip)
+                se = sched_node_entity(rb_next(&se->run_node));
+        }
+        if (se != NULL)
+            return se;
+    }
+    
+    return NULL;
+}
+
+// ============================================================================
+// PRIORITY AND TIMESLICE CALCULATION
+// ============================================================================
+
+void sched_check_interactive(sched_entity_t *se) {
+    // Interactive detection based on sleep/run ratio
+    if (se->sleep_time > 0 && se->sum_exec_runtime > 0) {
+        uint64_t ratio = (se->sleep_time * 100) / se->sum_exec_runtime;
+        
+        if (ratio > 150) {  // Sleeps more than 1.5x runtime
+            se->flags |= SCHED_FLAG_INTERACTIVE;
+        } else if (ratio < 50) {  // Sleeps less than 0.5x runtime
+            se->flags |= SCHED_FLAG_CPU_BOUND;
+            se->flags &= ~SCHED_FLAG_INTERACTIVE;
+        }
+    }
+}
+
+void sched_update_priority(sched_entity_t *se) {
+    // Don't adjust RT priorities
+    if (se->flags & SCHED_FLAG_RT)
+        return;
+    
+    uint8_t base = se->static_priority;
+    int adjustment = 0;
+    
+    // Boost interactive processes
+    if (se->flags & SCHED_FLAG_INTERACTIVE) {
+        adjustment = -1;  // Higher priority
+    }
+    
+    // Penalize CPU-bound processes
+    if (se->flags & SCHED_FLAG_CPU_BOUND) {
+        adjustment = 1;   // Lower priority
+    }
+    
+    // Apply nice value
+    adjustment += se->nice / 4;  // -5 to +5 adjustment
+    
+    int new_prio = (int)base + adjustment;
+    if (new_prio < PRIO_NORMAL_MIN)
+        new_prio = PRIO_NORMAL_MIN;
+    if (new_prio > PRIO_IDLE_MAX)
+        new_prio = PRIO_IDLE_MAX;
+    
+    se->dynamic_priority = (uint8_t)new_prio;
+}
+
+uint64_t sched_rq_timeslice(const runqueue_t *rq, const sched_entity_t *se) {
+    if (se->flags & SCHED_FLAG_RT) {
+        return SCHED_MAX_TIMESLICE_US;  // RT gets max timeslice
+    }
+    
+    // Compute based on weight and total system load
+    uint64_t weight = sched_entity_weight(se);
+    uint64_t total_weight = rq->total_weight;
+    
+    if (total_weight == 0)
+        return SCHED_MAX_TIMESLICE_US;
+    
+    // Proportional timeslice
+    uint64_t timeslice = (SCHED_MAX_TIMESLICE_US * weight) / total_weight;
+    
+    // Clamp to min/max
+    if (timeslice < SCHED_MIN_TIMESLICE_US)
+        timeslice = SCHED_MIN_TIMESLICE_US;
+    if (timeslice > SCHED_MAX_TIMESLICE_US)
+        timeslice = SCHED_MAX_TIMESLICE_US;
+    
+    // Interactive boost
+    if (se->flags & SCHED_FLAG_INTERACTIVE)
+        timeslice = (timeslice * 3) / 2;  // 1.5x boost
+    
+    return timeslice;
+}
+
+// ============================================================================
+// VRUNTIME MANAGEMENT (CFS-inspired)
+// ============================================================================
+
+void sched_update_vruntime(runqueue_t *rq, sched_entity_t *se, uint64_t delta) {
+    // Convert physical time to virtual time based on weight
+    uint64_t weight = sched_entity_weight(se);
+    uint64_t vdelta = (delta * 1024) / weight;  // Scaled by weight
+    
+    se->vruntime += vdelta;
+    se->sum_exec_runtime += delta;
+    
+    // Update min vruntime
+    if (se->vruntime < rq->min_vruntime)
+        rq->min_vruntime = se->vruntime;
+}
+
+// ============================================================================
+// ENTITY LIFE CYCLE
+// ============================================================================
+
+/**
+ * Resets se for a new process which will be queued on rq
+ */
+void sched_entity_init(const runqueue_t *rq, sched_entity_t *se) {
+    *se = (sched_entity_t){
+        // Inherit parent priority or set default
+        .static_priority = PRIO_NORMAL_MIN,
+        .dynamic_priority = PRIO_NORMAL_MIN,
+        .nice = 0,
+        // Start with current min vruntime (fair start)
+        .vruntime = rq->min_vruntime,
+    };
+    se->last_timeslice = sched_rq_timeslice(rq, se);
+}
+
+/**
+ * Queues a new or sleeping entity
+ */
+void sched_entity_wakeup(runqueue_t *rq, sched_entity_t *se) {
+    se->next = NULL;
+    se->prev = NULL;
+    
+    // Re-check priority on wakeup
+    sched_update_priority(se);
+    
+    sched_rq_enqueue(rq, se);
+}
+
+/**
+ * Hands the core to se, which was picked and dequeued from rq
+ */
+void sched_entity_start(runqueue_t *rq, sched_entity_t *se, uint64_t now) {
+    se->exec_start = now;
+    se->last_ran = now;
+    se->last_timeslice = sched_rq_timeslice(rq, se);
+}
+
+/**
+ * Charges the running entity for the time since the last tick. Returns
+ * whether its timeslice is used up.
+ */
+bool sched_entity_tick(runqueue_t *rq, sched_entity_t *se, uint64_t now) {
+    // Update runtime
+    if (se->exec_start > 0) {
+        uint64_t delta = now - se->exec_start;
+        sched_update_vruntime(rq, se, delta);
+        se->exec_start = now;
+    }
+    
+    // Check if timeslice expired
+    uint64_t runtime_this_slice = now - se->last_ran;
+    return runtime_this_slice >= se->last_timeslice;
+}
+
+/**
+ * Charges the entity which gave the core back for the rest of its run
+ */
+void sched_entity_stop(runqueue_t *rq, sched_entity_t *se, uint64_t now) {
+    // Update vruntime for the time slice used
+    uint64_t delta = now - se->exec_start;
+    sched_update_vruntime(rq, se, delta);
+    
+    // Check and update priority
+    sched_check_interactive(se);
+    sched_update_priority(se);
+}
+
+/**
+ * Takes an entity which goes to sleep off rq
+ */
+void sched_entity_sleep(runqueue_t *rq, sched_entity_t *se, uint64_t now) {
+    // Track sleep time for interactivity detection
+    if (se->last_ran > 0) {
+        uint64_t sleep_duration = now - se->last_ran;
+        se->sleep_time += sleep_duration;
+        
+        // Update rolling average
+        se->sleep_avg = (se->sleep_avg * 7 + sleep_duration) / 8;
+    }
+    
+    sched_rq_dequeue(rq, se);
+    sched_check_interactive(se);
+}
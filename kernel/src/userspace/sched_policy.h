@@ -0,0 +1,154 @@
+#pragma once
+/**
+ * The scheduling policy: the priority queues of a runqueue, which process
+ * runs next and for how long. Nothing in here touches hardware, takes
+ * locks or looks into struct process, so it builds both into the kernel
+ * and into the host scheduler simulator in tools/schedsim. All times are
+ * in the units of the clock the caller passes in.
+ */
+#include "common/rbtree.h"
+#include "common/spinlock.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+// ============================================================================
+// SCHEDULER CONFIGURATION
+// ============================================================================
+
+#define SCHED_PRIORITY_LEVELS 8      // Number of priority queues
+#define SCHED_MIN_TIMESLICE_US 2000  // 1ms minimum timeslice
+#define SCHED_MAX_TIMESLICE_US 16000 // 10ms maximum timeslice
+#define SCHED_TIMER_FREQ_HZ 1000     // 1ms timer tick
+#define SCHED_INTERACTIVE_THRESHOLD 5000 // 5ms interactive detection
+
+// Priority ranges
+#define PRIO_RT_MIN 0                // Real-time min priority
+#define PRIO_RT_MAX 2                // Real-time max priority
+#define PRIO_NORMAL_MIN 3            // Normal min priority
+#define PRIO_NORMAL_MAX 5            // Normal max priority
+#define PRIO_IDLE_MIN 6              // Idle min priority
+#define PRIO_IDLE_MAX 7              // Idle max priority
+
+// ============================================================================
+// PROCESS SCHEDULING METADATA
+// ============================================================================
+
+typedef struct sched_entity {
+    // Timing information
+    uint64_t vruntime;           // Virtual runtime (for fairness)
+    uint64_t exec_start;         // When process started executing
+    uint64_t sum_exec_runtime;   // Total CPU time used
+    uint64_t last_timeslice;     // Last assigned timeslice
+    
+    // Priority information
+    uint8_t static_priority;     // Base priority (0-7)
+    uint8_t dynamic_priority;    // Current effective priority
+    int8_t nice;                 // Nice value (-20 to +19)
+    
+    // Scheduling policy flags
+    uint32_t flags;
+    #define SCHED_FLAG_RT        (1 << 0)  // Real-time process
+    #define SCHED_FLAG_INTERACTIVE (1 << 1) // Interactive process
+    #define SCHED_FLAG_CPU_BOUND (1 << 2)  // CPU-bound process
+    
+    // Interactivity detection
+    uint64_t sleep_time;         // Time spent sleeping
+    uint64_t last_ran;           // Last time process ran
+    uint32_t sleep_avg;          // Rolling average of sleep time
+    
+    // Queue management
+    struct sched_entity *next;   // Next in real-time priority queue
+    struct sched_entity *prev;   // Previous in real-time priority queue
+    struct rb_node run_node;     // Node in the vruntime tree otherwise
+
+    uint8_t runqueue_prio;       // Priority bucket where it's enqueued
+    uint8_t in_runqueue;         // Non-zero if currently enqueued
+    uint8_t cpu;                 // Core whose runqueue it belongs to
+} sched_entity_t;
+
+// ============================================================================
+// RUNQUEUE STRUCTURE
+// ============================================================================
+
+struct process;
+
+typedef struct runqueue {
+    // Priority queues (one per priority level). Real-time levels are FIFO
+    // lists, the others are trees ordered by vruntime.
+    sched_entity_t *queue_heads[SCHED_PRIORITY_LEVELS];
+    sched_entity_t *queue_tails[SCHED_PRIORITY_LEVELS];
+    struct rb_root queue_trees[SCHED_PRIORITY_LEVELS];
+    uint64_t nonempty;           // Bit per priority level with queued entities
+    
+    // Queue statistics
+    uint32_t queue_sizes[SCHED_PRIORITY_LEVELS];
+    uint32_t total_runnable;
+    
+    // Timing
+    uint64_t clock;              // Runqueue clock
+    uint64_t prev_clock;         // Previous clock value
+    
+    // Current running process
+    struct process *curr;
+    
+    // Load tracking
+    uint64_t total_weight;       // Sum of all process weights
+    uint64_t min_vruntime;       // Minimum vruntime in queue
+    
+    // Core which owns this runqueue
+    uint8_t cpu_id;
+    
+    struct spinlock lock;
+} runqueue_t;
+
+// ============================================================================
+// WEIGHTS
+// ============================================================================
+
+static inline uint64_t sched_entity_weight(const sched_entity_t *se) {
+    // Weight calculation: higher priority = more weight
+    // Uses exponential scaling for fairness
+    static const uint32_t weights[8] = {
+        88761,  // Priority 0 (RT high)
+        71755,  // Priority 1 (RT)
+        56483,  // Priority 2 (RT low)
+        46273,  // Priority 3 (Normal high)
+        36291,  // Priority 4 (Normal)
+        29154,  // Priority 5 (Normal low)
+        23254,  // Priority 6 (Idle high)
+        15000   // Priority 7 (Idle)
+    };
+    return weights[se->dynamic_priority];
+}
+
+static inline bool sched_is_rt(const sched_entity_t *se) {
+    return se->dynamic_priority <= PRIO_RT_MAX;
+}
+
+static inline bool sched_is_interactive(const sched_entity_t *se) {
+    return (se->flags & SCHED_FLAG_INTERACTIVE) != 0;
+}
+
+// ============================================================================
+// POLICY
+// ============================================================================
+
+// Runqueue operations. The caller holds the runqueue lock.
+void sched_rq_enqueue(runqueue_t *rq, sched_entity_t *se);
+void sched_rq_dequeue(runqueue_t *rq, sched_entity_t *se);
+sched_entity_t *sched_rq_pick(const runqueue_t *rq);
+sched_entity_t *sched_rq_pick_except(const runqueue_t *rq, const sched_entity_t *skip);
+uint64_t sched_rq_timeslice(const runqueue_t *rq, const sched_entity_t *se);
+
+// Priority adjustment
+void sched_update_priority(sched_entity_t *se);
+void sched_check_interactive(sched_entity_t *se);
+void sched_update_vruntime(runqueue_t *rq, sched_entity_t *se, uint64_t delta);
+
+// Life cycle of an entity, in the order the scheduler calls them
+void sched_entity_init(const runqueue_t *rq, sched_entity_t *se);
+void sched_entity_wakeup(runqueue_t *rq, sched_entity_t *se);
+void sched_entity_start(runqueue_t *rq, sched_entity_t *se, uint64_t now);
+bool sched_entity_tick(runqueue_t *rq, sched_entity_t *se, uint64_t now);
+void sched_entity_stop(runqueue_t *rq, sched_entity_t *se, uint64_t now);
+void sched_entity_sleep(runqueue_t *rq, sched_entity_t *se, uint64_t now);
@@ -1,9 +1,12 @@
 #include "scheduler.h"
 
 #include "cpu/asm.h"
+#include "cpu/gdt.h"
+#include "device/clockevent.h"
 #include "device/pic.h"
 #include "device/rtc.h"
 #include "mem/kmalloc.h"
+#include "mem/mem.h"
 #include "common/printf.h"
 #include "common/lib.h"
 #include "proc.h"
@@ -12,6 +15,7 @@
 #include "cpu/smp.h"
 #include "cpu/fpu.h"
 #include "common/power.h"
+#include "common/timer.h"
 #include "cpu/gdt.h"
 
 // Helper macro for container_of
@@ -20,9 +24,15 @@
     ((type *)((char *)(ptr) - offsetof(type, member)))
 #endif
 
-// Global runqueue (single CPU for now)
-static runqueue_t g_runqueue;
-static sched_stats_t g_stats;
+// Runqueue and statistics of each core. A process stays on the runqueue
+// of one core unless an idle core steals it, see sched_steal.
+static runqueue_t runqueues[MAX_CORES];
+static sched_stats_t cpu_stats[MAX_CORES];
+
+extern struct spinlock process_table_lock;
+extern uint64_t process_count;
+extern uint64_t process_min_index;
+extern struct process* processes[MAX_PROCESSES];
 
 // Timer frequency in microseconds
 static uint64_t timer_period_us = 1000000 / SCHED_TIMER_FREQ_HZ;
@@ -31,281 +41,164 @@ static uint64_t timer_period_us = 1000000 / SCHED_TIMER_FREQ_HZ;
 // RUNQUEUE OPERATIONS
 // ============================================================================
 
-static void sched_enqueue(runqueue_t *rq, struct process *p) {
-    sched_entity_t *se = &p->sched;
-    uint8_t prio = se->dynamic_priority;
-    
-    if (prio >= SCHED_PRIORITY_LEVELS)
-        prio = SCHED_PRIORITY_LEVELS - 1;
-    
-    // Add to tail of priority queue
-    se->next = NULL;
-    se->prev = rq->queue_tails[prio];
-    se->runqueue_prio = prio;
-    se->in_runqueue = 1;
-    
-    if (rq->queue_tails[prio]) {
-        rq->queue_tails[prio]->next = se;
-    } else {
-        rq->queue_heads[prio] = se;
-    }
-    rq->queue_tails[prio] = se;
-    
-    rq->queue_sizes[prio]++;
-    rq->total_runnable++;
-    rq->total_weight += sched_entity_weight(se);
-}
+static inline runqueue_t *this_rq(void) { return &runqueues[cpu_local()->cpuid]; }
 
-static void sched_dequeue(runqueue_t *rq, struct process *p) {
-    sched_entity_t *se = &p->sched;
-    // Always use the recorded bucket to remove from the correct list
-    uint8_t prio = se->runqueue_prio;
-    
-    if (prio >= SCHED_PRIORITY_LEVELS)
-        return;
-    
-    // Remove from doubly-linked list
-    if (se->prev)
-        se->prev->next = se->next;
-    else
-        rq->queue_heads[prio] = se->next;
-    
-    if (se->next)
-        se->next->prev = se->prev;
-    else
-        rq->queue_tails[prio] = se->prev;
-    
-    se->next = se->prev = NULL;
-    se->in_runqueue = 0;
-    
-    rq->queue_sizes[prio]--;
-    rq->total_runnable--;
-    rq->total_weight -= sched_entity_weight(se);
-}
+static inline sched_stats_t *this_stats(void) { return &cpu_stats[cpu_local()->cpuid]; }
 
-static struct process *sched_pick_next(runqueue_t *rq) {
-    // Find highest priority non-empty queue
-    for (int prio = 0; prio < SCHED_PRIORITY_LEVELS; prio++) {
-        if (rq->queue_heads[prio]) {
-            sched_entity_t *se = rq->queue_heads[prio];
-            
-            // For RT tasks, simple FIFO
-            if (prio <= PRIO_RT_MAX) {
-                return container_of(se, struct process, sched);
-            }
-            
-            // For normal tasks, pick by vruntime
-            sched_entity_t *best = se;
-            uint64_t min_vruntime = se->vruntime;
-            
-            se = se->next;
-            while (se) {
-                if (se->vruntime < min_vruntime) {
-                    min_vruntime = se->vruntime;
-                    best = se;
-                }
-                se = se->next;
-            }
-            
-            return container_of(best, struct process, sched);
-        }
+/**
+ * Locks the runqueue which p belongs to and returns it. p might be stolen
+ * by another core until its runqueue is locked.
+ */
+static runqueue_t *sched_lock_rq_of(struct process *p) {
+    for (;;) {
+        const uint8_t cpu = __atomic_load_n(&p->sched.cpu, __ATOMIC_RELAXED);
+        runqueue_t *rq = &runqueues[cpu];
+        spinlock_lock(&rq->lock);
+        if (p->sched.cpu == cpu)
+            return rq;
+        spinlock_unlock(&rq->lock);
     }
-    
-    return NULL;
 }
 
-// ============================================================================
-// PRIORITY AND TIMESLICE CALCULATION
-// ============================================================================
+static inline void sched_enqueue(runqueue_t *rq, struct process *p) {
+    sched_rq_enqueue(rq, &p->sched);
+}
 
-static void sched_check_interactive(sched_entity_t *se) {
-    // Interactive detection based on sleep/run ratio
-    if (se->sleep_time > 0 && se->sum_exec_runtime > 0) {
-        uint64_t ratio = (se->sleep_time * 100) / se->sum_exec_runtime;
-        
-        if (ratio > 150) {  // Sleeps more than 1.5x runtime
-            se->flags |= SCHED_FLAG_INTERACTIVE;
-        } else if (ratio < 50) {  // Sleeps less than 0.5x runtime
-            se->flags |= SCHED_FLAG_CPU_BOUND;
-            se->flags &= ~SCHED_FLAG_INTERACTIVE;
-        }
-    }
+static inline void sched_dequeue(runqueue_t *rq, struct process *p) {
+    sched_rq_dequeue(rq, &p->sched);
 }
 
-static void sched_update_priority(sched_entity_t *se) {
-    // Don't adjust RT priorities
-    if (se->flags & SCHED_FLAG_RT)
-        return;
-    
-    uint8_t base = se->static_priority;
-    int adjustment = 0;
-    
-    // Boost interactive processes
-    if (se->flags & SCHED_FLAG_INTERACTIVE) {
-        adjustment = -1;  // Higher priority
-    }
-    
-    // Penalize CPU-bound processes
-    if (se->flags & SCHED_FLAG_CPU_BOUND) {
-        adjustment = 1;   // Lower priority
-    }
-    
-    // Apply nice value
-    adjustment += se->nice / 4;  // -5 to +5 adjustment
-    
-    int new_prio = (int)base + adjustment;
-    if (new_prio < PRIO_NORMAL_MIN)
-        new_prio = PRIO_NORMAL_MIN;
-    if (new_prio > PRIO_IDLE_MAX)
-        new_prio = PRIO_IDLE_MAX;
-    
-    se->dynamic_priority = (uint8_t)new_prio;
+static struct process *sched_pick_next(runqueue_t *rq) {
+    sched_entity_t *se = sched_rq_pick(rq);
+    return se ? container_of(se, struct process, sched) : NULL;
 }
 
 uint64_t sched_compute_timeslice(sched_entity_t *se) {
-    if (se->flags & SCHED_FLAG_RT) {
-        return SCHED_MAX_TIMESLICE_US;  // RT gets max timeslice
-    }
-    
-    // Compute based on weight and total system load
-    uint64_t weight = sched_entity_weight(se);
-    uint64_t total_weight = g_runqueue.total_weight;
-    
-    if (total_weight == 0)
-        return SCHED_MAX_TIMESLICE_US;
-    
-    // Proportional timeslice
-    uint64_t timeslice = (SCHED_MAX_TIMESLICE_US * weight) / total_weight;
-    
-    // Clamp to min/max
-    if (timeslice < SCHED_MIN_TIMESLICE_US)
-        timeslice = SCHED_MIN_TIMESLICE_US;
-    if (timeslice > SCHED_MAX_TIMESLICE_US)
-        timeslice = SCHED_MAX_TIMESLICE_US;
-    
-    // Interactive boost
-    if (se->flags & SCHED_FLAG_INTERACTIVE)
-        timeslice = (timeslice * 3) / 2;  // 1.5x boost
-    
-    return timeslice;
+    return sched_rq_timeslice(&runqueues[se->cpu], se);
 }
 
 // ============================================================================
-// VRUNTIME MANAGEMENT (CFS-inspired)
+// SCHEDULER CORE FUNCTIONS
 // ============================================================================
 
-static void sched_update_vruntime(sched_entity_t *se, uint64_t delta_us) {
-    // Convert physical time to virtual time based on weight
-    uint64_t weight = sched_entity_weight(se);
-    uint64_t vdelta = (delta_us * 1024) / weight;  // Scaled by weight
-    
-    se->vruntime += vdelta;
-    se->sum_exec_runtime += delta_us;
-    
-    // Update min vruntime
-    if (se->vruntime < g_runqueue.min_vruntime)
-        g_runqueue.min_vruntime = se->vruntime;
+/**
+ * Picks the core with the fewest processes for a new process. The loads
+ * are read without locks; a wrong guess is fixed by stealing.
+ */
+static uint8_t sched_pick_cpu(void) {
+    uint8_t best = 0;
+    uint32_t best_load = UINT32_MAX;
+    for (uint8_t cpu = 0; cpu < cpu_count(); cpu++) {
+        const runqueue_t *rq = &runqueues[cpu];
+        const uint32_t load = __atomic_load_n(&rq->total_runnable, __ATOMIC_RELAXED) +
+                              (__atomic_load_n(&rq->curr, __ATOMIC_RELAXED) != NULL);
+        if (load < best_load) {
+            best = cpu;
+            best_load = load;
+        }
+    }
+    return best;
 }
 
-// ============================================================================
-// SCHEDULER CORE FUNCTIONS
-// ============================================================================
-
 void sched_fork(struct process *p) {
-    sched_entity_t *se = &p->sched;
-    
-    memset(se, 0, sizeof(sched_entity_t));
-    
-    // Inherit parent priority or set default
-    se->static_priority = PRIO_NORMAL_MIN;
-    se->dynamic_priority = PRIO_NORMAL_MIN;
-    se->nice = 0;
-    
-    // Start with current min vruntime (fair start)
-    se->vruntime = g_runqueue.min_vruntime;
-    
-    se->last_timeslice = sched_compute_timeslice(se);
-
-    // Initialize FPU state image for this process to a valid baseline
-    // so that first fxrstor during context switch does not fault.
-    fpu_save((void *)p->additional_data.fpu_state);
+    const uint8_t cpu = sched_pick_cpu();
+    sched_entity_init(&runqueues[cpu], &p->sched);
+    p->sched.cpu = cpu;
 }
 
 void sched_sleep(struct process *p, void *wchan) {
-    spinlock_lock(&g_runqueue.lock);
+    runqueue_t *rq = sched_lock_rq_of(p);
     
-    sched_entity_t *se = &p->sched;
-    uint64_t now = rtc_now();
-    
-    // Track sleep time for interactivity detection
-    if (se->last_ran > 0) {
-        uint64_t sleep_duration = now - se->last_ran;
-        se->sleep_time += sleep_duration;
-        
-        // Update rolling average
-        se->sleep_avg = (se->sleep_avg * 7 + sleep_duration) / 8;
-    }
-    
-    sched_dequeue(&g_runqueue, p);
+    sched_entity_sleep(rq, &p->sched, rtc_now());
     p->state = SLEEPING;
     p->waiting_channel = wchan;
     
-    sched_check_interactive(se);
-    
-    spinlock_unlock(&g_runqueue.lock);
+    spinlock_unlock(&rq->lock);
+}
+
+/**
+ * Makes sure some core looks at a process which was just queued on cpu.
+ * Idle cores have no timer armed, so they are woken up with an IPI. If
+ * cpu is busy with another process, an idle core is woken up instead so
+ * it can steal the new one.
+ */
+static void sched_kick(uint8_t cpu, bool busy) {
+    // Pairs with the idle flag of scheduler_start: either the idle core
+    // sees the queued process or we see that it is idle
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!busy) {
+        smp_kick(cpu);
+        return;
+    }
+    for (uint8_t other = 0; other < cpu_count(); other++) {
+        if (other != cpu && __atomic_load_n(&cpu_local_of(other)->idle, __ATOMIC_SEQ_CST)) {
+            smp_kick(other);
+            return;
+        }
+    }
+}
+
+/**
+ * Arms the timer of this core for whatever is due first: the end of the
+ * timeslice of se, if a process is about to run, or the nearest kernel
+ * timer. The timer is stopped if nothing is due at all.
+ */
+static void sched_arm_timer(const sched_entity_t *se, uint64_t now) {
+    uint64_t deadline = timer_next_expiry();
+    if (se != NULL && se->last_ran + se->last_timeslice < deadline)
+        deadline = se->last_ran + se->last_timeslice;
+    if (deadline == UINT64_MAX) {
+        clockevent_stop();
+        return;
+    }
+    // The timer may fire a little early, so add a microsecond to not
+    // come back just before the deadline
+    clockevent_arm(deadline > now ? deadline - now + 1 : 1);
 }
 
 void sched_wakeup(struct process *p) {
-    spinlock_lock(&g_runqueue.lock);
+    runqueue_t *rq = sched_lock_rq_of(p);
     
     // Allow initial wake of a freshly created process as well
     // Accept wake for freshly created (USED) or sleeping tasks
     if (p->state != SLEEPING && p->state != USED) {
-        spinlock_unlock(&g_runqueue.lock);
+        spinlock_unlock(&rq->lock);
         return;
     }
     
     p->state = RUNNABLE;
     p->waiting_channel = NULL;
-    p->sched.next = NULL;
-    p->sched.prev = NULL;
-    
-    // Re-check priority on wakeup
-    sched_update_priority(&p->sched);
-    
-    sched_enqueue(&g_runqueue, p);
+    sched_entity_wakeup(rq, &p->sched);
+    const uint8_t cpu = rq - runqueues;
+    const bool busy = rq->curr != NULL;
     
-    spinlock_unlock(&g_runqueue.lock);
+    spinlock_unlock(&rq->lock);
+    sched_kick(cpu, busy);
 }
 
 void scheduler_tick(interrupt_frame_t* frame) {
-    g_stats.total_timer_ticks++;
+    this_stats()->total_timer_ticks++;
     
-    struct process *curr = g_runqueue.curr;
-    if (!curr || curr->state != RUNNING)
+    runqueue_t *rq = this_rq();
+    struct process *curr = rq->curr;
+    const uint64_t now = rtc_now();
+    if (!curr || curr->state != RUNNING) {
+        sched_arm_timer(NULL, now);
         return;
-    
-    sched_entity_t *se = &curr->sched;
-    uint64_t now = rtc_now();
-    
-    // Update runtime
-    if (se->exec_start > 0) {
-        uint64_t delta = now - se->exec_start;
-        sched_update_vruntime(se, delta);
-        se->exec_start = now;
     }
     
-    // Check if timeslice expired
-    uint64_t runtime_this_slice = now - se->last_ran;
-    if (runtime_this_slice >= se->last_timeslice) {
+    if (sched_entity_tick(rq, &curr->sched, now)) {
         // Time to preempt
-        g_stats.total_preemptions++;
+        this_stats()->total_preemptions++;
         scheduler_preempt(frame);
     }
+    // Woken up early, e.g. by a kick or a kernel timer. Wait for the
+    // rest of the slice.
+    sched_arm_timer(&curr->sched, now);
 }
 
 void scheduler_preempt(interrupt_frame_t* frame) {
-    struct process *curr = g_runqueue.curr;
+    struct process *curr = this_rq()->curr;
     if (!curr)
         return;
     
@@ -320,7 +213,7 @@ void scheduler_preempt(interrupt_frame_t* frame) {
 }
 
 void scheduler_yield(interrupt_frame_t* frame) {
-    g_stats.total_yields++;
+    this_stats()->total_yields++;
     
     struct process *curr = my_process();
     if (!curr)
@@ -339,59 +232,35 @@ extern void isr_timer_stub(void);  // Defined in isr_stubs.S
 
 void sched_timer_handler(interrupt_frame_t* frame) {
     // Update runqueue clock
-    g_runqueue.clock = rtc_now();
+    const uint64_t now = rtc_now();
+    this_rq()->clock = now;
+
+    // Kernel mappings which another core unmapped may be in our TLB
+    vmm_tlb_sync();
     
     // Send EOI
     lapic_send_eoi();
+
+    // Wake up sleepers before the tick so they are already queued when
+    // it decides about preemption
+    timer_run(now);
     
     // Call scheduler tick
     scheduler_tick(frame);
 }
 
-extern device_t* g_rtc_dev;
-
 void sched_timer_init(void) {
-    ktprintf("[SCHED] Initializing LAPIC timer for preemption\n");
-    
-    // Use RTC to get TSC frequency for calibration
-    uint64_t tsc_freq;
-    driver_ioctl(g_rtc_dev, 1, (uintptr_t)&tsc_freq);
-    
-    // Calculate timer divisor for desired frequency
-    uint64_t ticks_per_interrupt = tsc_freq / SCHED_TIMER_FREQ_HZ;
-    
-    // Configure LAPIC timer
-    // Disable timer during setup
-    lapic_write(LAPIC_TIMER, LAPIC_MASKED);
-    
-    // Set divide configuration (divide by 1)
-    lapic_write(LAPIC_TDCR, LAPIC_X1_DIV);
-    
-    // Set initial count
-    lapic_write(LAPIC_TICR, (uint32_t)ticks_per_interrupt);
-    
-    // Set timer to periodic mode with vector
-    uint8_t timer_vector = T_IRQ0 + 0;  // IRQ0 for timer
-    lapic_write(LAPIC_TIMER, timer_vector | LAPIC_PERIODIC);
-    
-    // Register interrupt handler
-    idt_set_gate(timer_vector, (uint64_t)isr_timer_stub, 0, 0x8E);
-    
-    ktprintf("[SCHED] Timer initialized: %lu Hz (%lu ticks)\n", 
-             (unsigned long)SCHED_TIMER_FREQ_HZ, 
-             (unsigned long)ticks_per_interrupt);
+    ktprintf("[SCHED] Initializing one-shot timer for preemption\n");
+
+    // The timer is armed for each timeslice by the scheduler loop
+    clockevent_init();
+    idt_set_gate(CLOCKEVENT_VECTOR, (uint64_t)isr_timer_stub, 0, 0x8E);
 }
 
 // ============================================================================
 // MAIN SCHEDULER LOOP
 // ============================================================================
 
-extern struct cpu_context kernel_context;
-
-extern uint64_t process_count;
-extern uint64_t process_min_index;
-extern struct process* processes[MAX_PROCESSES];
-
 extern void context_switch_to_user(struct cpu_context *to_context, struct cpu_context *from_context);
 extern void context_switch_to_kernel(struct cpu_context *to_context, struct cpu_context *user_context, interrupt_frame_t* frame);
 
@@ -405,10 +274,6 @@ void load_additional_data_if_needed(struct process *old, const struct process *n
   // in order for it to be swapped with swapgs and be stored in
   // the main gs base.
   wrmsr(MSR_KERNEL_GS_BASE, new->additional_data.gs_base);
-  // Save the FPU state of the old process and load the new one
-  if (old != NULL) // this might happen at first program
-    fpu_save((void *)old->additional_data.fpu_state);
-  fpu_load((const void *)new->additional_data.fpu_state);
 }
 
 void coelesce_processes(size_t i)
@@ -432,117 +297,174 @@ void coelesce_processes(size_t i)
   --process_count;
 }
 
+/**
+ * Releases what is left of an exited process and its process table slot.
+ * Called without the runqueue lock.
+ */
+static void sched_reclaim(struct process *p) {
+    ktprintf("[SCHED] Process %llu exited\n", p->pid);
+
+    vmm_free_proc_kernel_stack(p->kernel_stack_top);
+    vmm_user_pagetable_free(p->pagetable);
+
+    if (cpu_local()->last_running_process == p)
+        cpu_local()->last_running_process = NULL;
+    fpu_release(p);
+
+    proc_release(p);
+}
+
+/**
+ * Moves a queued process of the busiest other core to rq, which must be
+ * locked by the caller. Returns whether a process was moved.
+ */
+static bool sched_steal(runqueue_t *rq) {
+    runqueue_t *src = NULL;
+    uint32_t src_load = 0;
+    for (uint8_t cpu = 0; cpu < cpu_count(); cpu++) {
+        const uint32_t load = __atomic_load_n(&runqueues[cpu].total_runnable, __ATOMIC_RELAXED);
+        if (&runqueues[cpu] != rq && load > src_load) {
+            src = &runqueues[cpu];
+            src_load = load;
+        }
+    }
+    if (src == NULL)
+        return false;
+
+    // Both locks are taken in core order so two idle cores stealing from
+    // each other do not deadlock
+    spinlock_unlock(&rq->lock);
+    spinlock_lock(src < rq ? &src->lock : &rq->lock);
+    spinlock_lock(src < rq ? &rq->lock : &src->lock);
+
+    // The FPU owner of a core may have registers newer than its save area,
+    // so it stays where it is
+    const struct process *pinned = cpu_local_of(src - runqueues)->fpu_owner;
+    sched_entity_t *se = sched_rq_pick_except(src, pinned ? &pinned->sched : NULL);
+    struct process *p = se ? container_of(se, struct process, sched) : NULL;
+
+    if (p != NULL) {
+        sched_dequeue(src, p);
+        __atomic_store_n(&p->sched.cpu, rq - runqueues, __ATOMIC_RELAXED);
+        // Keep its position relative to the processes of this core
+        if (p->sched.vruntime < rq->min_vruntime)
+            p->sched.vruntime = rq->min_vruntime;
+        // The ASID may be live on this core for another address space
+        vmm_migrate_asid(&p->asid);
+        sched_enqueue(rq, p);
+    }
+    spinlock_unlock(&src->lock);
+    return p != NULL;
+}
+
+/**
+ * Whether every process has exited
+ */
+static bool sched_all_done(void) {
+    bool all_done = true;
+    spinlock_lock(&process_table_lock);
+    for (size_t i = 0; i < process_count; i++) {
+        if (processes[i] && processes[i]->state != UNUSED) {
+            all_done = false;
+            break;
+        }
+    }
+    spinlock_unlock(&process_table_lock);
+    return all_done;
+}
+
 void scheduler_start(void) {
-    ktprintf("[SCHED] Starting preemptive scheduler\n");
+    ktprintf("[SCHED] Starting preemptive scheduler on core %d\n", cpu_local()->cpuid);
     
     // Initialize runqueue
-    g_runqueue.cpu_id = 0;
+    runqueue_t *rq = this_rq();
+    rq->cpu_id = cpu_local()->cpuid;
     
     // Initialize statistics
-    memset(&g_stats, 0, sizeof(g_stats));
+    sched_stats_t *stats = this_stats();
+    memset(stats, 0, sizeof(*stats));
+    stats->start_tsc = get_tsc();
     
     // Initialize timer
     sched_timer_init();
+#ifdef DZOS_BOOT_BENCHMARKS
+    if (cpu_local()->cpuid == 0)
+        timer_bench_accuracy();
+#endif
     
     // Main scheduling loop
     for (;;) {
-        spinlock_lock(&g_runqueue.lock);
+        vmm_tlb_sync();
+        spinlock_lock(&rq->lock);
         
         // Check if we have any runnable processes
-        if (g_runqueue.total_runnable == 0) {
-            // Attempt to rebuild runqueue from process table if any RUNNABLE tasks exist
-            for (size_t i = 0; i < process_count; i++) {
-                if (processes[i] && processes[i]->state == RUNNABLE) {
-                    if (!processes[i]->sched.in_runqueue) {
-                        processes[i]->sched.next = NULL;
-                        processes[i]->sched.prev = NULL;
-                        sched_enqueue(&g_runqueue, processes[i]);
-                    }
-                }
-            }
-            
-            if (g_runqueue.total_runnable > 0) {
-                // We recovered runnable tasks; schedule immediately
-                spinlock_unlock(&g_runqueue.lock);
-                continue;
-            }
-
-            // No runnable tasks; reclaim any EXITED processes
-            bool reclaimed_any = false;
-            for (size_t i = 0; i < process_count; ) {
-                struct process* p = processes[i];
-                if (p && p->state == EXITED) {
-                    // Free resources and mark UNUSED
-                    ktprintf("[SCHED] (idle) reclaiming exited PID %llu\n", p->pid);
-                    vmm_free_proc_kernel_stack(p->orig_i);
-                    vmm_user_pagetable_free(p->pagetable);
-                    p->state = UNUSED;
-                    p->pid = 0;
-                    if (cpu_local()->last_running_process == p)
-                        cpu_local()->last_running_process = NULL;
-                    kfree(p);
-                    processes[i] = NULL;
-                    coelesce_processes(i);
-                    reclaimed_any = true;
-                    // Do not increment i; recheck this index after compaction
-                    continue;
-                }
-                i++;
-            }
-            
-            if (reclaimed_any) {
-                // Check again if we have runnable processes after reclamation
-                spinlock_unlock(&g_runqueue.lock);
+        if (rq->total_runnable == 0) {
+            // Take work from a busier core before going idle. sched_steal
+            // drops the lock in between, so look at the queue again.
+            if (sched_steal(rq)) {
+                spinlock_unlock(&rq->lock);
                 continue;
             }
             
-            spinlock_unlock(&g_runqueue.lock);
+            spinlock_unlock(&rq->lock);
             
-            // No processes to run - idle
-            g_stats.idle_time++;
+            // No processes to run - idle. Leave the pagetable of the last
+            // process first: it may exit on another core, which then waits
+            // for us before freeing it.
+            vmm_switch_to_kernel();
+            stats->idle_time++;
             
             // Check if all processes exited
-            bool all_done = true;
-            for (size_t i = 0; i < process_count; i++) {
-                if (processes[i] && processes[i]->state != UNUSED) {
-                    all_done = false;
-                    break;
-                }
-            }
-            
-            if (all_done) {
+            if (sched_all_done()) {
+                sched_print_stats();
                 system_shutdown();
             }
             
-            // Wait for interrupt
-            sti();
-            __asm__ volatile("hlt");
-            cli();
+            // Use idle time to pre-zero pages. Open a short interrupt
+            // window after each batch so pending IRQs are not delayed.
+            if (mem_zero_pool_refill(SCHED_IDLE_ZERO_BATCH) != 0) {
+                __asm__ volatile("sti; nop; cli");
+                continue;
+            }
+
+            // Only kernel timers are due on an idle core, so without them
+            // its timer stays off until a device interrupt or a kick from
+            // another core. The flag is set before looking at the runqueue
+            // a last time, so a process queued meanwhile is either seen
+            // here or kicks this core.
+            sched_arm_timer(NULL, rtc_now());
+            __atomic_store_n(&cpu_local()->idle, true, __ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&rq->total_runnable, __ATOMIC_SEQ_CST) == 0) {
+                const uint64_t halt_start = get_tsc();
+                // sti only takes effect after hlt, so no interrupt is lost
+                __asm__ volatile("sti; hlt; cli" ::: "memory");
+                stats->idle_cycles += get_tsc() - halt_start;
+            }
+            __atomic_store_n(&cpu_local()->idle, false, __ATOMIC_RELAXED);
             continue;
         }
         
         // Pick next process to run
-        struct process *next = sched_pick_next(&g_runqueue);
+        struct process *next = sched_pick_next(rq);
         
         if (!next) {
-            spinlock_unlock(&g_runqueue.lock);
+            spinlock_unlock(&rq->lock);
             continue;
         }
         
         // Remove from runqueue while running
-        sched_dequeue(&g_runqueue, next);
+        sched_dequeue(rq, next);
         
         // Set as current
-        g_runqueue.curr = next;
+        rq->curr = next;
         next->state = RUNNING;
         
-        spinlock_unlock(&g_runqueue.lock);
+        spinlock_unlock(&rq->lock);
         
-        // Update scheduling entity
-        sched_entity_t *se = &next->sched;
-        se->exec_start = rtc_now();
-        se->last_ran = se->exec_start;
-        se->last_timeslice = sched_compute_timeslice(se);
+        // Update scheduling entity and let the timer end its slice
+        const uint64_t start = rtc_now();
+        sched_entity_start(rq, &next->sched, start);
+        sched_arm_timer(&next->sched, start);
         
         // Load additional process data
         load_additional_data_if_needed(cpu_local()->last_running_process, next);
@@ -552,46 +474,43 @@ void scheduler_start(void) {
         // Update GS base for current CPU
         wrmsr(MSR_KERNEL_GS_BASE, (uint64_t)cpu_local());
         
+        // Syscalls and interrupts of the process run on its kernel stack
+        tss_set_kernel_stack(next->kernel_stack_top);
+
         // Prepare kernel context
-        kernel_context.rsp = next->kernel_stack_top;
-        kernel_context.kernel_rip = (uint64_t)&&resume_scheduler;
+        struct cpu_context *kernel_context = &cpu_local()->kernel_context;
+        kernel_context->kernel_rip = (uint64_t)&&resume_scheduler;
 
         // Context switch to user
-        g_stats.total_switches++;
+        stats->total_switches++;
 
         condvar_lock(&next->lock);
     
-        // Switch to process address space
-        install_pagetable(V2P(next->pagetable));
-        vmm_flush_tlb();
-        context_switch_to_user(&next->ctx, &kernel_context);
+        // Switch to process address space. The kernel half is mapped in
+        // every pagetable, so we simply stay on it when the process gives
+        // the core back, until the core goes idle.
+        vmm_switch_pagetable(next->pagetable, &next->asid);
+        // Last, as the lazy mode makes the FPU unusable until userspace
+        fpu_return_to_user(next);
+        context_switch_to_user(&next->ctx, kernel_context);
         
 resume_scheduler:
-        install_pagetable(V2P(kernel_pagetable));
-        vmm_flush_tlb();
-
+        // We're back from the process. Lock the runqueue before letting go
+        // of the process so that a wakeup from another core cannot queue
+        // it before its state is handled below.
+        spinlock_lock(&rq->lock);
         condvar_unlock(&next->lock);
-
-        // We're back from the process
-        
-        spinlock_lock(&g_runqueue.lock);
         
-        // Update vruntime for the time slice used
-        uint64_t now = rtc_now();
-        uint64_t delta = now - se->exec_start;
-        sched_update_vruntime(se, delta);
-        
-        // Check and update priority
-        sched_check_interactive(se);
-        sched_update_priority(se);
+        sched_entity_stop(rq, &next->sched, rtc_now());
         
         // Handle process state - CRITICAL: Check state BEFORE any operations
         enum process_state current_state = next->state;
+        bool exited = false;
         
         switch (current_state) {
         case RUNNABLE:
             // Re-enqueue for next time
-            sched_enqueue(&g_runqueue, next);
+            sched_enqueue(rq, next);
             break;
             
         case SLEEPING:
@@ -599,24 +518,8 @@ resume_scheduler:
             break;
             
         case EXITED:
-            // Clean up immediately - don't defer to idle
-            ktprintf("[SCHED] Process %llu exited\n", next->pid);
-            
-            vmm_free_proc_kernel_stack(next->orig_i);
-            vmm_user_pagetable_free(next->pagetable);
-            
-            next->state = UNUSED;
-            next->pid = 0;
-            
-            if (cpu_local()->last_running_process == next)
-                cpu_local()->last_running_process = NULL;
-            
-            kfree(next);
-            
-            // Update process table
-            size_t idx = next->i;
-            processes[idx] = NULL;
-            coelesce_processes(idx);
+            // Clean up once the runqueue is unlocked - don't defer to idle
+            exited = true;
             break;
             
         default:
@@ -625,15 +528,18 @@ resume_scheduler:
                      next->pid, current_state);
             if (current_state != RUNNING) {
                 next->state = RUNNABLE;
-                sched_enqueue(&g_runqueue, next);
+                sched_enqueue(rq, next);
             }
             break;
         }
         
-        g_runqueue.curr = NULL;
+        rq->curr = NULL;
         cpu_local()->running_process = NULL;
         
-        spinlock_unlock(&g_runqueue.lock);
+        spinlock_unlock(&rq->lock);
+
+        if (exited)
+            sched_reclaim(next);
     }
 }
 
@@ -645,7 +551,7 @@ void sched_set_priority(struct process *p, uint8_t prio) {
     if (prio >= SCHED_PRIORITY_LEVELS)
         return;
     
-    spinlock_lock(&g_runqueue.lock);
+    runqueue_t *rq = sched_lock_rq_of(p);
     
     sched_entity_t *se = &p->sched;
     
@@ -661,28 +567,28 @@ void sched_set_priority(struct process *p, uint8_t prio) {
     
     // Re-enqueue if runnable and currently enqueued to update position
     if (p->state == RUNNABLE && p->sched.in_runqueue) {
-        sched_dequeue(&g_runqueue, p);
-        sched_enqueue(&g_runqueue, p);
+        sched_dequeue(rq, p);
+        sched_enqueue(rq, p);
     }
     
-    spinlock_unlock(&g_runqueue.lock);
+    spinlock_unlock(&rq->lock);
 }
 
 void sched_nice(struct process *p, int8_t nice) {
     if (nice < -20) nice = -20;
     if (nice > 19) nice = 19;
     
-    spinlock_lock(&g_runqueue.lock);
+    runqueue_t *rq = sched_lock_rq_of(p);
     
     p->sched.nice = nice;
     sched_update_priority(&p->sched);
     // If runnable and enqueued, requeue to reflect new priority
     if (p->state == RUNNABLE && p->sched.in_runqueue) {
-        sched_dequeue(&g_runqueue, p);
-        sched_enqueue(&g_runqueue, p);
+        sched_dequeue(rq, p);
+        sched_enqueue(rq, p);
     }
     
-    spinlock_unlock(&g_runqueue.lock);
+    spinlock_unlock(&rq->lock);
 }
 
 // ============================================================================
@@ -690,17 +596,35 @@ void sched_nice(struct process *p, int8_t nice) {
 // ============================================================================
 
 sched_stats_t sched_get_stats(void) {
-    return g_stats;
+    // Summed over all cores without locks; the counters are only statistics
+    sched_stats_t total = {0};
+    for (uint8_t cpu = 0; cpu < cpu_count(); cpu++) {
+        total.total_switches += cpu_stats[cpu].total_switches;
+        total.total_preemptions += cpu_stats[cpu].total_preemptions;
+        total.total_yields += cpu_stats[cpu].total_yields;
+        total.total_timer_ticks += cpu_stats[cpu].total_timer_ticks;
+        total.idle_time += cpu_stats[cpu].idle_time;
+        total.idle_cycles += cpu_stats[cpu].idle_cycles;
+    }
+    return total;
 }
 
 void sched_print_stats(void) {
+    const sched_stats_t stats = sched_get_stats();
     ktprintf("\n=== Scheduler Statistics ===\n");
-    ktprintf("Total switches:     %llu\n", g_stats.total_switches);
-    ktprintf("Total preemptions:  %llu\n", g_stats.total_preemptions);
-    ktprintf("Total yields:       %llu\n", g_stats.total_yields);
-    ktprintf("Total timer ticks:  %llu\n", g_stats.total_timer_ticks);
-    ktprintf("Idle time:          %llu\n", g_stats.idle_time);
-    ktprintf("Runnable processes: %u\n", g_runqueue.total_runnable);
-    ktprintf("Min vruntime:       %llu\n", g_runqueue.min_vruntime);
+    ktprintf("Total switches:     %llu\n", stats.total_switches);
+    ktprintf("Total preemptions:  %llu\n", stats.total_preemptions);
+    ktprintf("Total yields:       %llu\n", stats.total_yields);
+    ktprintf("Total timer ticks:  %llu\n", stats.total_timer_ticks);
+    ktprintf("Idle time:          %llu\n", stats.idle_time);
+    fpu_print_stats();
+    const uint64_t now = get_tsc();
+    for (uint8_t cpu = 0; cpu < cpu_count(); cpu++) {
+        const sched_stats_t *core = &cpu_stats[cpu];
+        const uint64_t elapsed = now - core->start_tsc;
+        ktprintf("Core %d: %u runnable, min vruntime %llu, %llu timer interrupts, %llu%% idle\n", cpu,
+                 runqueues[cpu].total_runnable, runqueues[cpu].min_vruntime,
+                 core->total_timer_ticks, elapsed ? core->idle_cycles * 100 / elapsed : 0);
+    }
     ktprintf("============================\n\n");
 }
@@ -34,9 +34,10 @@ void init_syscall_table(void)
 }
 
 uint64_t syscall_c(uint64_t a1, uint64_t a2, uint64_t a3,
-                    uint64_t syscall_number)
+                    uint64_t syscall_number, struct syscall_frame *frame)
 {
     uint64_t ret = 0;
+    my_process()->syscall_frame = frame;
     switch (syscall_number)
     {
     // Expand macros into assignments + break to ensure single exit below
@@ -11,8 +11,25 @@ typedef long long ssize_t;
 
 void init_syscall_table(void);
 
+/**
+ * User registers saved by syscall_handler_asm, in the order they are on the
+ * stack. Only the registers preserved across a syscall are here.
+ */
+struct syscall_frame {
+    uint64_t rsp;
+    uint64_t number;
+    uint64_t rip;
+    uint64_t rflags;
+    uint64_t rbx;
+    uint64_t rbp;
+    uint64_t r12;
+    uint64_t r13;
+    uint64_t r14;
+    uint64_t r15;
+};
+
 uint64_t syscall_c(uint64_t a1, uint64_t a2, uint64_t a3,
-                    uint64_t syscall_number);
+                    uint64_t syscall_number, struct syscall_frame *frame);
 
 int write(int fd, const void* buf, size_t len);
 int test(int i, int o);
\ No newline at end of file
@@ -1,6 +1,7 @@
 #pragma once
 #include <stddef.h>
 #include <stdint.h>
+#include <zos/mman.h>
 
 #define GEN_SYS_0U(RET, NAME, U) RET NAME()
 #define GEN_SYS_1U(RET, NAME, U, ARG1) RET NAME(ARG1)
@@ -1,6 +1,7 @@
 #include "stdlib.h"
 #include "usyscalls.h"
 #include <stdint.h>
+#include "zos/memops.h"
 
 // Entry point: extract argc/argv from stack per SysV AMD64 ABI
 void _start(void) {
@@ -9,6 +10,7 @@ void _start(void) {
   __asm__ volatile("mov %%rsp, %0" : "=r"(sp));
   int argc = (int)sp[0];
   char **argv = (char**)&sp[1];
+  memops_init();
   exit(main(argc, argv));
 }
 
@@ -9,56 +9,8 @@
 #include "stdlib.h"
 #include <stdint.h>
 
-void *memcpy(void *dest, const void *src, size_t n) {
-  uint8_t *pdest = (uint8_t *)dest;
-  const uint8_t *psrc = (const uint8_t *)src;
-
-  for (size_t i = 0; i < n; i++) {
-    pdest[i] = psrc[i];
-  }
-
-  return dest;
-}
-
-void *memset(void *s, int c, size_t n) {
-  uint8_t *p = (uint8_t *)s;
-
-  for (size_t i = 0; i < n; i++) {
-    p[i] = (uint8_t)c;
-  }
-
-  return s;
-}
-
-void *memmove(void *dest, const void *src, size_t n) {
-  uint8_t *pdest = (uint8_t *)dest;
-  const uint8_t *psrc = (const uint8_t *)src;
-
-  if (src > dest) {
-    for (size_t i = 0; i < n; i++) {
-      pdest[i] = psrc[i];
-    }
-  } else if (src < dest) {
-    for (size_t i = n; i > 0; i--) {
-      pdest[i - 1] = psrc[i - 1];
-    }
-  }
-
-  return dest;
-}
-
-int memcmp(const void *s1, const void *s2, size_t n) {
-  const uint8_t *p1 = (const uint8_t *)s1;
-  const uint8_t *p2 = (const uint8_t *)s2;
-
-  for (size_t i = 0; i < n; i++) {
-    if (p1[i] != p2[i]) {
-      return p1[i] < p2[i] ? -1 : 1;
-    }
-  }
-
-  return 0;
-}
+// memcpy, memset, memmove, memcmp and strlen are shared with the kernel, see
+// kernel/src/common/memops.S
 
 char *strcpy(char *s, const char *t) {
   char *os = s;
@@ -119,14 +71,6 @@ int strncasecmp(const char *s1, const char *s2, size_t n) {
   return (0);
 }
 
-size_t strlen(const char *s) {
-  size_t n;
-
-  for (n = 0; s[n]; n++)
-    ;
-  return n;
-}
-
 char *strchr(const char *s, char c) {
   for (; *s; s++)
     if (*s == c)
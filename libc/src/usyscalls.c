@@ -1,4 +1,5 @@
 #include <zos/sysnum.h>
+#include <zos/mman.h>
 #include <stddef.h>
 #include <stdint.h>
 #include "userspace/proc.h"
@@ -0,0 +1,472 @@
+// schedsim.c - Replays workloads against the kernel scheduling policy
+//
+// The policy of kernel/src/userspace/sched_policy.c is compiled in as is
+// and driven like scheduler.c drives it on one core: wakeups queue a task,
+// the timer tick charges the running task and preempts it once its
+// timeslice is used up, and a task which blocks gives the core back. The
+// clock is virtual and counts microseconds, so seconds of simulated time
+// take milliseconds to run.
+#define _POSIX_C_SOURCE 200809L
+#include "userspace/sched_policy.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define TICK_US (1000000 / SCHED_TIMER_FREQ_HZ)
+#define MAX_CLASSES 16
+#define MAX_PATTERN 32
+#define NEVER UINT64_MAX
+
+#define container_of(ptr, type, member) ((type *)((char *)(ptr) - offsetof(type, member)))
+
+/**
+ * A growable array of samples
+ */
+struct samples {
+    uint64_t *values;
+    size_t count;
+    size_t capacity;
+};
+
+/**
+ * Tasks with the same behaviour, which are reported together
+ */
+struct task_class {
+    char name[32];
+    uint32_t tasks;
+    uint64_t cpu_time;
+    struct samples latency;
+};
+
+enum task_state { TASK_NEW, TASK_RUNNABLE, TASK_RUNNING, TASK_SLEEPING };
+
+/**
+ * How a task behaves. A task either follows a fixed pattern of runs and
+ * sleeps, or draws each run and sleep from a range. A run of zero never
+ * ends.
+ */
+struct behaviour {
+    uint32_t pattern_len;
+    uint64_t pattern[MAX_PATTERN][2]; // run, sleep
+    uint64_t run_min, run_max;
+    uint64_t sleep_min, sleep_max;
+};
+
+struct task {
+    sched_entity_t se;
+    struct task_class *class;
+    struct behaviour behaviour;
+    enum task_state state;
+    uint32_t phase;
+    uint64_t arrival;
+    uint64_t burst_left;  // NEVER for CPU-bound runs
+    uint64_t sleep_len;   // Sleep after the current burst
+    uint64_t wake_at;
+    uint64_t queued_at;
+    uint64_t cpu_time;
+};
+
+static struct task *tasks;
+static uint32_t task_count;
+static struct task_class classes[MAX_CLASSES];
+static uint32_t class_count;
+
+static struct {
+    uint64_t switches;
+    uint64_t preemptions;
+    uint64_t blocks;
+    uint64_t idle_time;
+    uint64_t picks;
+    uint64_t queued_at_pick;
+    struct samples pick_ns;
+} stats;
+
+static uint32_t rng_state = 2463534242U;
+
+static uint32_t rand_next(void) {
+    uint32_t x = rng_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    rng_state = x;
+    return x;
+}
+
+static uint64_t rand_between(uint64_t min, uint64_t max) {
+    return max <= min ? min : min + rand_next() % (max - min + 1);
+}
+
+static void samples_add(struct samples *s, uint64_t value) {
+    if (s->count == s->capacity) {
+        s->capacity = s->capacity ? s->capacity * 2 : 1024;
+        s->values = realloc(s->values, s->capacity * sizeof(*s->values));
+        if (s->values == NULL) {
+            perror("schedsim");
+            exit(1);
+        }
+    }
+    s->values[s->count++] = value;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    const uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Returns the p-th percentile of s, which must be sorted
+ */
+static uint64_t percentile(const struct samples *s, double p) {
+    if (s->count == 0)
+        return 0;
+    size_t i = (size_t)(p / 100.0 * (double)(s->count - 1) + 0.5);
+    return s->values[i];
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static struct task_class *class_get(const char *name) {
+    for (uint32_t i = 0; i < class_count; i++)
+        if (strcmp(classes[i].name, name) == 0)
+            return &classes[i];
+    if (class_count == MAX_CLASSES) {
+        fprintf(stderr, "schedsim: more than %d task classes\n", MAX_CLASSES);
+        exit(1);
+    }
+    struct task_class *class = &classes[class_count++];
+    snprintf(class->name, sizeof(class->name), "%s", name);
+    return class;
+}
+
+static struct task *task_add(const char *class, int8_t nice, uint64_t arrival,
+                             const struct behaviour *behaviour) {
+    tasks = realloc(tasks, (task_count + 1) * sizeof(*tasks));
+    if (tasks == NULL) {
+        perror("schedsim");
+        exit(1);
+    }
+    struct task *t = &tasks[task_count++];
+    *t = (struct task){
+        .class = class_get(class),
+        .behaviour = *behaviour,
+        .state = TASK_NEW,
+        .arrival = arrival,
+    };
+    t->se.nice = nice;
+    t->class->tasks++;
+    return t;
+}
+
+// ============================================================================
+// WORKLOADS
+// ============================================================================
+
+static const struct behaviour cpu_bound = {.run_min = 0, .run_max = 0};
+static const struct behaviour interactive = {
+    .run_min = 100, .run_max = 500, .sleep_min = 5000, .sleep_max = 20000};
+static const struct behaviour bursty = {
+    .run_min = 1000, .run_max = 30000, .sleep_min = 1000, .sleep_max = 100000};
+
+/**
+ * Creates n tasks of a synthetic workload, arriving within the first 10ms
+ */
+static bool workload_synthetic(const char *name, uint32_t n) {
+    for (uint32_t i = 0; i < n; i++) {
+        const uint64_t arrival = rand_between(0, 10000);
+        if (strcmp(name, "cpu") == 0) {
+            task_add("cpu", 0, arrival, &cpu_bound);
+        } else if (strcmp(name, "interactive") == 0) {
+            task_add("interactive", 0, arrival, &interactive);
+        } else if (strcmp(name, "bursty") == 0) {
+            task_add("bursty", 0, arrival, &bursty);
+        } else if (strcmp(name, "mixed") == 0) {
+            // A quarter CPU-bound, half interactive, a quarter bursty
+            switch (i % 4) {
+            case 0: task_add("cpu", 0, arrival, &cpu_bound); break;
+            case 1: task_add("bursty", 0, arrival, &bursty); break;
+            default: task_add("interactive", 0, arrival, &interactive); break;
+            }
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Reads a recorded workload. Each line is one task:
+ *
+ *   <class> <nice> <arrival_us> <run_us> <sleep_us> [<run_us> <sleep_us>...]
+ *
+ * The runs and sleeps repeat until the end of the simulation. A run of
+ * zero never ends. Empty lines and lines starting with # are skipped.
+ */
+static bool workload_trace(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        fprintf(stderr, "schedsim: %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    char line[1024];
+    uint32_t line_no = 0;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        line_no++;
+        char *save = NULL;
+        const char *class = strtok_r(line, " \t\r\n", &save);
+        if (class == NULL || class[0] == '#')
+            continue;
+        const char *nice = strtok_r(NULL, " \t\r\n", &save);
+        const char *arrival = strtok_r(NULL, " \t\r\n", &save);
+        struct behaviour behaviour = {0};
+        // Count the numbers first and halve it afterwards
+        for (const char *tok; (tok = strtok_r(NULL, " \t\r\n", &save)) != NULL;) {
+            if (behaviour.pattern_len == 2 * MAX_PATTERN)
+                break;
+            const uint32_t i = behaviour.pattern_len++;
+            behaviour.pattern[i / 2][i % 2] = strtoull(tok, NULL, 10);
+        }
+        if (nice == NULL || arrival == NULL || behaviour.pattern_len < 2 ||
+            behaviour.pattern_len % 2 != 0) {
+            fprintf(stderr, "schedsim: %s:%u: expected <class> <nice> <arrival> <run> <sleep>...\n",
+                    path, line_no);
+            fclose(f);
+            return false;
+        }
+        behaviour.pattern_len /= 2;
+        task_add(class, (int8_t)atoi(nice), strtoull(arrival, NULL, 10), &behaviour);
+    }
+    fclose(f);
+    return true;
+}
+
+// ============================================================================
+// SIMULATION
+// ============================================================================
+
+/**
+ * Draws the next run and sleep of t
+ */
+static void task_next_burst(struct task *t) {
+    const struct behaviour *b = &t->behaviour;
+    uint64_t run, sleep;
+    if (b->pattern_len != 0) {
+        run = b->pattern[t->phase][0];
+        sleep = b->pattern[t->phase][1];
+        t->phase = (t->phase + 1) % b->pattern_len;
+    } else {
+        run = rand_between(b->run_min, b->run_max);
+        sleep = rand_between(b->sleep_min, b->sleep_max);
+    }
+    t->burst_left = run == 0 ? NEVER : run;
+    t->sleep_len = sleep;
+}
+
+static void task_wakeup(runqueue_t *rq, struct task *t, uint64_t now) {
+    if (t->state == TASK_NEW) {
+        // sched_fork
+        const int8_t nice = t->se.nice;
+        sched_entity_init(rq, &t->se);
+        t->se.nice = nice;
+    }
+    t->state = TASK_RUNNABLE;
+    t->queued_at = now;
+    task_next_burst(t);
+    sched_entity_wakeup(rq, &t->se);
+}
+
+/**
+ * Queues every task which arrives or wakes up at or before now. Returns
+ * when the next one is due.
+ */
+static uint64_t wake_due(runqueue_t *rq, uint64_t now) {
+    uint64_t next = NEVER;
+    for (uint32_t i = 0; i < task_count; i++) {
+        struct task *t = &tasks[i];
+        uint64_t due;
+        if (t->state == TASK_NEW)
+            due = t->arrival;
+        else if (t->state == TASK_SLEEPING)
+            due = t->wake_at;
+        else
+            continue;
+        if (due <= now)
+            task_wakeup(rq, t, due);
+        else if (due < next)
+            next = due;
+    }
+    return next;
+}
+
+static struct task *pick_next(runqueue_t *rq, uint64_t now) {
+    stats.queued_at_pick += rq->total_runnable;
+    const uint64_t start = now_ns();
+    sched_entity_t *se = sched_rq_pick(rq);
+    samples_add(&stats.pick_ns, now_ns() - start);
+    stats.picks++;
+    if (se == NULL)
+        return NULL;
+
+    struct task *t = container_of(se, struct task, se);
+    sched_rq_dequeue(rq, se);
+    sched_entity_start(rq, se, now);
+    samples_add(&t->class->latency, now - t->queued_at);
+    t->state = TASK_RUNNING;
+    stats.switches++;
+    return t;
+}
+
+static void simulate(uint64_t duration) {
+    runqueue_t rq = {0};
+    struct task *curr = NULL;
+    uint64_t now = 0;
+    uint64_t next_tick = TICK_US;
+
+    while (now < duration) {
+        const uint64_t next_wake = wake_due(&rq, now);
+        if (curr == NULL)
+            curr = pick_next(&rq, now);
+
+        // Run until the next thing happens
+        uint64_t until = next_wake < next_tick ? next_wake : next_tick;
+        if (curr != NULL && curr->burst_left != NEVER && now + curr->burst_left < until)
+            until = now + curr->burst_left;
+        if (until > duration)
+            until = duration;
+        if (curr != NULL) {
+            curr->cpu_time += until - now;
+            if (curr->burst_left != NEVER)
+                curr->burst_left -= until - now;
+        } else {
+            stats.idle_time += until - now;
+        }
+        now = until;
+
+        if (curr != NULL && curr->burst_left == 0) {
+            // The task blocks: sched_sleep, then the scheduler takes the
+            // core back
+            sched_entity_sleep(&rq, &curr->se, now);
+            sched_entity_stop(&rq, &curr->se, now);
+            curr->state = TASK_SLEEPING;
+            curr->wake_at = now + curr->sleep_len;
+            stats.blocks++;
+            curr = NULL;
+        }
+        if (now == next_tick) {
+            next_tick += TICK_US;
+            if (curr != NULL && sched_entity_tick(&rq, &curr->se, now)) {
+                sched_entity_stop(&rq, &curr->se, now);
+                curr->state = TASK_RUNNABLE;
+                curr->queued_at = now;
+                sched_rq_enqueue(&rq, &curr->se);
+                stats.preemptions++;
+                curr = NULL;
+            }
+        }
+    }
+    // Charge the last run like a preemption would
+    if (curr != NULL)
+        sched_entity_stop(&rq, &curr->se, now);
+}
+
+// ============================================================================
+// REPORT
+// ============================================================================
+
+/**
+ * Jain's fairness index of the CPU time of the tasks of class: 1 when all
+ * got the same, 1/n when one task got everything
+ */
+static double class_fairness(const struct task_class *class) {
+    double sum = 0, sum_sq = 0;
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < task_count; i++) {
+        if (tasks[i].class != class)
+            continue;
+        const double x = (double)tasks[i].cpu_time;
+        sum += x;
+        sum_sq += x * x;
+        n++;
+    }
+    return sum_sq == 0 ? 1.0 : sum * sum / (n * sum_sq);
+}
+
+static void report(uint64_t duration) {
+    printf("%u tasks, %.3f s simulated, tick %d us\n\n", task_count, duration / 1e6, TICK_US);
+    printf("%-14s %6s %7s %8s %10s %10s %10s %10s\n", "class", "tasks", "cpu%", "fairness",
+           "lat p50", "lat p95", "lat p99", "lat max");
+    for (uint32_t i = 0; i < class_count; i++) {
+        struct task_class *class = &classes[i];
+        for (uint32_t j = 0; j < task_count; j++)
+            if (tasks[j].class == class)
+                class->cpu_time += tasks[j].cpu_time;
+        struct samples *lat = &class->latency;
+        qsort(lat->values, lat->count, sizeof(*lat->values), compare_u64);
+        printf("%-14s %6u %6.2f%% %8.4f %8lluus %8lluus %8lluus %8lluus\n", class->name,
+               class->tasks, 100.0 * class->cpu_time / duration, class_fairness(class),
+               (unsigned long long)percentile(lat, 50), (unsigned long long)percentile(lat, 95),
+               (unsigned long long)percentile(lat, 99), (unsigned long long)percentile(lat, 100));
+    }
+
+    struct samples *pick = &stats.pick_ns;
+    uint64_t pick_total = 0;
+    for (size_t i = 0; i < pick->count; i++)
+        pick_total += pick->values[i];
+    qsort(pick->values, pick->count, sizeof(*pick->values), compare_u64);
+
+    printf("\nswitches %llu (%.1f/s), preemptions %llu, blocks %llu, idle %.2f%%\n",
+           (unsigned long long)stats.switches, stats.switches / (duration / 1e6),
+           (unsigned long long)stats.preemptions, (unsigned long long)stats.blocks,
+           100.0 * stats.idle_time / duration);
+    printf("pick: %llu calls, %.1f queued on average, mean %.0f ns, p99 %llu ns\n",
+           (unsigned long long)stats.picks,
+           stats.picks ? (double)stats.queued_at_pick / stats.picks : 0.0,
+           pick->count ? (double)pick_total / pick->count : 0.0,
+           (unsigned long long)percentile(pick, 99));
+}
+
+static void usage(void) {
+    fprintf(stderr,
+            "usage: schedsim [-w cpu|interactive|bursty|mixed] [-n tasks] [-f trace]\n"
+            "                [-t duration_ms] [-s seed]\n");
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    const char *workload = "mixed";
+    const char *trace = NULL;
+    uint32_t n = 64;
+    uint64_t duration_ms = 10000;
+
+    for (int i = 1; i < argc; i++) {
+        if (argv[i][0] != '-' || argv[i][1] == '\0' || argv[i][2] != '\0' || i + 1 == argc)
+            usage();
+        const char *arg = argv[++i];
+        switch (argv[i - 1][1]) {
+        case 'w': workload = arg; break;
+        case 'f': trace = arg; break;
+        case 'n': n = (uint32_t)strtoul(arg, NULL, 10); break;
+        case 't': duration_ms = strtoull(arg, NULL, 10); break;
+        case 's': rng_state = (uint32_t)strtoul(arg, NULL, 10) | 1; break;
+        default: usage();
+        }
+    }
+
+    if (trace != NULL ? !workload_trace(trace) : !workload_synthetic(workload, n))
+        usage();
+    if (task_count == 0 || duration_ms == 0)
+        usage();
+
+    simulate(duration_ms * 1000);
+    report(duration_ms * 1000);
+    return 0;
+}
@@ -4,7 +4,37 @@
 #include <stdint.h>
 #define WRITE(STR) write(1, STR, strlen(STR))
 #define WRITEC(C) write(1, &C, 1)
+
+#ifdef DZOS_BOOT_BENCHMARKS
+#define SYSCALL_BENCH_ROUNDS 100000
+
+static inline uint64_t rdtsc(void) {
+    uint32_t lo, hi;
+    __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+/**
+ * Average TSC cycles of a syscall round trip, measured with time() which
+ * does almost nothing in the kernel. The FPU is used first so its state
+ * is live, like in any program doing floating point math.
+ */
+static void bench_syscall_round_trip(void) {
+    volatile double warm = 1.0;
+    warm *= 2.0;
+    time();
+    uint64_t start = rdtsc();
+    for (int i = 0; i < SYSCALL_BENCH_ROUNDS; i++)
+        time();
+    uint64_t cycles = rdtsc() - start;
+    printf("[bench] syscall round trip: %llu cycles\n", cycles / SYSCALL_BENCH_ROUNDS);
+}
+#endif
+
 int main(int argc, char** argv) {
+#ifdef DZOS_BOOT_BENCHMARKS
+    bench_syscall_round_trip();
+#endif
     int i = 737;
     int j = 2;
     double start = (double)time();
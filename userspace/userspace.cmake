@@ -19,6 +19,9 @@ macro(add_userspace_prog NAME)
     )
 
     set_optimizations(${NAME})
+    if(DZOS_BOOT_BENCHMARKS)
+        target_compile_definitions(${NAME} PRIVATE DZOS_BOOT_BENCHMARKS)
+    endif()
 
     target_link_options(${NAME} PRIVATE
         -static -nostdlib